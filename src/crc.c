@@ -0,0 +1,238 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC_HW
+#endif
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Checksummed records.
+ *
+ * A CRC element frames a record of any kind: the tag, the 8-byte length
+ * of the rest, the 4-byte CRC32C of the record, and the record.  The
+ * lengths and the checksum are big-endian.  The checksum is verified
+ * before anything in the record is parsed, so that a damaged length
+ * cannot send the parser astray.
+ *
+ * CRC32C is computed with the SSE4.2 crc32 instruction where the CPU
+ * has it, eight bytes at a time, and with slicing-by-8 tables
+ * otherwise.
+ */
+
+#define CRC_POLY 0x82f63b78u
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_table[8][256];
+#ifdef CRC_HW
+static int crc_hw;
+#endif
+
+
+static void
+crc_once_init(void)
+{
+    unsigned i, j;
+
+    for (i = 0; i < 256; ++i) {
+        uint32_t c = i;
+
+        for (j = 0; j < 8; ++j) {
+            c = (c >> 1) ^ (c & 1 ? CRC_POLY : 0);
+        }
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; ++i) {
+        for (j = 1; j < 8; ++j) {
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+                              crc_table[0][crc_table[j - 1][i] & 0xff];
+        }
+    }
+#ifdef CRC_HW
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+
+static uint32_t
+crc_sw(uint32_t c, const unsigned char *p, size_t sz)
+{
+    while (sz >= 8) {
+        uint32_t lo = c ^ ((uint32_t)p[0] |
+                           (uint32_t)p[1] << 8 |
+                           (uint32_t)p[2] << 16 |
+                           (uint32_t)p[3] << 24);
+
+        c = crc_table[7][lo & 0xff] ^
+            crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^
+            crc_table[4][lo >> 24] ^
+            crc_table[3][p[4]] ^
+            crc_table[2][p[5]] ^
+            crc_table[1][p[6]] ^
+            crc_table[0][p[7]];
+        p += 8;
+        sz -= 8;
+    }
+    while (sz > 0) {
+        c = (c >> 8) ^ crc_table[0][(c ^ *p) & 0xff];
+        ++p;
+        --sz;
+    }
+    return c;
+}
+
+
+#ifdef CRC_HW
+__attribute__((target("sse4.2"))) static uint32_t
+crc_sse42(uint32_t c, const unsigned char *p, size_t sz)
+{
+    uint64_t c64 = c;
+
+    while (sz >= 8) {
+        uint64_t w;
+
+        memcpy(&w, p, sizeof(w));
+        c64 = _mm_crc32_u64(c64, w);
+        p += 8;
+        sz -= 8;
+    }
+    c = (uint32_t)c64;
+    while (sz > 0) {
+        c = _mm_crc32_u8(c, *p);
+        ++p;
+        --sz;
+    }
+    return c;
+}
+#endif
+
+
+/*
+ * CRC32C of sz bytes at buf, continuing crc, the checksum of what
+ * precedes them, or 0 to start.
+ */
+uint32_t
+mrkdata_crc32c(uint32_t crc, const void *buf, size_t sz)
+{
+    pthread_once(&crc_once, crc_once_init);
+
+#ifdef CRC_HW
+    if (crc_hw) {
+        return ~crc_sse42(~crc, buf, sz);
+    }
+#endif
+    return ~crc_sw(~crc, buf, sz);
+}
+
+
+/*
+ * Frame the record of sz bytes at buf + MRKDATA_CRC_HDRSZ, writing the
+ * header in front of it.  Return the size of the framed record.
+ */
+ssize_t
+mrkdata_crc_seal(unsigned char *buf, ssize_t sz)
+{
+    unsigned char *rec = buf + MRKDATA_CRC_HDRSZ;
+
+    buf[0] = MRKDATA_CRC;
+    *((uint64_t *)(buf + 1)) = htobe64(sz + sizeof(uint32_t));
+    *((uint32_t *)(buf + MRKDATA_EXPECT_SZ(MRKDATA_CRC))) =
+        htobe32(mrkdata_crc32c(0, rec, sz));
+    return MRKDATA_CRC_HDRSZ + sz;
+}
+
+
+/*
+ * Pack dat as a CRC record.  Return its size, or 0.
+ */
+ssize_t
+mrkdata_crc_pack_datum(const mrkdata_datum_t *dat,
+                       unsigned char *buf,
+                       ssize_t sz)
+{
+    ssize_t nwritten;
+
+    if (sz < MRKDATA_CRC_HDRSZ + dat->packsz) {
+        MRKDATA_STATS_ERROR(MRKDATA_CRC_PACK_DATUM + 1);
+        return 0;
+    }
+    if ((nwritten = mrkdata_pack_datum(dat,
+                                       buf + MRKDATA_CRC_HDRSZ,
+                                       sz - MRKDATA_CRC_HDRSZ)) == 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_CRC_PACK_DATUM + 2);
+        return 0;
+    }
+    return mrkdata_crc_seal(buf, nwritten);
+}
+
+
+/*
+ * Verify the CRC record at buf.  Return the record it frames, with its
+ * size in *psz, or NULL if the frame does not fit in sz or the checksum
+ * does not match.
+ */
+const unsigned char *
+mrkdata_crc_open(const unsigned char *buf, ssize_t sz, ssize_t *psz)
+{
+    uint64_t len;
+    uint32_t crc;
+    const unsigned char *rec;
+
+    if (sz < MRKDATA_CRC_HDRSZ || buf[0] != MRKDATA_CRC) {
+        MRKDATA_STATS_ERROR(MRKDATA_CRC_OPEN + 1);
+        return NULL;
+    }
+    len = be64toh(*((const uint64_t *)(buf + 1)));
+    if (len < sizeof(uint32_t) ||
+        len > (uint64_t)(sz - MRKDATA_EXPECT_SZ(MRKDATA_CRC))) {
+        MRKDATA_STATS_ERROR(MRKDATA_CRC_OPEN + 2);
+        return NULL;
+    }
+    crc = be32toh(*((const uint32_t *)
+                    (buf + MRKDATA_EXPECT_SZ(MRKDATA_CRC))));
+    rec = buf + MRKDATA_CRC_HDRSZ;
+    if (mrkdata_crc32c(0, rec, len - sizeof(uint32_t)) != crc) {
+        MRKDATA_STATS_ERROR(MRKDATA_CRC_OPEN + 3);
+        return NULL;
+    }
+    *psz = len - sizeof(uint32_t);
+    return rec;
+}
+
+
+/*
+ * Verify the CRC record at buf, and unpack the plain record it frames
+ * into *pdat.  Return the size of the CRC record, or 0.
+ */
+ssize_t
+mrkdata_crc_unpack_buf(const mrkdata_spec_t *spec,
+                       const unsigned char *buf,
+                       ssize_t sz,
+                       mrkdata_datum_t **pdat)
+{
+    const unsigned char *rec;
+    ssize_t recsz;
+
+    assert(pdat != NULL);
+
+    if ((rec = mrkdata_crc_open(buf, sz, &recsz)) == NULL) {
+        MRKDATA_STATS_ERROR(MRKDATA_CRC_UNPACK_BUF + 1);
+        return 0;
+    }
+    if (mrkdata_unpack_buf(spec, rec, recsz, pdat) != recsz) {
+        MRKDATA_STATS_ERROR(MRKDATA_CRC_UNPACK_BUF + 2);
+        return 0;
+    }
+    return MRKDATA_CRC_HDRSZ + recsz;
+}
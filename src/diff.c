@@ -0,0 +1,470 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Patches between two datums of the same spec.
+ *
+ * A patch is a list of operations on the elements of a plain record,
+ * each addressed by its path from the top, ended by DIFF_END:
+ *
+ *  - the operation byte;
+ *  - the depth of the path, one byte, and the path, big-endian 4-byte
+ *    field or item indexes;
+ *  - DIFF_SET: the new element, packed, in place of the one at the
+ *    path;
+ *  - DIFF_ADD: an item, packed, appended to the SEQ at the path;
+ *  - DIFF_TRUNC: the big-endian 8-byte number of items the SEQ at the
+ *    path is cut down to.
+ *
+ * STRUCTs are compared field by field, SEQs item by item up to the
+ * shorter one.  A container whose operations would take more room than
+ * the container itself is set as a whole.
+ */
+
+#define DIFF_END 0
+#define DIFF_SET 1
+#define DIFF_ADD 2
+#define DIFF_TRUNC 3
+
+#define DIFF_OPSZ(depth) (2 + sizeof(uint32_t) * (depth))
+
+typedef struct _diff {
+    /* NULL to only count */
+    unsigned char *buf;
+    ssize_t sz;
+    ssize_t pos;
+    unsigned path[MRKDATA_MAXDEPTH];
+} diff_t;
+
+typedef struct _diff_op {
+    unsigned op;
+    unsigned depth;
+    unsigned path[MRKDATA_MAXDEPTH];
+    const unsigned char *value;
+    ssize_t valuesz;
+    uint64_t n;
+} diff_op_t;
+
+
+/*
+ * Write the operation header.  Past the end of the buffer, only count.
+ */
+static void
+diff_op(diff_t *d, unsigned op, unsigned depth)
+{
+    if (d->buf != NULL && d->pos + (ssize_t)DIFF_OPSZ(depth) <= d->sz) {
+        unsigned char *p = d->buf + d->pos;
+        unsigned i;
+
+        p[0] = op;
+        p[1] = depth;
+        for (i = 0; i < depth; ++i) {
+            *((uint32_t *)(p + 2) + i) = htobe32(d->path[i]);
+        }
+    }
+    d->pos += DIFF_OPSZ(depth);
+}
+
+
+static int
+diff_value(diff_t *d, unsigned op, unsigned depth, const mrkdata_datum_t *dat)
+{
+    diff_op(d, op, depth);
+    if (d->buf != NULL && d->pos + dat->packsz <= d->sz) {
+        if (mrkdata_pack_elem(dat,
+                              d->buf + d->pos,
+                              d->sz - d->pos) != dat->packsz) {
+            return -1;
+        }
+    }
+    d->pos += dat->packsz;
+    return 0;
+}
+
+
+static int
+diff_elem(diff_t *d,
+          const mrkdata_datum_t *a,
+          const mrkdata_datum_t *b,
+          unsigned depth)
+{
+    mrkdata_tag_t tag;
+    ssize_t start;
+    unsigned i, na, nb;
+
+    if (a == b) {
+        return 0;
+    }
+    if (a == NULL || b == NULL || a->spec->tag != b->spec->tag) {
+        return -1;
+    }
+    /* unpacked from the same bytes and unchanged since, see mrkdata.c */
+    if (a->packed != NULL && a->packed == b->packed) {
+        return 0;
+    }
+
+    tag = a->spec->tag;
+    if (tag != MRKDATA_STRUCT && tag != MRKDATA_SEQ) {
+        if (mrkdata_datum_cmp(a, b) == 0) {
+            return 0;
+        }
+        return diff_value(d, DIFF_SET, depth, b);
+    }
+
+    na = a->data.fields.elnum;
+    nb = b->data.fields.elnum;
+    if (depth == MRKDATA_MAXDEPTH || (tag == MRKDATA_STRUCT && na != nb)) {
+        return diff_value(d, DIFF_SET, depth, b);
+    }
+
+    start = d->pos;
+    for (i = 0; i < MIN(na, nb); ++i) {
+        d->path[depth] = i;
+        if (diff_elem(d,
+                      *(mrkdata_datum_t **)array_get(&a->data.fields, i),
+                      *(mrkdata_datum_t **)array_get(&b->data.fields, i),
+                      depth + 1) != 0) {
+            return -1;
+        }
+    }
+    for (i = na; i < nb; ++i) {
+        if (diff_value(d,
+                       DIFF_ADD,
+                       depth,
+                       *(mrkdata_datum_t **)array_get(&b->data.fields,
+                                                      i)) != 0) {
+            return -1;
+        }
+    }
+    if (nb < na) {
+        diff_op(d, DIFF_TRUNC, depth);
+        if (d->buf != NULL && d->pos + (ssize_t)sizeof(uint64_t) <= d->sz) {
+            *((uint64_t *)(d->buf + d->pos)) = htobe64(nb);
+        }
+        d->pos += sizeof(uint64_t);
+    }
+
+    if (d->pos - start > (ssize_t)DIFF_OPSZ(depth) + b->packsz) {
+        d->pos = start;
+        return diff_value(d, DIFF_SET, depth, b);
+    }
+    return 0;
+}
+
+
+/*
+ * Write the patch that turns a into b, of the same spec, to buf.  With
+ * no buffer, only count.  Return the size of the patch, or 0.
+ */
+ssize_t
+mrkdata_diff(const mrkdata_datum_t *a,
+             const mrkdata_datum_t *b,
+             unsigned char *buf,
+             ssize_t sz)
+{
+    diff_t d;
+
+    d.buf = buf;
+    d.sz = sz;
+    d.pos = 0;
+
+    if (diff_elem(&d, a, b, 0) != 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_DIFF + 1);
+        return 0;
+    }
+    if (d.buf != NULL && d.pos < d.sz) {
+        d.buf[d.pos] = DIFF_END;
+    }
+    ++d.pos;
+
+    if (buf != NULL && d.pos > sz) {
+        MRKDATA_STATS_ERROR(MRKDATA_DIFF + 2);
+        return 0;
+    }
+    return d.pos;
+}
+
+
+/*
+ * Read the operation at p.  Return its size, or 0.
+ */
+static ssize_t
+patch_op(const unsigned char *p, ssize_t sz, diff_op_t *op)
+{
+    ssize_t hdrsz;
+    unsigned i;
+
+    if (sz < 1) {
+        return 0;
+    }
+    op->op = p[0];
+    if (op->op == DIFF_END) {
+        return 1;
+    }
+    if (sz < 2 ||
+        (op->depth = p[1]) > MRKDATA_MAXDEPTH ||
+        sz < (hdrsz = DIFF_OPSZ(op->depth))) {
+        return 0;
+    }
+    for (i = 0; i < op->depth; ++i) {
+        op->path[i] = be32toh(*((const uint32_t *)(p + 2) + i));
+    }
+
+    switch (op->op) {
+    case DIFF_SET:
+    case DIFF_ADD:
+        op->value = p + hdrsz;
+        if ((op->valuesz = mrkdata_buf_size(op->value, sz - hdrsz)) <= 0 ||
+            op->valuesz > sz - hdrsz) {
+            return 0;
+        }
+        return hdrsz + op->valuesz;
+
+    case DIFF_TRUNC:
+        if (sz - hdrsz < (ssize_t)sizeof(uint64_t)) {
+            return 0;
+        }
+        op->n = be64toh(*((const uint64_t *)(p + hdrsz)));
+        return hdrsz + sizeof(uint64_t);
+
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * The datum at path below dat, or NULL.
+ */
+static mrkdata_datum_t *
+patch_get(mrkdata_datum_t *dat, const unsigned *path, unsigned depth)
+{
+    unsigned i;
+
+    for (i = 0; i < depth && dat != NULL; ++i) {
+        if (dat->spec->tag != MRKDATA_STRUCT &&
+            dat->spec->tag != MRKDATA_SEQ) {
+            return NULL;
+        }
+        dat = mrkdata_datum_get_field(dat, path[i]);
+    }
+    return dat;
+}
+
+
+/*
+ * Apply patch to *pdat.  Only the datums on the paths of the patch get
+ * copied if shared, see mrkdata_datum_set_path().  On error, *pdat may
+ * be partly patched.
+ */
+int
+mrkdata_patch_datum(mrkdata_datum_t **pdat,
+                    const unsigned char *patch,
+                    ssize_t sz)
+{
+    const unsigned char *end = patch + sz;
+    diff_op_t op;
+    ssize_t opsz;
+
+    while ((opsz = patch_op(patch, end - patch, &op)) > 0) {
+        mrkdata_datum_t *target, *value = NULL;
+        const mrkdata_spec_t *spec;
+
+        patch += opsz;
+        if (op.op == DIFF_END) {
+            if (patch != end) {
+                TRRET(MRKDATA_PATCH_DATUM + 1);
+            }
+            return 0;
+        }
+
+        if ((target = patch_get(*pdat, op.path, op.depth)) == NULL) {
+            TRRET(MRKDATA_PATCH_DATUM + 2);
+        }
+
+        if (op.op == DIFF_TRUNC) {
+            if (mrkdata_datum_trunc_path(pdat,
+                                         op.path,
+                                         op.depth,
+                                         op.n) != 0) {
+                TRRET(MRKDATA_PATCH_DATUM + 3);
+            }
+            continue;
+        }
+
+        if (op.op == DIFF_SET) {
+            spec = target->spec;
+        } else if (target->spec->tag == MRKDATA_SEQ &&
+                   target->spec->fields.elnum > 0) {
+            spec = *(mrkdata_spec_t **)array_get(&target->spec->fields, 0);
+        } else {
+            TRRET(MRKDATA_PATCH_DATUM + 2);
+        }
+
+        if (mrkdata_unpack_elem(spec,
+                                op.value,
+                                op.valuesz,
+                                &value) != op.valuesz) {
+            mrkdata_datum_destroy(&value);
+            TRRET(MRKDATA_PATCH_DATUM + 4);
+        }
+        if ((op.op == DIFF_SET ?
+             mrkdata_datum_set_path(pdat, op.path, op.depth, value) :
+             mrkdata_datum_add_path(pdat, op.path, op.depth, value)) != 0) {
+            TRRET(MRKDATA_PATCH_DATUM + 3);
+        }
+    }
+
+    TRRET(MRKDATA_PATCH_DATUM + 1);
+}
+
+
+/*
+ * Replace the oldsz bytes at off with the newsz bytes at value, moving
+ * the rest of the record.
+ */
+static int
+patch_splice(unsigned char *buf,
+             ssize_t *psz,
+             ssize_t bufsz,
+             ssize_t off,
+             ssize_t oldsz,
+             const unsigned char *value,
+             ssize_t newsz)
+{
+    if (*psz - oldsz + newsz > bufsz) {
+        return -1;
+    }
+    memmove(buf + off + newsz, buf + off + oldsz, *psz - off - oldsz);
+    if (newsz > 0) {
+        memcpy(buf + off, value, newsz);
+    }
+    *psz += newsz - oldsz;
+    return 0;
+}
+
+
+/*
+ * Apply patch to the plain record of sz bytes in place, in a buffer of
+ * bufsz.  Return the new size of the record, or 0.  On error, the record
+ * may be partly patched.
+ */
+ssize_t
+mrkdata_patch_buf(unsigned char *buf,
+                  ssize_t sz,
+                  ssize_t bufsz,
+                  const unsigned char *patch,
+                  ssize_t psz)
+{
+    const unsigned char *end = patch + psz;
+    diff_op_t op;
+    ssize_t opsz;
+
+    while ((opsz = patch_op(patch, end - patch, &op)) > 0) {
+        /* the elements on the path, and the sizes of the last one */
+        ssize_t spine[MRKDATA_MAXDEPTH + 1];
+        ssize_t elemsz, delta, off;
+        unsigned i, ncont;
+
+        patch += opsz;
+        if (op.op == DIFF_END) {
+            if (patch != end) {
+                break;
+            }
+            return sz;
+        }
+
+        spine[0] = 0;
+        if ((elemsz = mrkdata_buf_size(buf, sz)) <= 0 || elemsz != sz) {
+            break;
+        }
+        for (i = 0; i < op.depth; ++i) {
+            const unsigned char *field;
+
+            if (buf[spine[i]] != MRKDATA_STRUCT &&
+                buf[spine[i]] != MRKDATA_SEQ) {
+                break;
+            }
+            if ((field = mrkdata_buf_get_field(buf + spine[i],
+                                               elemsz,
+                                               op.path[i],
+                                               &elemsz)) == NULL) {
+                break;
+            }
+            spine[i + 1] = field - buf;
+        }
+        if (i < op.depth) {
+            break;
+        }
+
+        off = spine[op.depth];
+        switch (op.op) {
+        case DIFF_SET:
+            if (op.value[0] != buf[off] ||
+                patch_splice(buf, &sz, bufsz, off, elemsz,
+                             op.value, op.valuesz) != 0) {
+                goto err;
+            }
+            delta = op.valuesz - elemsz;
+            ncont = op.depth;
+            break;
+
+        case DIFF_ADD:
+            if (buf[off] != MRKDATA_SEQ ||
+                patch_splice(buf, &sz, bufsz, off + elemsz, 0,
+                             op.value, op.valuesz) != 0) {
+                goto err;
+            }
+            delta = op.valuesz;
+            ncont = op.depth + 1;
+            break;
+
+        default:
+            {
+                const unsigned char *item, *seqend;
+                ssize_t itemsz;
+                uint64_t n;
+
+                if (buf[off] != MRKDATA_SEQ) {
+                    goto err;
+                }
+                item = buf + off + MRKDATA_EXPECT_SZ(MRKDATA_SEQ);
+                seqend = buf + off + elemsz;
+                for (n = 0; n < op.n; ++n) {
+                    if ((itemsz = mrkdata_buf_size(item,
+                                                   seqend - item)) <= 0 ||
+                        itemsz > seqend - item) {
+                        goto err;
+                    }
+                    item += itemsz;
+                }
+                delta = -(seqend - item);
+                if (patch_splice(buf, &sz, bufsz, item - buf,
+                                 seqend - item, NULL, 0) != 0) {
+                    goto err;
+                }
+                ncont = op.depth + 1;
+            }
+        }
+
+        /* the containers on the path */
+        for (i = 0; i < ncont; ++i) {
+            int64_t *len = (int64_t *)(buf + spine[i] + 1);
+
+            *len = htobe64(be64toh(*len) + delta);
+        }
+    }
+
+err:
+    MRKDATA_STATS_ERROR(MRKDATA_PATCH_BUF + 1);
+    return 0;
+}
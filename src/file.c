@@ -0,0 +1,1226 @@
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <unistd.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Indexed record file layout:
+ *
+ *  - blocks of packed records, a record never spans two blocks;
+ *  - the index, itself a packed record of index_spec:
+ *
+ *      STRUCT {
+ *          UINT32 version,
+ *          SEQ<UINT32> indexed fields,
+ *          SEQ<UINT8> sorted flags,
+ *          SEQ<STRUCT {
+ *              UINT64 offset,
+ *              UINT64 size,
+ *              UINT64 nrecs,
+ *              SEQ<UINT64> min and max, per indexed field,
+ *          }> blocks,
+ *          SEQ<UINT32> fields with Bloom filters,
+ *          SEQ<STR64> filters, one per block,
+ *          SEQ<UINT32> checksums, one per block, or none,
+ *      }
+ *
+ *  - the trailer: big-endian index offset and size, and FILE_MAGIC.
+ *    With checksums, it starts with the big-endian CRC32C of the index,
+ *    zero-extended to 64 bits, and ends with FILE_MAGIC_CRC instead.
+ *
+ * Min and max are the order-preserving keys of the fields zero-extended
+ * to 64 bits, so that all numeric tags compare as unsigned integers.
+ *
+ * The filters of a block are bloomsz bytes each, concatenated in the
+ * order of the fields.  A filter has FILE_BLOOM_BITS bits per record,
+ * FILE_BLOOM_K of which are set per field value, from the hash of the
+ * packed field, see mrkdata_buf_hash().  Version 1 indexes have no
+ * filters.
+ *
+ * A checksum is the CRC32C of the whole block, see mrkdata_crc32c(),
+ * verified whenever the block is read.  Indexes before version 3 have
+ * no checksums.  The checksum of the index is verified before it is
+ * unpacked.
+ */
+
+#define FILE_MAGIC "MRKDIDX1"
+#define FILE_MAGIC_CRC "MRKDIDX2"
+#define FILE_VERSION 3
+#define FILE_BLOOM_BITS 10
+#define FILE_BLOOM_K 7
+#define FILE_TRAILER_SZ (2 * sizeof(uint64_t) + 8)
+#define FILE_TRAILER_CRC_SZ (FILE_TRAILER_SZ + sizeof(uint64_t))
+#define FILE_INDEX_MAXSZ (1ull << 32)
+
+/* fixed-size numeric tags, the only ones that can be indexed */
+#define FILE_TAG_INDEXABLE(t) ((t) <= MRKDATA_DOUBLE)
+
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+static mrkdata_spec_t *index_spec_v1;
+static mrkdata_spec_t *index_spec_v2;
+static mrkdata_spec_t *index_spec;
+
+
+static void
+index_spec_init(void)
+{
+    mrkdata_spec_t *seq, *fields, *block, **field;
+    mnarray_iter_t it;
+
+    index_spec_v1 = mrkdata_make_spec(MRKDATA_STRUCT);
+    mrkdata_spec_add_field(index_spec_v1, mrkdata_make_spec(MRKDATA_UINT32));
+
+    fields = mrkdata_make_spec(MRKDATA_SEQ);
+    mrkdata_spec_add_field(fields, mrkdata_make_spec(MRKDATA_UINT32));
+    mrkdata_spec_add_field(index_spec_v1, fields);
+
+    seq = mrkdata_make_spec(MRKDATA_SEQ);
+    mrkdata_spec_add_field(seq, mrkdata_make_spec(MRKDATA_UINT8));
+    mrkdata_spec_add_field(index_spec_v1, seq);
+
+    block = mrkdata_make_spec(MRKDATA_STRUCT);
+    mrkdata_spec_add_field(block, mrkdata_make_spec(MRKDATA_UINT64));
+    mrkdata_spec_add_field(block, mrkdata_make_spec(MRKDATA_UINT64));
+    mrkdata_spec_add_field(block, mrkdata_make_spec(MRKDATA_UINT64));
+    seq = mrkdata_make_spec(MRKDATA_SEQ);
+    mrkdata_spec_add_field(seq, mrkdata_make_spec(MRKDATA_UINT64));
+    mrkdata_spec_add_field(block, seq);
+
+    seq = mrkdata_make_spec(MRKDATA_SEQ);
+    mrkdata_spec_add_field(seq, block);
+    mrkdata_spec_add_field(index_spec_v1, seq);
+
+    /* version 2 adds the filters */
+    index_spec_v2 = mrkdata_make_spec(MRKDATA_STRUCT);
+    for (field = array_first(&index_spec_v1->fields, &it);
+         field != NULL;
+         field = array_next(&index_spec_v1->fields, &it)) {
+        mrkdata_spec_add_field(index_spec_v2, *field);
+    }
+    mrkdata_spec_add_field(index_spec_v2, fields);
+    seq = mrkdata_make_spec(MRKDATA_SEQ);
+    mrkdata_spec_add_field(seq, mrkdata_make_spec(MRKDATA_STR64));
+    mrkdata_spec_add_field(index_spec_v2, seq);
+
+    /* version 3 adds the checksums */
+    index_spec = mrkdata_make_spec(MRKDATA_STRUCT);
+    for (field = array_first(&index_spec_v2->fields, &it);
+         field != NULL;
+         field = array_next(&index_spec_v2->fields, &it)) {
+        mrkdata_spec_add_field(index_spec, *field);
+    }
+    mrkdata_spec_add_field(index_spec, fields);
+}
+
+
+static uint64_t
+key_fold(const unsigned char *key, ssize_t sz)
+{
+    uint64_t res = 0;
+    ssize_t i;
+
+    for (i = 0; i < sz; ++i) {
+        res = (res << 8) | key[i];
+    }
+    return res;
+}
+
+
+/*
+ * Key of the field idx of the packed STRUCT rec.
+ */
+static int
+rec_key(const unsigned char *rec, ssize_t sz, unsigned idx, uint64_t *pkey)
+{
+    const unsigned char *elem;
+    ssize_t elemsz, keysz;
+    unsigned char key[sizeof(uint64_t)];
+
+    if ((elem = mrkdata_buf_get_field(rec, sz, idx, &elemsz)) == NULL) {
+        return -1;
+    }
+    if (!FILE_TAG_INDEXABLE(elem[0])) {
+        return -1;
+    }
+    if ((keysz = mrkdata_key_encode_buf(elem,
+                                        elemsz,
+                                        key,
+                                        sizeof(key))) < 0) {
+        return -1;
+    }
+    *pkey = key_fold(key, keysz);
+    return 0;
+}
+
+
+/*
+ * Bloom filter bits come from the two halves of the hash, see Kirsch
+ * and Mitzenmacher, "Less Hashing, Same Performance".
+ */
+static void
+bloom_add(unsigned char *filter, uint64_t nbits, uint64_t h)
+{
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32);
+    unsigned i;
+
+    for (i = 0; i < FILE_BLOOM_K; ++i) {
+        uint64_t bit = (h1 + (uint64_t)i * h2) % nbits;
+
+        filter[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+
+static int
+bloom_check(const unsigned char *filter, uint64_t nbits, uint64_t h)
+{
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32);
+    unsigned i;
+
+    for (i = 0; i < FILE_BLOOM_K; ++i) {
+        uint64_t bit = (h1 + (uint64_t)i * h2) % nbits;
+
+        if (!(filter[bit >> 3] & (1 << (bit & 7)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static int
+write_all(int fd, const unsigned char *buf, ssize_t sz)
+{
+    ssize_t nwritten;
+
+    while (sz > 0) {
+        if ((nwritten = write(fd, buf, sz)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nwritten;
+        sz -= nwritten;
+    }
+    return 0;
+}
+
+
+static int
+pread_all(int fd, unsigned char *buf, ssize_t sz, off_t offset)
+{
+    ssize_t nread;
+
+    while (sz > 0) {
+        if ((nread = pread(fd, buf, sz, offset)) <= 0) {
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nread;
+        sz -= nread;
+        offset += nread;
+    }
+    return 0;
+}
+
+
+/* writer */
+
+static void
+fwriter_block_reset(mrkdata_fwriter_t *w)
+{
+    memset(&w->cur, '\0', sizeof(w->cur));
+    w->cur.offset = w->offset;
+    w->pos = 0;
+}
+
+
+/*
+ * Build the filters of the current block from the hashes of its
+ * records.
+ */
+static void
+fwriter_blooms(mrkdata_fwriter_t *w)
+{
+    uint64_t i, nbits;
+    unsigned j;
+    unsigned char *filter;
+
+    if (w->nbloom == 0) {
+        return;
+    }
+
+    w->cur.bloomsz = (w->cur.nrecs * FILE_BLOOM_BITS + 7) / 8;
+    w->cur.bloomoff = w->bloomssz;
+    nbits = w->cur.bloomsz * 8;
+
+    w->bloomssz += w->nbloom * w->cur.bloomsz;
+    if ((w->blooms = realloc(w->blooms, w->bloomssz)) == NULL) {
+        FAIL("realloc");
+    }
+    filter = w->blooms + w->cur.bloomoff;
+    memset(filter, '\0', w->nbloom * w->cur.bloomsz);
+
+    for (j = 0; j < w->nbloom; ++j) {
+        for (i = 0; i < w->cur.nrecs; ++i) {
+            bloom_add(filter, nbits, w->hashes[i * w->nbloom + j]);
+        }
+        filter += w->cur.bloomsz;
+    }
+}
+
+
+static int
+fwriter_flush(mrkdata_fwriter_t *w)
+{
+    mrkdata_fblock_t *block;
+
+    if (w->pos == 0) {
+        return 0;
+    }
+
+    if (w->crc) {
+        w->cur.crc = mrkdata_crc32c(0, w->buf, w->pos);
+    }
+
+    if (write_all(w->fd, w->buf, w->pos) != 0) {
+        return -1;
+    }
+
+    if ((block = array_incr(&w->blocks)) == NULL) {
+        FAIL("array_incr");
+    }
+    w->cur.size = w->pos;
+    fwriter_blooms(w);
+    *block = w->cur;
+    w->offset += w->pos;
+    fwriter_block_reset(w);
+    return 0;
+}
+
+
+/*
+ * Make room for a record of sz at w->pos, starting a new block if the
+ * record does not fit in this one.  A record larger than blocksz gets a
+ * block of its own.
+ */
+static int
+fwriter_reserve(mrkdata_fwriter_t *w, ssize_t sz)
+{
+    if (w->pos > 0 && w->pos + sz > w->blocksz) {
+        if (fwriter_flush(w) != 0) {
+            return -1;
+        }
+    }
+
+    if (w->pos + sz > w->bufsz) {
+        if ((w->buf = realloc(w->buf, w->pos + sz)) == NULL) {
+            FAIL("realloc");
+        }
+        w->bufsz = w->pos + sz;
+    }
+    return 0;
+}
+
+
+/*
+ * Index the record already placed at w->buf + w->pos, and account it.
+ */
+static int
+fwriter_commit(mrkdata_fwriter_t *w, ssize_t sz)
+{
+    unsigned i;
+    uint64_t keys[MRKDATA_FILE_MAXINDEX];
+    uint64_t hashes[MRKDATA_FILE_MAXBLOOM];
+
+    for (i = 0; i < w->nindex; ++i) {
+        if (rec_key(w->buf + w->pos, sz, w->index[i], &keys[i]) != 0) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < w->nbloom; ++i) {
+        const unsigned char *elem;
+        ssize_t elemsz;
+
+        if ((elem = mrkdata_buf_get_field(w->buf + w->pos,
+                                          sz,
+                                          w->bloom[i],
+                                          &elemsz)) == NULL) {
+            return -1;
+        }
+        hashes[i] = mrkdata_buf_hash(elem, elemsz, 0);
+    }
+
+    if (w->nbloom > 0) {
+        if ((w->cur.nrecs + 1) * w->nbloom > w->hashessz) {
+            w->hashessz = (w->cur.nrecs + 1) * w->nbloom * 2;
+            if ((w->hashes = realloc(w->hashes,
+                                     w->hashessz * sizeof(uint64_t))) == NULL) {
+                FAIL("realloc");
+            }
+        }
+        memcpy(w->hashes + w->cur.nrecs * w->nbloom,
+               hashes,
+               w->nbloom * sizeof(uint64_t));
+    }
+
+    for (i = 0; i < w->nindex; ++i) {
+        if (w->cur.nrecs == 0 || keys[i] < w->cur.min[i]) {
+            w->cur.min[i] = keys[i];
+        }
+        if (w->cur.nrecs == 0 || keys[i] > w->cur.max[i]) {
+            w->cur.max[i] = keys[i];
+        }
+        if (keys[i] < w->prev[i]) {
+            w->sorted[i] = 0;
+        }
+        w->prev[i] = keys[i];
+    }
+
+    ++w->cur.nrecs;
+    w->pos += sz;
+    return 0;
+}
+
+
+int
+mrkdata_fwriter_init(mrkdata_fwriter_t *w,
+                     int fd,
+                     const mrkdata_spec_t *spec,
+                     ssize_t blocksz)
+{
+    if (spec->tag != MRKDATA_STRUCT || blocksz <= 0) {
+        TRRET(MRKDATA_FWRITER_INIT + 1);
+    }
+
+    pthread_once(&index_once, index_spec_init);
+
+    w->fd = fd;
+    w->spec = spec;
+    w->blocksz = blocksz;
+    w->bufsz = blocksz;
+    if ((w->buf = malloc(w->bufsz)) == NULL) {
+        FAIL("malloc");
+    }
+    w->offset = 0;
+    w->nindex = 0;
+    w->nbloom = 0;
+    w->hashes = NULL;
+    w->hashessz = 0;
+    w->blooms = NULL;
+    w->bloomssz = 0;
+    w->crc = 0;
+    if (array_init(&w->blocks, sizeof(mrkdata_fblock_t), 0,
+                   NULL, NULL) != 0) {
+        FAIL("array_init");
+    }
+    fwriter_block_reset(w);
+    return 0;
+}
+
+
+/*
+ * Index the top-level field idx.  Fields can only be added before the
+ * first record is written.
+ */
+int
+mrkdata_fwriter_add_index(mrkdata_fwriter_t *w, unsigned idx)
+{
+    mrkdata_spec_t **field;
+
+    if (w->nindex >= MRKDATA_FILE_MAXINDEX ||
+        w->offset > 0 ||
+        w->pos > 0) {
+        TRRET(MRKDATA_FWRITER_ADD_INDEX + 1);
+    }
+
+    if ((field = array_get(&w->spec->fields, idx)) == NULL ||
+        !FILE_TAG_INDEXABLE((*field)->tag)) {
+        TRRET(MRKDATA_FWRITER_ADD_INDEX + 2);
+    }
+
+    w->index[w->nindex] = idx;
+    w->sorted[w->nindex] = 1;
+    w->prev[w->nindex] = 0;
+    ++w->nindex;
+    return 0;
+}
+
+
+/*
+ * Keep a Bloom filter of the top-level field idx in every block.  Like
+ * indexes, filters can only be added before the first record.
+ */
+int
+mrkdata_fwriter_add_bloom(mrkdata_fwriter_t *w, unsigned idx)
+{
+    if (w->nbloom >= MRKDATA_FILE_MAXBLOOM ||
+        w->offset > 0 ||
+        w->pos > 0) {
+        TRRET(MRKDATA_FWRITER_ADD_BLOOM + 1);
+    }
+
+    if (array_get(&w->spec->fields, idx) == NULL) {
+        TRRET(MRKDATA_FWRITER_ADD_BLOOM + 2);
+    }
+
+    w->bloom[w->nbloom++] = idx;
+    return 0;
+}
+
+
+/*
+ * Checksum every block.  Like indexes, only before the first record.
+ */
+int
+mrkdata_fwriter_add_crc(mrkdata_fwriter_t *w)
+{
+    if (w->offset > 0 || w->pos > 0) {
+        TRRET(MRKDATA_FWRITER_ADD_CRC + 1);
+    }
+
+    w->crc = 1;
+    return 0;
+}
+
+
+int
+mrkdata_fwriter_write(mrkdata_fwriter_t *w, const mrkdata_datum_t *dat)
+{
+    ssize_t sz;
+
+    if (dat->spec != w->spec) {
+        TRRET(MRKDATA_FWRITER_WRITE + 1);
+    }
+
+    if (fwriter_reserve(w, dat->packsz) != 0) {
+        TRRET(MRKDATA_FWRITER_WRITE + 2);
+    }
+
+    if ((sz = mrkdata_pack_datum(dat,
+                                 w->buf + w->pos,
+                                 w->bufsz - w->pos)) <= 0) {
+        TRRET(MRKDATA_FWRITER_WRITE + 3);
+    }
+
+    if (fwriter_commit(w, sz) != 0) {
+        TRRET(MRKDATA_FWRITER_WRITE + 4);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Append a record packed elsewhere.  The record is expected to match
+ * the writer's spec, only its size and the indexed fields are checked.
+ */
+int
+mrkdata_fwriter_write_buf(mrkdata_fwriter_t *w,
+                          const unsigned char *rec,
+                          ssize_t sz)
+{
+    if (mrkdata_buf_size(rec, sz) != sz || rec[0] != MRKDATA_STRUCT) {
+        TRRET(MRKDATA_FWRITER_WRITE_BUF + 1);
+    }
+
+    if (fwriter_reserve(w, sz) != 0) {
+        TRRET(MRKDATA_FWRITER_WRITE_BUF + 2);
+    }
+
+    memcpy(w->buf + w->pos, rec, sz);
+
+    if (fwriter_commit(w, sz) != 0) {
+        TRRET(MRKDATA_FWRITER_WRITE_BUF + 3);
+    }
+
+    return 0;
+}
+
+
+static mrkdata_datum_t *
+fwriter_index(mrkdata_fwriter_t *w)
+{
+    mrkdata_datum_t *dat, *seq, *block, *minmax;
+    mrkdata_spec_t **seqspec;
+    mrkdata_fblock_t *b;
+    mnarray_iter_t it;
+    unsigned i;
+
+    dat = mrkdata_datum_from_spec(index_spec, NULL, 0);
+    mrkdata_datum_add_field(dat, mrkdata_datum_make_u32(FILE_VERSION));
+
+    seqspec = array_get(&index_spec->fields, 1);
+    seq = mrkdata_datum_from_spec(*seqspec, NULL, 0);
+    for (i = 0; i < w->nindex; ++i) {
+        mrkdata_datum_add_field(seq, mrkdata_datum_make_u32(w->index[i]));
+    }
+    mrkdata_datum_add_field(dat, seq);
+
+    seqspec = array_get(&index_spec->fields, 2);
+    seq = mrkdata_datum_from_spec(*seqspec, NULL, 0);
+    for (i = 0; i < w->nindex; ++i) {
+        mrkdata_datum_add_field(seq, mrkdata_datum_make_u8(w->sorted[i]));
+    }
+    mrkdata_datum_add_field(dat, seq);
+
+    seqspec = array_get(&index_spec->fields, 3);
+    seq = mrkdata_datum_from_spec(*seqspec, NULL, 0);
+    for (b = array_first(&w->blocks, &it);
+         b != NULL;
+         b = array_next(&w->blocks, &it)) {
+        mrkdata_spec_t **blockspec, **minmaxspec;
+
+        blockspec = array_get(&(*seqspec)->fields, 0);
+        block = mrkdata_datum_from_spec(*blockspec, NULL, 0);
+        mrkdata_datum_add_field(block, mrkdata_datum_make_u64(b->offset));
+        mrkdata_datum_add_field(block, mrkdata_datum_make_u64(b->size));
+        mrkdata_datum_add_field(block, mrkdata_datum_make_u64(b->nrecs));
+
+        minmaxspec = array_get(&(*blockspec)->fields, 3);
+        minmax = mrkdata_datum_from_spec(*minmaxspec, NULL, 0);
+        for (i = 0; i < w->nindex; ++i) {
+            mrkdata_datum_add_field(minmax, mrkdata_datum_make_u64(b->min[i]));
+            mrkdata_datum_add_field(minmax, mrkdata_datum_make_u64(b->max[i]));
+        }
+        mrkdata_datum_add_field(block, minmax);
+        mrkdata_datum_add_field(seq, block);
+    }
+    mrkdata_datum_add_field(dat, seq);
+
+    seqspec = array_get(&index_spec->fields, 4);
+    seq = mrkdata_datum_from_spec(*seqspec, NULL, 0);
+    for (i = 0; i < w->nbloom; ++i) {
+        mrkdata_datum_add_field(seq, mrkdata_datum_make_u32(w->bloom[i]));
+    }
+    mrkdata_datum_add_field(dat, seq);
+
+    seqspec = array_get(&index_spec->fields, 5);
+    seq = mrkdata_datum_from_spec(*seqspec, NULL, 0);
+    for (b = array_first(&w->blocks, &it);
+         b != NULL;
+         b = array_next(&w->blocks, &it)) {
+        mrkdata_datum_add_field(seq,
+            mrkdata_datum_make_str64((char *)w->blooms + b->bloomoff,
+                                     w->nbloom * b->bloomsz));
+    }
+    mrkdata_datum_add_field(dat, seq);
+
+    seqspec = array_get(&index_spec->fields, 6);
+    seq = mrkdata_datum_from_spec(*seqspec, NULL, 0);
+    if (w->crc) {
+        for (b = array_first(&w->blocks, &it);
+             b != NULL;
+             b = array_next(&w->blocks, &it)) {
+            mrkdata_datum_add_field(seq, mrkdata_datum_make_u32(b->crc));
+        }
+    }
+    mrkdata_datum_add_field(dat, seq);
+
+    return dat;
+}
+
+
+/*
+ * Flush the last block, write the index and the trailer, and release
+ * the writer.  The file descriptor is left open.
+ */
+int
+mrkdata_fwriter_fini(mrkdata_fwriter_t *w)
+{
+    int res = 0;
+    mrkdata_datum_t *dat;
+    unsigned char *buf = NULL;
+    ssize_t sz, trailersz;
+    uint64_t trailer[3];
+
+    if (fwriter_flush(w) != 0) {
+        res = MRKDATA_FWRITER_FINI + 1;
+        goto end;
+    }
+
+    dat = fwriter_index(w);
+    if ((buf = malloc(dat->packsz + FILE_TRAILER_CRC_SZ)) == NULL) {
+        FAIL("malloc");
+    }
+    sz = mrkdata_pack_datum(dat, buf, dat->packsz);
+    mrkdata_datum_destroy(&dat);
+    if (sz <= 0) {
+        res = MRKDATA_FWRITER_FINI + 2;
+        goto end;
+    }
+
+    if (w->crc) {
+        trailer[0] = htobe64(mrkdata_crc32c(0, buf, sz));
+        trailer[1] = htobe64(w->offset);
+        trailer[2] = htobe64(sz);
+        memcpy(buf + sz, trailer, sizeof(trailer));
+        memcpy(buf + sz + sizeof(trailer), FILE_MAGIC_CRC, 8);
+        trailersz = FILE_TRAILER_CRC_SZ;
+    } else {
+        trailer[0] = htobe64(w->offset);
+        trailer[1] = htobe64(sz);
+        memcpy(buf + sz, trailer, 2 * sizeof(uint64_t));
+        memcpy(buf + sz + 2 * sizeof(uint64_t), FILE_MAGIC, 8);
+        trailersz = FILE_TRAILER_SZ;
+    }
+
+    if (write_all(w->fd, buf, sz + trailersz) != 0) {
+        res = MRKDATA_FWRITER_FINI + 3;
+        goto end;
+    }
+
+end:
+    if (buf != NULL) {
+        free(buf);
+    }
+    free(w->buf);
+    w->buf = NULL;
+    if (w->hashes != NULL) {
+        free(w->hashes);
+        w->hashes = NULL;
+    }
+    if (w->blooms != NULL) {
+        free(w->blooms);
+        w->blooms = NULL;
+    }
+    array_fini(&w->blocks);
+    TRRET(res);
+}
+
+
+/* reader */
+
+/*
+ * Load the index at buf, read from offset.  The blocks must all lie
+ * before it.
+ */
+static int
+freader_load_index(mrkdata_freader_t *r,
+                   const unsigned char *buf,
+                   ssize_t sz,
+                   uint64_t offset)
+{
+    mrkdata_datum_t *dat = NULL, *seq, *block, *minmax, **pd;
+    const mrkdata_spec_t *spec;
+    const unsigned char *elem;
+    mnarray_iter_t it;
+    ssize_t n;
+    unsigned i;
+    uint32_t version;
+    uint64_t bloomssz;
+    int res = 0;
+
+    if ((elem = mrkdata_buf_get_field(buf, sz, 0, &n)) == NULL ||
+        elem[0] != MRKDATA_UINT32 ||
+        n != MRKDATA_EXPECT_SZ(MRKDATA_UINT32)) {
+        return -1;
+    }
+    memcpy(&version, elem + 1, sizeof(version));
+    version = be32toh(version);
+
+    if (version == 1) {
+        spec = index_spec_v1;
+    } else if (version == 2) {
+        spec = index_spec_v2;
+    } else if (version == FILE_VERSION) {
+        spec = index_spec;
+    } else {
+        return -1;
+    }
+
+    if (mrkdata_validate_buf(spec, buf, sz, NULL, &n) != 0 || n != sz) {
+        return -1;
+    }
+    if (mrkdata_unpack_buf(spec, buf, sz, &dat) != sz) {
+        return -1;
+    }
+
+    seq = mrkdata_datum_get_field(dat, 1);
+    for (pd = array_first(&seq->data.fields, &it);
+         pd != NULL;
+         pd = array_next(&seq->data.fields, &it)) {
+        mrkdata_spec_t **field;
+
+        if (r->nindex >= MRKDATA_FILE_MAXINDEX ||
+            (field = array_get(&r->spec->fields,
+                               (*pd)->value.u32)) == NULL ||
+            !FILE_TAG_INDEXABLE((*field)->tag)) {
+            res = -1;
+            goto end;
+        }
+        r->index[r->nindex++] = (*pd)->value.u32;
+    }
+
+    seq = mrkdata_datum_get_field(dat, 2);
+    for (i = 0; i < r->nindex; ++i) {
+        mrkdata_datum_t *sorted;
+
+        if ((sorted = mrkdata_datum_get_field(seq, i)) == NULL) {
+            res = -1;
+            goto end;
+        }
+        r->sorted[i] = sorted->value.u8;
+    }
+
+    seq = mrkdata_datum_get_field(dat, 3);
+    for (pd = array_first(&seq->data.fields, &it);
+         pd != NULL;
+         pd = array_next(&seq->data.fields, &it)) {
+        mrkdata_fblock_t *b;
+
+        block = *pd;
+        if ((b = array_incr(&r->blocks)) == NULL) {
+            FAIL("array_incr");
+        }
+        memset(b, '\0', sizeof(*b));
+        b->offset = mrkdata_datum_get_field(block, 0)->value.u64;
+        b->size = mrkdata_datum_get_field(block, 1)->value.u64;
+        b->nrecs = mrkdata_datum_get_field(block, 2)->value.u64;
+        if (b->offset > offset || b->size > offset - b->offset) {
+            res = -1;
+            goto end;
+        }
+        minmax = mrkdata_datum_get_field(block, 3);
+        for (i = 0; i < r->nindex; ++i) {
+            mrkdata_datum_t *min, *max;
+
+            if ((min = mrkdata_datum_get_field(minmax, 2 * i)) == NULL ||
+                (max = mrkdata_datum_get_field(minmax, 2 * i + 1)) == NULL) {
+                res = -1;
+                goto end;
+            }
+            b->min[i] = min->value.u64;
+            b->max[i] = max->value.u64;
+        }
+    }
+
+    if (version < 2) {
+        goto end;
+    }
+
+    seq = mrkdata_datum_get_field(dat, 4);
+    for (pd = array_first(&seq->data.fields, &it);
+         pd != NULL;
+         pd = array_next(&seq->data.fields, &it)) {
+        if (r->nbloom >= MRKDATA_FILE_MAXBLOOM ||
+            array_get(&r->spec->fields, (*pd)->value.u32) == NULL) {
+            res = -1;
+            goto end;
+        }
+        r->bloom[r->nbloom++] = (*pd)->value.u32;
+    }
+
+    seq = mrkdata_datum_get_field(dat, 5);
+    if (r->nbloom > 0 && seq->data.fields.elnum != r->blocks.elnum) {
+        res = -1;
+        goto end;
+    }
+    bloomssz = 0;
+    for (i = 0; r->nbloom > 0 && i < r->blocks.elnum; ++i) {
+        mrkdata_fblock_t *b = array_get(&r->blocks, i);
+        mrkdata_datum_t *filters = mrkdata_datum_get_field(seq, i);
+        uint64_t filterssz = filters->value.sz64;
+
+        if (filterssz == 0 || filterssz % r->nbloom != 0) {
+            res = -1;
+            goto end;
+        }
+        if ((r->blooms = realloc(r->blooms, bloomssz + filterssz)) == NULL) {
+            FAIL("realloc");
+        }
+        memcpy(r->blooms + bloomssz, filters->data.str, filterssz);
+        b->bloomoff = bloomssz;
+        b->bloomsz = filterssz / r->nbloom;
+        bloomssz += filterssz;
+    }
+
+    if (version < 3) {
+        goto end;
+    }
+
+    seq = mrkdata_datum_get_field(dat, 6);
+    if (seq->data.fields.elnum == 0) {
+        goto end;
+    }
+    if (seq->data.fields.elnum != r->blocks.elnum) {
+        res = -1;
+        goto end;
+    }
+    for (i = 0; i < r->blocks.elnum; ++i) {
+        mrkdata_fblock_t *b = array_get(&r->blocks, i);
+
+        b->crc = mrkdata_datum_get_field(seq, i)->value.u32;
+    }
+    r->crc = 1;
+
+end:
+    mrkdata_datum_destroy(&dat);
+    return res;
+}
+
+
+/*
+ * Read the index of the file at fd.  Records are expected to be of
+ * spec, which must match the spec the file was written with.
+ */
+int
+mrkdata_freader_init(mrkdata_freader_t *r, int fd, const mrkdata_spec_t *spec)
+{
+    off_t end;
+    unsigned char trailer[FILE_TRAILER_CRC_SZ];
+    unsigned char *tp = trailer + sizeof(uint64_t);
+    uint64_t offset, sz, crc = 0;
+    unsigned char *buf;
+    int hascrc;
+
+    if (spec->tag != MRKDATA_STRUCT) {
+        TRRET(MRKDATA_FREADER_INIT + 1);
+    }
+
+    pthread_once(&index_once, index_spec_init);
+
+    r->fd = fd;
+    r->spec = spec;
+    r->nindex = 0;
+    r->nbloom = 0;
+    r->blooms = NULL;
+    r->crc = 0;
+    r->buf = NULL;
+    r->bufsz = 0;
+    r->nread = 0;
+    if (array_init(&r->blocks, sizeof(mrkdata_fblock_t), 0,
+                   NULL, NULL) != 0) {
+        FAIL("array_init");
+    }
+
+    /* the plain trailer is the tail of the one with the checksum */
+    if ((end = lseek(fd, 0, SEEK_END)) < (off_t)FILE_TRAILER_SZ ||
+        pread_all(fd, tp, FILE_TRAILER_SZ, end - FILE_TRAILER_SZ) != 0) {
+        array_fini(&r->blocks);
+        TRRET(MRKDATA_FREADER_INIT + 2);
+    }
+
+    if (memcmp(tp + 2 * sizeof(uint64_t), FILE_MAGIC_CRC, 8) == 0) {
+        hascrc = 1;
+        end -= sizeof(uint64_t);
+        if (end < (off_t)FILE_TRAILER_SZ ||
+            pread_all(fd, trailer, sizeof(uint64_t),
+                      end - FILE_TRAILER_SZ) != 0) {
+            array_fini(&r->blocks);
+            TRRET(MRKDATA_FREADER_INIT + 2);
+        }
+        memcpy(&crc, trailer, sizeof(crc));
+        crc = be64toh(crc);
+    } else if (memcmp(tp + 2 * sizeof(uint64_t), FILE_MAGIC, 8) == 0) {
+        hascrc = 0;
+    } else {
+        array_fini(&r->blocks);
+        TRRET(MRKDATA_FREADER_INIT + 3);
+    }
+
+    memcpy(&offset, tp, sizeof(offset));
+    memcpy(&sz, tp + sizeof(offset), sizeof(sz));
+    offset = be64toh(offset);
+    sz = be64toh(sz);
+
+    if (sz == 0 ||
+        sz > FILE_INDEX_MAXSZ ||
+        offset > (uint64_t)end - FILE_TRAILER_SZ ||
+        sz != (uint64_t)end - FILE_TRAILER_SZ - offset) {
+        array_fini(&r->blocks);
+        TRRET(MRKDATA_FREADER_INIT + 4);
+    }
+
+    if ((buf = malloc(sz)) == NULL) {
+        FAIL("malloc");
+    }
+
+    if (pread_all(fd, buf, sz, offset) != 0 ||
+        (hascrc && mrkdata_crc32c(0, buf, sz) != crc) ||
+        freader_load_index(r, buf, sz, offset) != 0) {
+        free(buf);
+        mrkdata_freader_fini(r);
+        TRRET(MRKDATA_FREADER_INIT + 5);
+    }
+
+    free(buf);
+    return 0;
+}
+
+
+/*
+ * Read block i into the reader's buffer, valid until the next read.
+ * The block is verified if the file has checksums.
+ */
+int
+mrkdata_freader_read_block(mrkdata_freader_t *r,
+                           unsigned i,
+                           const unsigned char **pbuf,
+                           ssize_t *psz)
+{
+    mrkdata_fblock_t *b;
+
+    if ((b = array_get(&r->blocks, i)) == NULL) {
+        TRRET(MRKDATA_FREADER_READ_BLOCK + 1);
+    }
+
+    if ((ssize_t)b->size > r->bufsz) {
+        if ((r->buf = realloc(r->buf, b->size)) == NULL) {
+            FAIL("realloc");
+        }
+        r->bufsz = b->size;
+    }
+
+    if (pread_all(r->fd, r->buf, b->size, b->offset) != 0) {
+        TRRET(MRKDATA_FREADER_READ_BLOCK + 2);
+    }
+
+    if (r->crc && mrkdata_crc32c(0, r->buf, b->size) != b->crc) {
+        TRRET(MRKDATA_FREADER_READ_BLOCK + 3);
+    }
+
+    ++r->nread;
+    *pbuf = r->buf;
+    *psz = b->size;
+    return 0;
+}
+
+
+static int
+bound_key(const mrkdata_spec_t *spec,
+          unsigned idx,
+          const mrkdata_datum_t *dat,
+          uint64_t *pkey)
+{
+    mrkdata_spec_t **field;
+    unsigned char key[sizeof(uint64_t)];
+    ssize_t keysz;
+
+    field = array_get(&spec->fields, idx);
+    assert(field != NULL);
+
+    if (dat->spec->tag != (*field)->tag) {
+        return -1;
+    }
+    if ((keysz = mrkdata_key_encode(dat, key, sizeof(key))) < 0) {
+        return -1;
+    }
+    *pkey = key_fold(key, keysz);
+    return 0;
+}
+
+
+/*
+ * Call cb on every record whose field idx is within [lo, hi], either
+ * bound may be NULL.  The bounds must be of the field's tag.  Blocks
+ * whose min/max are off the range are not read, and if the field was
+ * written in order, the scan starts from the first relevant block found
+ * by binary search and stops after the last one.  A non-zero return
+ * from cb stops the scan and is returned.
+ */
+int
+mrkdata_freader_scan(mrkdata_freader_t *r,
+                     unsigned idx,
+                     const mrkdata_datum_t *lo,
+                     const mrkdata_datum_t *hi,
+                     mrkdata_frecord_cb_t cb,
+                     void *udata)
+{
+    unsigned i, k, nblocks;
+    uint64_t klo = 0, khi = UINT64_MAX;
+    int res;
+
+    for (k = 0; k < r->nindex; ++k) {
+        if (r->index[k] == idx) {
+            break;
+        }
+    }
+    if (k == r->nindex) {
+        TRRET(MRKDATA_FREADER_SCAN + 1);
+    }
+
+    if ((lo != NULL && bound_key(r->spec, idx, lo, &klo) != 0) ||
+        (hi != NULL && bound_key(r->spec, idx, hi, &khi) != 0)) {
+        TRRET(MRKDATA_FREADER_SCAN + 2);
+    }
+
+    nblocks = r->blocks.elnum;
+    i = 0;
+
+    if (r->sorted[k]) {
+        unsigned j = nblocks;
+
+        /* first block whose max is not below klo */
+        while (i < j) {
+            unsigned m = i + (j - i) / 2;
+            mrkdata_fblock_t *b = array_get(&r->blocks, m);
+
+            if (b->max[k] < klo) {
+                i = m + 1;
+            } else {
+                j = m;
+            }
+        }
+    }
+
+    for (; i < nblocks; ++i) {
+        mrkdata_fblock_t *b;
+        const unsigned char *buf, *end;
+        ssize_t sz, recsz;
+
+        b = array_get(&r->blocks, i);
+
+        if (b->min[k] > khi) {
+            if (r->sorted[k]) {
+                break;
+            }
+            continue;
+        }
+        if (b->max[k] < klo) {
+            continue;
+        }
+
+        if (mrkdata_freader_read_block(r, i, &buf, &sz) != 0) {
+            TRRET(MRKDATA_FREADER_SCAN + 3);
+        }
+
+        for (end = buf + sz; buf < end; buf += recsz) {
+            uint64_t key;
+
+            if ((recsz = mrkdata_buf_size(buf, end - buf)) <= 0 ||
+                recsz > end - buf ||
+                rec_key(buf, recsz, idx, &key) != 0) {
+                TRRET(MRKDATA_FREADER_SCAN + 4);
+            }
+
+            if (key >= klo && key <= khi) {
+                if ((res = cb(buf, recsz, udata)) != 0) {
+                    return res;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Call cb on every record whose field idx equals value.  The field must
+ * have Bloom filters, and only the blocks whose filter may contain the
+ * value are read.  A non-zero return from cb stops the lookup and is
+ * returned.
+ */
+int
+mrkdata_freader_lookup(mrkdata_freader_t *r,
+                       unsigned idx,
+                       const mrkdata_datum_t *value,
+                       mrkdata_frecord_cb_t cb,
+                       void *udata)
+{
+    unsigned i, k;
+    mrkdata_spec_t **field;
+    unsigned char *packed;
+    uint64_t h;
+    int res = 0;
+
+    for (k = 0; k < r->nbloom; ++k) {
+        if (r->bloom[k] == idx) {
+            break;
+        }
+    }
+    if (k == r->nbloom) {
+        TRRET(MRKDATA_FREADER_LOOKUP + 1);
+    }
+
+    field = array_get(&r->spec->fields, idx);
+    assert(field != NULL);
+    if (value->spec->tag != (*field)->tag) {
+        TRRET(MRKDATA_FREADER_LOOKUP + 2);
+    }
+
+    if ((packed = malloc(value->packsz)) == NULL) {
+        FAIL("malloc");
+    }
+    if (mrkdata_pack_datum(value, packed, value->packsz) != value->packsz) {
+        free(packed);
+        TRRET(MRKDATA_FREADER_LOOKUP + 3);
+    }
+    h = mrkdata_buf_hash(packed, value->packsz, 0);
+
+    for (i = 0; i < r->blocks.elnum; ++i) {
+        mrkdata_fblock_t *b;
+        const unsigned char *buf, *end;
+        ssize_t sz, recsz;
+
+        b = array_get(&r->blocks, i);
+
+        if (!bloom_check(r->blooms + b->bloomoff + k * b->bloomsz,
+                         b->bloomsz * 8,
+                         h)) {
+            continue;
+        }
+
+        if (mrkdata_freader_read_block(r, i, &buf, &sz) != 0) {
+            res = MRKDATA_FREADER_LOOKUP + 4;
+            break;
+        }
+
+        for (end = buf + sz; buf < end; buf += recsz) {
+            const unsigned char *elem;
+            ssize_t elemsz;
+
+            if ((recsz = mrkdata_buf_size(buf, end - buf)) <= 0 ||
+                recsz > end - buf ||
+                (elem = mrkdata_buf_get_field(buf,
+                                              recsz,
+                                              idx,
+                                              &elemsz)) == NULL) {
+                res = MRKDATA_FREADER_LOOKUP + 5;
+                goto end;
+            }
+
+            if (elemsz == value->packsz &&
+                memcmp(elem, packed, elemsz) == 0) {
+                if ((res = cb(buf, recsz, udata)) != 0) {
+                    goto end;
+                }
+            }
+        }
+    }
+
+end:
+    free(packed);
+    TRRET(res);
+}
+
+
+int
+mrkdata_freader_fini(mrkdata_freader_t *r)
+{
+    if (r->buf != NULL) {
+        free(r->buf);
+        r->buf = NULL;
+    }
+    if (r->blooms != NULL) {
+        free(r->blooms);
+        r->blooms = NULL;
+    }
+    array_fini(&r->blocks);
+    return 0;
+}
@@ -0,0 +1,387 @@
+#include <assert.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Hashing and ordering are both defined over the packed encoding, so
+ * that a datum and the record it packs into hash and compare alike.
+ * The hash is XXH64, fed incrementally so that datums never need to be
+ * packed into a buffer.
+ */
+
+#define P1 0x9e3779b185ebca87ull
+#define P2 0xc2b2ae3d27d4eb4full
+#define P3 0x165667b19e3779f9ull
+#define P4 0x85ebca77c2b2ae63ull
+#define P5 0x27d4eb2f165667c5ull
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct _hash_state {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;
+    unsigned char mem[32];
+    size_t memsz;
+} hash_state_t;
+
+static inline uint64_t
+read64(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static inline uint32_t
+read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static inline uint64_t
+hash_round(uint64_t acc, uint64_t v)
+{
+    acc += v * P2;
+    acc = ROTL(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t
+hash_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= hash_round(0, v);
+    return acc * P1 + P4;
+}
+
+static void
+hash_init(hash_state_t *st, uint64_t seed)
+{
+    st->v[0] = seed + P1 + P2;
+    st->v[1] = seed + P2;
+    st->v[2] = seed;
+    st->v[3] = seed - P1;
+    st->seed = seed;
+    st->total = 0;
+    st->memsz = 0;
+}
+
+static void
+hash_stripes(hash_state_t *st, const unsigned char *p, size_t n)
+{
+    const unsigned char *end = p + n;
+
+    while (p < end) {
+        st->v[0] = hash_round(st->v[0], read64(p));
+        st->v[1] = hash_round(st->v[1], read64(p + 8));
+        st->v[2] = hash_round(st->v[2], read64(p + 16));
+        st->v[3] = hash_round(st->v[3], read64(p + 24));
+        p += 32;
+    }
+}
+
+static void
+hash_update(hash_state_t *st, const unsigned char *p, size_t sz)
+{
+    size_t n;
+
+    st->total += sz;
+
+    if (st->memsz + sz < sizeof(st->mem)) {
+        memcpy(st->mem + st->memsz, p, sz);
+        st->memsz += sz;
+        return;
+    }
+
+    if (st->memsz > 0) {
+        n = sizeof(st->mem) - st->memsz;
+        memcpy(st->mem + st->memsz, p, n);
+        hash_stripes(st, st->mem, sizeof(st->mem));
+        p += n;
+        sz -= n;
+        st->memsz = 0;
+    }
+
+    n = sz & ~(sizeof(st->mem) - 1);
+    hash_stripes(st, p, n);
+    p += n;
+    sz -= n;
+
+    memcpy(st->mem, p, sz);
+    st->memsz = sz;
+}
+
+static uint64_t
+hash_final(const hash_state_t *st)
+{
+    uint64_t h;
+    const unsigned char *p = st->mem;
+    const unsigned char *end = st->mem + st->memsz;
+
+    if (st->total >= sizeof(st->mem)) {
+        h = ROTL(st->v[0], 1) + ROTL(st->v[1], 7) +
+            ROTL(st->v[2], 12) + ROTL(st->v[3], 18);
+        h = hash_merge(h, st->v[0]);
+        h = hash_merge(h, st->v[1]);
+        h = hash_merge(h, st->v[2]);
+        h = hash_merge(h, st->v[3]);
+    } else {
+        h = st->seed + P5;
+    }
+
+    h += st->total;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= hash_round(0, read64(p));
+        h = ROTL(h, 27) * P1 + P4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * P1;
+        h = ROTL(h, 23) * P2 + P3;
+        p += 4;
+    }
+
+    for (; p < end; ++p) {
+        h ^= (*p) * P5;
+        h = ROTL(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
+/*
+ * Write the tag and the fixed-size part of dat as mrkdata_pack_datum()
+ * would, and return its size.
+ */
+static ssize_t
+datum_header(const mrkdata_datum_t *dat, unsigned char *hdr)
+{
+    union {
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+    } v;
+
+    hdr[0] = dat->spec->tag;
+
+    switch (dat->spec->tag) {
+    case MRKDATA_UINT8:
+    case MRKDATA_INT8:
+    case MRKDATA_STR8:
+        hdr[1] = dat->value.u8;
+        break;
+
+    case MRKDATA_UINT16:
+    case MRKDATA_INT16:
+    case MRKDATA_STR16:
+        v.u16 = htons(dat->value.u16);
+        memcpy(hdr + 1, &v.u16, sizeof(v.u16));
+        break;
+
+    case MRKDATA_UINT32:
+    case MRKDATA_INT32:
+    case MRKDATA_STR32:
+        v.u32 = htonl(dat->value.u32);
+        memcpy(hdr + 1, &v.u32, sizeof(v.u32));
+        break;
+
+    case MRKDATA_DOUBLE:
+        memcpy(hdr + 1, &dat->value.d, sizeof(double));
+        break;
+
+    default:
+        v.u64 = htobe64(dat->value.u64);
+        memcpy(hdr + 1, &v.u64, sizeof(v.u64));
+    }
+
+    return MRKDATA_EXPECT_SZ(dat->spec->tag);
+}
+
+static void
+datum_hash(hash_state_t *st, const mrkdata_datum_t *dat)
+{
+    static const unsigned char absent = 0xff;
+    unsigned char hdr[16];
+    mrkdata_tag_t tag = dat->spec->tag;
+
+    hash_update(st, hdr, datum_header(dat, hdr));
+
+    if (MRKDATA_STREAMED(dat)) {
+        /* the body is not ours to read, the length stands for it */
+
+    } else if (tag >= MRKDATA_STR8 && tag <= MRKDATA_STR64) {
+        hash_update(st,
+                    (const unsigned char *)dat->data.str,
+                    dat->packsz - MRKDATA_EXPECT_SZ(tag));
+
+    } else if (MRKDATA_TAG_CUSTOM(tag)) {
+        mrkdata_datum_t **field;
+        mnarray_iter_t it;
+
+        for (field = array_first(&dat->data.fields, &it);
+             field != NULL;
+             field = array_next(&dat->data.fields, &it)) {
+            if (*field == NULL) {
+                /* absent, not a tag */
+                hash_update(st, &absent, 1);
+            } else {
+                datum_hash(st, *field);
+            }
+        }
+    }
+}
+
+uint64_t
+mrkdata_datum_hash(const mrkdata_datum_t *dat, uint64_t seed)
+{
+    hash_state_t st;
+
+    hash_init(&st, seed);
+    datum_hash(&st, dat);
+    return hash_final(&st);
+}
+
+/*
+ * Hash the record at buf.  buf must hold the whole record, see
+ * mrkdata_buf_size().  Return 0 if it does not.
+ */
+uint64_t
+mrkdata_buf_hash(const unsigned char *buf, ssize_t sz, uint64_t seed)
+{
+    hash_state_t st;
+    ssize_t recsz;
+
+    if ((recsz = mrkdata_buf_size(buf, sz)) <= 0 || recsz > sz) {
+        return 0;
+    }
+
+    hash_init(&st, seed);
+    hash_update(&st, buf, recsz);
+    return hash_final(&st);
+}
+
+
+#define SIGN(r) ((r) < 0 ? -1 : (r) > 0 ? 1 : 0)
+
+/*
+ * Order datums as memcmp() would order their packed records, without
+ * packing them.  The encoding is self-delimiting, so the first differing
+ * field decides.
+ */
+int
+mrkdata_datum_cmp(const mrkdata_datum_t *a, const mrkdata_datum_t *b)
+{
+    unsigned char ahdr[16], bhdr[16];
+    mrkdata_tag_t tag;
+    ssize_t hsz;
+    int res;
+
+    if (a == b) {
+        return 0;
+    }
+
+    if (a->spec->tag != b->spec->tag) {
+        return a->spec->tag < b->spec->tag ? -1 : 1;
+    }
+
+    tag = a->spec->tag;
+    hsz = datum_header(a, ahdr);
+    datum_header(b, bhdr);
+
+    if ((res = memcmp(ahdr + 1, bhdr + 1, hsz - 1)) != 0) {
+        return SIGN(res);
+    }
+
+    if (tag >= MRKDATA_STR8 && tag <= MRKDATA_STR64) {
+        /* equal headers, equal lengths */
+        if (MRKDATA_STREAMED(a) || MRKDATA_STREAMED(b)) {
+            return MRKDATA_STREAMED(a) - MRKDATA_STREAMED(b);
+        }
+        res = memcmp(a->data.str, b->data.str, a->packsz - hsz);
+        return SIGN(res);
+
+    } else if (MRKDATA_TAG_CUSTOM(tag)) {
+        mrkdata_datum_t **afield, **bfield;
+        mnarray_iter_t ait, bit;
+
+        for (afield = array_first(&a->data.fields, &ait),
+                bfield = array_first(&b->data.fields, &bit);
+             afield != NULL && bfield != NULL;
+             afield = array_next(&a->data.fields, &ait),
+                bfield = array_next(&b->data.fields, &bit)) {
+
+            /* absent fields sort first */
+            if (*afield == NULL || *bfield == NULL) {
+                if (*afield != *bfield) {
+                    return *afield == NULL ? -1 : 1;
+                }
+                continue;
+            }
+            if ((res = mrkdata_datum_cmp(*afield, *bfield)) != 0) {
+                return res;
+            }
+        }
+
+        if (afield != NULL) {
+            return 1;
+        }
+        if (bfield != NULL) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Order the records at a and b, see mrkdata_datum_cmp().  Incomplete
+ * records sort first.
+ */
+int
+mrkdata_buf_cmp(const unsigned char *a,
+                ssize_t asz,
+                const unsigned char *b,
+                ssize_t bsz)
+{
+    ssize_t arecsz, brecsz;
+    int res;
+
+    arecsz = mrkdata_buf_size(a, asz);
+    if (arecsz > asz) {
+        arecsz = -1;
+    }
+    brecsz = mrkdata_buf_size(b, bsz);
+    if (brecsz > bsz) {
+        brecsz = -1;
+    }
+
+    if (arecsz <= 0 || brecsz <= 0) {
+        return SIGN(arecsz - brecsz);
+    }
+
+    if ((res = memcmp(a, b, MIN(arecsz, brecsz))) != 0) {
+        return SIGN(res);
+    }
+
+    return SIGN(arecsz - brecsz);
+}
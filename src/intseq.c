@@ -0,0 +1,520 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Delta and frame-of-reference encoding of integer sequences.
+ *
+ * An INTSEQ element is the tag, the 8-byte length of the rest, the tag
+ * of the items (UINT8 to INT64), the 8-byte number of items, and the
+ * 8-byte base, followed by blocks of MRKDATA_INTSEQ_BLOCK items, the
+ * last one possibly shorter.  The lengths and the base are big-endian.
+ *
+ * An item is stored as its delta from the item before it, the first
+ * one from the base, all modulo 2^64 with signed items sign-extended.
+ * A block is the 8-byte minimum of its deltas, the 1-byte width w, and
+ * each delta minus the minimum in w bits.  Items go alternately to two
+ * lanes of little-endian 64-bit words, interleaved word by word, so
+ * that a block of m items takes 16 * ceil(ceil(m / 2) * w / 64) bytes.
+ *
+ * Two lanes decode with the same shifts, and are unpacked together with
+ * SSE2.  The base is chosen so that the first delta is the second, and
+ * a sequence of steady timestamps has all blocks of width 0.
+ */
+
+#define INTSEQ_HDRSZ \
+    (MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ) + \
+     sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint64_t))
+#define INTSEQ_BLOCKHDRSZ (sizeof(uint64_t) + sizeof(uint8_t))
+#define INTSEQ_TAG_INTEGER(t) ((t) <= MRKDATA_INT64)
+
+static ssize_t
+intseq_nwords(unsigned m, unsigned w)
+{
+    return (((m + 1) / 2) * w + 63) / 64;
+}
+
+
+/*
+ * Pack the block of m items of v after the item *prev, and return its
+ * size.  With no buffer, only count.
+ */
+static ssize_t
+intseq_put_block(const uint64_t *v,
+                 unsigned m,
+                 uint64_t *prev,
+                 unsigned char *buf,
+                 ssize_t sz)
+{
+    uint64_t d[MRKDATA_INTSEQ_BLOCK];
+    uint64_t umax, *words;
+    int64_t dmin;
+    unsigned i, w;
+    ssize_t nwords, res;
+
+    assert(m > 0 && m <= MRKDATA_INTSEQ_BLOCK);
+
+    dmin = INT64_MAX;
+    for (i = 0; i < m; ++i) {
+        d[i] = v[i] - *prev;
+        *prev = v[i];
+        dmin = MIN(dmin, (int64_t)d[i]);
+    }
+    umax = 0;
+    for (i = 0; i < m; ++i) {
+        d[i] -= (uint64_t)dmin;
+        umax |= d[i];
+    }
+    w = umax == 0 ? 0 : 64 - __builtin_clzll(umax);
+    nwords = intseq_nwords(m, w);
+    res = INTSEQ_BLOCKHDRSZ + nwords * 2 * sizeof(uint64_t);
+
+    if (buf == NULL) {
+        return res;
+    }
+    if (sz < res) {
+        return 0;
+    }
+
+    *((int64_t *)buf) = htobe64(dmin);
+    buf += sizeof(int64_t);
+    *buf = w;
+    ++buf;
+    words = (uint64_t *)buf;
+    memset(words, '\0', nwords * 2 * sizeof(uint64_t));
+    if (w > 0) {
+        for (i = 0; i < m; ++i) {
+            unsigned p = (i / 2) * w;
+            unsigned j = (p / 64) * 2 + (i & 1);
+            unsigned off = p % 64;
+
+            words[j] |= d[i] << off;
+            if (off + w > 64) {
+                words[j + 2] |= d[i] >> (64 - off);
+            }
+        }
+        for (i = 0; i < nwords * 2; ++i) {
+            words[i] = htole64(words[i]);
+        }
+    }
+    return res;
+}
+
+
+/*
+ * Unpack the block of m items at buf after the item *prev into v, and
+ * return its size, or 0 if it does not fit sz.  With no v, only skip.
+ */
+static ssize_t
+intseq_get_block(const unsigned char *buf,
+                 ssize_t sz,
+                 unsigned m,
+                 uint64_t *prev,
+                 uint64_t *v)
+{
+    /* and the lane 1 item past an odd m */
+    uint64_t d[MRKDATA_INTSEQ_BLOCK + 1];
+    const uint64_t *words;
+    uint64_t dmin, mask;
+    unsigned i, k, w;
+    ssize_t nwords, res;
+
+    if (sz < (ssize_t)INTSEQ_BLOCKHDRSZ) {
+        return 0;
+    }
+    dmin = be64toh(*((const uint64_t *)buf));
+    w = buf[sizeof(uint64_t)];
+    if (w > 64) {
+        return 0;
+    }
+    nwords = intseq_nwords(m, w);
+    res = INTSEQ_BLOCKHDRSZ + nwords * 2 * sizeof(uint64_t);
+    if (sz < res) {
+        return 0;
+    }
+    if (v == NULL) {
+        return res;
+    }
+
+    words = (const uint64_t *)(buf + INTSEQ_BLOCKHDRSZ);
+    mask = w == 64 ? ~(uint64_t)0 : ((uint64_t)1 << w) - 1;
+    k = 0;
+    if (w == 0) {
+        for (; k < m; ++k) {
+            d[k] = dmin;
+        }
+    } else {
+#ifdef __SSE2__
+        const __m128i vmask = _mm_set1_epi64x(mask);
+        const __m128i vmin = _mm_set1_epi64x(dmin);
+
+        for (; k < m; k += 2) {
+            unsigned p = (k / 2) * w;
+            unsigned off = p % 64;
+            const __m128i *pw = (const __m128i *)(words + (p / 64) * 2);
+            __m128i x;
+
+            x = _mm_srl_epi64(_mm_loadu_si128(pw), _mm_cvtsi32_si128(off));
+            if (off + w > 64) {
+                x = _mm_or_si128(x,
+                                 _mm_sll_epi64(_mm_loadu_si128(pw + 1),
+                                     _mm_cvtsi32_si128(64 - off)));
+            }
+            x = _mm_add_epi64(_mm_and_si128(x, vmask), vmin);
+            _mm_storeu_si128((__m128i *)(d + k), x);
+        }
+#else
+        for (; k < m; ++k) {
+            unsigned p = (k / 2) * w;
+            unsigned j = (p / 64) * 2 + (k & 1);
+            unsigned off = p % 64;
+            uint64_t x;
+
+            x = le64toh(words[j]) >> off;
+            if (off + w > 64) {
+                x |= le64toh(words[j + 2]) << (64 - off);
+            }
+            d[k] = (x & mask) + dmin;
+        }
+#endif
+    }
+
+    for (i = 0; i < m; ++i) {
+        *prev += d[i];
+        v[i] = *prev;
+    }
+    return res;
+}
+
+
+static ssize_t
+intseq_put_hdr(mrkdata_tag_t tag,
+               uint64_t n,
+               uint64_t base,
+               unsigned char *buf)
+{
+    if (buf != NULL) {
+        buf[0] = MRKDATA_INTSEQ;
+        buf[MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ)] = tag;
+        *((uint64_t *)(buf + MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ) + 1)) =
+            htobe64(n);
+        *((uint64_t *)(buf + MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ) + 9)) =
+            htobe64(base);
+    }
+    return INTSEQ_HDRSZ;
+}
+
+
+static void
+intseq_put_len(unsigned char *buf, ssize_t sz)
+{
+    if (buf != NULL) {
+        *((int64_t *)(buf + 1)) =
+            htobe64(sz - MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ));
+    }
+}
+
+
+static uint64_t
+intseq_base(const uint64_t *v, uint64_t n)
+{
+    return n < 2 ? (n < 1 ? 0 : v[0]) : v[0] - (v[1] - v[0]);
+}
+
+
+/*
+ * Encode the n items of v, of the integer tag, as an INTSEQ element.
+ * Signed items are sign-extended to 64 bits.  With no buffer, only
+ * count.  Return the size of the element, or 0.
+ */
+ssize_t
+mrkdata_intseq_encode(mrkdata_tag_t tag,
+                      const uint64_t *v,
+                      uint64_t n,
+                      unsigned char *buf,
+                      ssize_t sz)
+{
+    uint64_t i, prev;
+    ssize_t res, nwritten;
+
+    if (!INTSEQ_TAG_INTEGER(tag)) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_ENCODE + 1);
+        return 0;
+    }
+    if (buf != NULL && sz < (ssize_t)INTSEQ_HDRSZ) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_ENCODE + 2);
+        return 0;
+    }
+
+    prev = intseq_base(v, n);
+    res = intseq_put_hdr(tag, n, prev, buf);
+
+    for (i = 0; i < n; i += MRKDATA_INTSEQ_BLOCK) {
+        if ((nwritten = intseq_put_block(v + i,
+                                         MIN(n - i, MRKDATA_INTSEQ_BLOCK),
+                                         &prev,
+                                         buf == NULL ? NULL : buf + res,
+                                         sz - res)) == 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_ENCODE + 2);
+            return 0;
+        }
+        res += nwritten;
+    }
+
+    intseq_put_len(buf, res);
+    MRKDATA_STATS_VALUE(MRKDATA_INTSEQ);
+    return res;
+}
+
+
+static ssize_t
+intseq_get_hdr(const unsigned char *buf,
+               ssize_t sz,
+               mrkdata_tag_t *ptag,
+               uint64_t *pn,
+               uint64_t *pbase)
+{
+    int64_t len;
+
+    if (sz < (ssize_t)INTSEQ_HDRSZ || buf[0] != MRKDATA_INTSEQ) {
+        return 0;
+    }
+    len = be64toh(*((const int64_t *)(buf + 1)));
+    *ptag = buf[MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ)];
+    *pn = be64toh(*((const uint64_t *)
+                    (buf + MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ) + 1)));
+    *pbase = be64toh(*((const uint64_t *)
+                       (buf + MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ) + 9)));
+    if (len < (int64_t)(INTSEQ_HDRSZ - MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ)) ||
+        len > sz - MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ) ||
+        !INTSEQ_TAG_INTEGER(*ptag) ||
+        /* every block takes a header at least */
+        *pn / MRKDATA_INTSEQ_BLOCK > (uint64_t)len / INTSEQ_BLOCKHDRSZ) {
+        return 0;
+    }
+    return len + MRKDATA_EXPECT_SZ(MRKDATA_INTSEQ);
+}
+
+
+/*
+ * Decode the INTSEQ element at buf into v, of *pn items at most, and
+ * set *ptag, if not NULL, to the tag of the items, and *pn to their
+ * number.  With no v, only count.  Return the size of the element, or
+ * 0.
+ */
+ssize_t
+mrkdata_intseq_decode(const unsigned char *buf,
+                      ssize_t sz,
+                      mrkdata_tag_t *ptag,
+                      uint64_t *v,
+                      uint64_t *pn)
+{
+    mrkdata_tag_t tag;
+    uint64_t i, n, prev;
+    ssize_t len, res, nread;
+
+    if ((len = intseq_get_hdr(buf, sz, &tag, &n, &prev)) == 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_DECODE + 1);
+        return 0;
+    }
+    if (v != NULL && n > *pn) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_DECODE + 2);
+        return 0;
+    }
+
+    res = INTSEQ_HDRSZ;
+    for (i = 0; i < n; i += MRKDATA_INTSEQ_BLOCK) {
+        if ((nread = intseq_get_block(buf + res,
+                                      len - res,
+                                      MIN(n - i, MRKDATA_INTSEQ_BLOCK),
+                                      &prev,
+                                      v == NULL ? NULL : v + i)) == 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_DECODE + 3);
+            return 0;
+        }
+        res += nread;
+    }
+    if (res != len) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_DECODE + 3);
+        return 0;
+    }
+
+    if (ptag != NULL) {
+        *ptag = tag;
+    }
+    *pn = n;
+    MRKDATA_STATS_VALUE(MRKDATA_INTSEQ);
+    return res;
+}
+
+
+static uint64_t
+intseq_datum_value(const mrkdata_datum_t *dat)
+{
+    switch (dat->spec->tag) {
+    case MRKDATA_UINT8:
+        return dat->value.u8;
+    case MRKDATA_INT8:
+        return (uint64_t)(int64_t)dat->value.i8;
+    case MRKDATA_UINT16:
+        return dat->value.u16;
+    case MRKDATA_INT16:
+        return (uint64_t)(int64_t)dat->value.i16;
+    case MRKDATA_UINT32:
+        return dat->value.u32;
+    case MRKDATA_INT32:
+        return (uint64_t)(int64_t)dat->value.i32;
+    default:
+        return dat->value.u64;
+    }
+}
+
+
+/*
+ * Pack dat, a SEQ of integers of a single tag, as an INTSEQ element.
+ * Return its size, or 0.
+ */
+ssize_t
+mrkdata_intseq_pack_datum(const mrkdata_datum_t *dat,
+                          unsigned char *buf,
+                          ssize_t sz)
+{
+    uint64_t v[MRKDATA_INTSEQ_BLOCK];
+    mrkdata_spec_t **item;
+    mrkdata_datum_t **field;
+    mnarray_iter_t it;
+    uint64_t i, n, prev;
+    unsigned m;
+    ssize_t res, nwritten;
+    mrkdata_stats_t *st;
+
+    if (dat->spec->tag != MRKDATA_SEQ ||
+        (item = array_get(&dat->spec->fields, 0)) == NULL ||
+        !INTSEQ_TAG_INTEGER((*item)->tag)) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_PACK_DATUM + 1);
+        return 0;
+    }
+    if (sz < (ssize_t)INTSEQ_HDRSZ) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_PACK_DATUM + 2);
+        return 0;
+    }
+
+    n = dat->data.fields.elnum;
+    for (i = 0; i < MIN(n, 2); ++i) {
+        v[i] = intseq_datum_value(*(mrkdata_datum_t **)
+                                  array_get(&dat->data.fields, i));
+    }
+    prev = intseq_base(v, MIN(n, 2));
+    res = intseq_put_hdr((*item)->tag, n, prev, buf);
+
+    i = 0;
+    m = 0;
+    for (field = array_first(&dat->data.fields, &it);
+         field != NULL;
+         field = array_next(&dat->data.fields, &it)) {
+
+        if ((*field)->spec->tag != (*item)->tag) {
+            MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_PACK_DATUM + 1);
+            return 0;
+        }
+        v[m++] = intseq_datum_value(*field);
+        if (m == MRKDATA_INTSEQ_BLOCK || i + m == n) {
+            if ((nwritten = intseq_put_block(v,
+                                             m,
+                                             &prev,
+                                             buf + res,
+                                             sz - res)) == 0) {
+                MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_PACK_DATUM + 2);
+                return 0;
+            }
+            res += nwritten;
+            i += m;
+            m = 0;
+        }
+    }
+
+    intseq_put_len(buf, res);
+    MRKDATA_STATS_VALUE(MRKDATA_INTSEQ);
+    st = MRKDATA_STATS();
+    ++st->npacked;
+    st->bpacked += res;
+    return res;
+}
+
+
+/*
+ * Unpack the INTSEQ element at buf into a new datum of spec, a SEQ of
+ * the integers of the element.  Return the size of the element, or 0.
+ */
+ssize_t
+mrkdata_intseq_unpack_buf(const mrkdata_spec_t *spec,
+                          const unsigned char *buf,
+                          ssize_t sz,
+                          mrkdata_datum_t **pdat)
+{
+    uint64_t v[MRKDATA_INTSEQ_BLOCK];
+    mrkdata_spec_t **item;
+    mrkdata_datum_t *dat;
+    mrkdata_tag_t tag;
+    uint64_t i, n, prev;
+    unsigned j, m;
+    ssize_t len, res, nread;
+    mrkdata_stats_t *st;
+
+    assert(pdat != NULL);
+
+    if ((len = intseq_get_hdr(buf, sz, &tag, &n, &prev)) == 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_UNPACK_BUF + 1);
+        return 0;
+    }
+    if (*pdat != NULL ||
+        spec->tag != MRKDATA_SEQ ||
+        (item = array_get(&spec->fields, 0)) == NULL ||
+        (*item)->tag != tag) {
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_UNPACK_BUF + 2);
+        return 0;
+    }
+
+    dat = mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+    res = INTSEQ_HDRSZ;
+    for (i = 0; i < n; i += m) {
+        m = MIN(n - i, MRKDATA_INTSEQ_BLOCK);
+        if ((nread = intseq_get_block(buf + res,
+                                      len - res,
+                                      m,
+                                      &prev,
+                                      v)) == 0) {
+            mrkdata_datum_destroy(&dat);
+            MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_UNPACK_BUF + 3);
+            return 0;
+        }
+        res += nread;
+        for (j = 0; j < m; ++j) {
+            mrkdata_datum_add_field(dat,
+                mrkdata_datum_from_spec(*item, (void *)(uintptr_t)v[j], 0));
+        }
+    }
+    if (res != len) {
+        mrkdata_datum_destroy(&dat);
+        MRKDATA_STATS_ERROR(MRKDATA_INTSEQ_UNPACK_BUF + 3);
+        return 0;
+    }
+
+    *pdat = dat;
+    MRKDATA_STATS_VALUE(MRKDATA_INTSEQ);
+    st = MRKDATA_STATS();
+    ++st->nunpacked;
+    st->bunpacked += res;
+    return res;
+}
@@ -0,0 +1,1163 @@
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * JSON transcoding, straight between JSON text and packed records with
+ * no datums in between.
+ *
+ * JSON to packed: container and string lengths are not known up front,
+ * so their headers are reserved and patched when the body is written.
+ * With a spec, a STRUCT is read from an object by the field names of
+ * the spec (in any order, other keys are ignored) or, when its fields
+ * are not all named, by position from an object or an array, and a SEQ
+ * from an array.  Without a spec, arrays become
+ * SEQ, objects a SEQ of STRUCT {key, value}, strings the smallest STRn,
+ * integers INT64, other numbers DOUBLE, true and false UINT8, and null
+ * an empty SEQ.
+ *
+ * Packed to JSON: a STRUCT whose spec fields are all named is written as
+ * an object, any other container as an array.  Fields of an object past
+ * those of the spec are keyed by their position.  Strings are written
+ * as is, but for the escapes JSON requires, and NaNs and infinities,
+ * which JSON has no numbers for, as null.
+ *
+ * String bodies, most of the bytes in practice, are scanned 16 bytes at
+ * a time with SSE2 for the quote, the backslash and control characters,
+ * and a byte at a time without it.
+ */
+
+typedef struct _json_writer {
+    unsigned char *buf;
+    ssize_t sz;
+    ssize_t pos;
+} json_writer_t;
+
+typedef struct _json_parser {
+    const char *p;
+    const char *end;
+    unsigned depth;
+} json_parser_t;
+
+
+/*
+ * With no buffer, only count.
+ */
+static int
+jw_put(json_writer_t *jw, const void *p, ssize_t sz)
+{
+    if (jw->buf != NULL) {
+        if (jw->sz - jw->pos < sz) {
+            return -1;
+        }
+        memcpy(jw->buf + jw->pos, p, sz);
+    }
+    jw->pos += sz;
+    return 0;
+}
+
+
+static int
+jw_put_byte(json_writer_t *jw, unsigned char c)
+{
+    return jw_put(jw, &c, 1);
+}
+
+
+/*
+ * Reserve room for a header to be patched later.
+ */
+static int
+jw_reserve(json_writer_t *jw, ssize_t sz)
+{
+    if (jw->buf != NULL && jw->sz - jw->pos < sz) {
+        return -1;
+    }
+    jw->pos += sz;
+    return 0;
+}
+
+
+/*
+ * Return the first quote, backslash or control character in [p, end),
+ * or end.
+ */
+static const char *
+json_scan_str(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m;
+        unsigned mask;
+
+        m = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                         _mm_cmpeq_epi8(v, bslash));
+        /* v <= 0x1f, unsigned */
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+        if ((mask = _mm_movemask_epi8(m)) != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end &&
+           *p != '"' &&
+           *p != '\\' &&
+           (unsigned char)*p >= 0x20) {
+        ++p;
+    }
+    return p;
+}
+
+
+static void
+json_ws(json_parser_t *jp)
+{
+    while (jp->p < jp->end &&
+           (*jp->p == ' ' || *jp->p == '\n' ||
+            *jp->p == '\r' || *jp->p == '\t')) {
+        ++jp->p;
+    }
+}
+
+
+static int
+json_expect(json_parser_t *jp, char c)
+{
+    json_ws(jp);
+    if (jp->p < jp->end && *jp->p == c) {
+        ++jp->p;
+        return 0;
+    }
+    return -1;
+}
+
+
+static int
+json_literal(json_parser_t *jp, const char *s)
+{
+    size_t sz = strlen(s);
+
+    if ((size_t)(jp->end - jp->p) < sz || memcmp(jp->p, s, sz) != 0) {
+        return -1;
+    }
+    jp->p += sz;
+    return 0;
+}
+
+
+static int
+json_hex4(const char *p, unsigned *pv)
+{
+    unsigned i, v = 0;
+
+    for (i = 0; i < 4; ++i) {
+        char c = p[i];
+
+        v <<= 4;
+        if (c >= '0' && c <= '9') {
+            v |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            v |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            v |= c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+    *pv = v;
+    return 0;
+}
+
+
+static int
+json_put_utf8(json_writer_t *jw, unsigned cp)
+{
+    unsigned char u[4];
+    ssize_t n;
+
+    if (cp < 0x80) {
+        u[0] = cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        u[0] = 0xc0 | (cp >> 6);
+        u[1] = 0x80 | (cp & 0x3f);
+        n = 2;
+    } else if (cp < 0x10000) {
+        u[0] = 0xe0 | (cp >> 12);
+        u[1] = 0x80 | ((cp >> 6) & 0x3f);
+        u[2] = 0x80 | (cp & 0x3f);
+        n = 3;
+    } else {
+        u[0] = 0xf0 | (cp >> 18);
+        u[1] = 0x80 | ((cp >> 12) & 0x3f);
+        u[2] = 0x80 | ((cp >> 6) & 0x3f);
+        u[3] = 0x80 | (cp & 0x3f);
+        n = 4;
+    }
+    return jw_put(jw, u, n);
+}
+
+
+/*
+ * Decode the string at jp->p, past its opening quote, into jw.
+ */
+static int
+json_string_body(json_parser_t *jp, json_writer_t *jw)
+{
+    while (1) {
+        const char *q = json_scan_str(jp->p, jp->end);
+        unsigned cp, lo;
+
+        if (jw_put(jw, jp->p, q - jp->p) != 0) {
+            return -1;
+        }
+        jp->p = q;
+
+        if (q == jp->end || (unsigned char)*q < 0x20) {
+            return -1;
+        }
+        if (*q == '"') {
+            ++jp->p;
+            return 0;
+        }
+
+        /* escape */
+        if (jp->end - q < 2) {
+            return -1;
+        }
+        jp->p += 2;
+        switch (q[1]) {
+        case '"':
+        case '\\':
+        case '/':
+            cp = q[1];
+            break;
+        case 'b':
+            cp = '\b';
+            break;
+        case 'f':
+            cp = '\f';
+            break;
+        case 'n':
+            cp = '\n';
+            break;
+        case 'r':
+            cp = '\r';
+            break;
+        case 't':
+            cp = '\t';
+            break;
+        case 'u':
+            if (jp->end - jp->p < 4 || json_hex4(jp->p, &cp) != 0) {
+                return -1;
+            }
+            jp->p += 4;
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                if (jp->end - jp->p < 6 ||
+                    jp->p[0] != '\\' ||
+                    jp->p[1] != 'u' ||
+                    json_hex4(jp->p + 2, &lo) != 0 ||
+                    lo < 0xdc00 || lo >= 0xe000) {
+                    return -1;
+                }
+                jp->p += 6;
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+        if (json_put_utf8(jw, cp) != 0) {
+            return -1;
+        }
+    }
+}
+
+
+/*
+ * Skip the string at jp->p, past its opening quote.
+ */
+static int
+json_skip_string(json_parser_t *jp)
+{
+    while (1) {
+        const char *q = json_scan_str(jp->p, jp->end);
+
+        if (q == jp->end || (unsigned char)*q < 0x20) {
+            return -1;
+        }
+        if (*q == '"') {
+            jp->p = q + 1;
+            return 0;
+        }
+        if (jp->end - q < 2) {
+            return -1;
+        }
+        jp->p = q + 2;
+    }
+}
+
+
+/*
+ * Skip the digits at p, at least one.
+ */
+static const char *
+json_digits(const char *p, const char *end)
+{
+    const char *start = p;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        ++p;
+    }
+    return p > start ? p : NULL;
+}
+
+
+/*
+ * The extent of the number at jp->p, and whether it is an integer.  As
+ * in RFC 8259, there are no leading zeros, and a fraction or an
+ * exponent has digits.
+ */
+static int
+json_number(json_parser_t *jp, const char **pstart, int *pint)
+{
+    const char *p = jp->p;
+
+    *pstart = p;
+    *pint = 1;
+    if (p < jp->end && *p == '-') {
+        ++p;
+    }
+    if (p < jp->end && *p == '0') {
+        ++p;
+    } else if ((p = json_digits(p, jp->end)) == NULL) {
+        return -1;
+    }
+    if (p < jp->end && *p == '.') {
+        *pint = 0;
+        if ((p = json_digits(p + 1, jp->end)) == NULL) {
+            return -1;
+        }
+    }
+    if (p < jp->end && (*p == 'e' || *p == 'E')) {
+        *pint = 0;
+        ++p;
+        if (p < jp->end && (*p == '+' || *p == '-')) {
+            ++p;
+        }
+        if ((p = json_digits(p, jp->end)) == NULL) {
+            return -1;
+        }
+    }
+    /* 01 is 0 followed by junk */
+    if (p < jp->end && *p >= '0' && *p <= '9') {
+        return -1;
+    }
+    jp->p = p;
+    return 0;
+}
+
+
+/*
+ * Integer of [s, e) as sign and magnitude.
+ */
+static int
+json_int(const char *s, const char *e, int *pneg, uint64_t *pv)
+{
+    uint64_t v = 0;
+
+    *pneg = 0;
+    if (*s == '-') {
+        *pneg = 1;
+        ++s;
+    }
+    for (; s < e; ++s) {
+        unsigned d = *s - '0';
+
+        if (v > (UINT64_MAX - d) / 10) {
+            return -1;
+        }
+        v = v * 10 + d;
+    }
+    *pv = v;
+    return 0;
+}
+
+
+static int
+json_double(const char *s, const char *e, double *pv)
+{
+    char tmp[64];
+    char *te;
+
+    if (e - s >= (ssize_t)sizeof(tmp)) {
+        return -1;
+    }
+    memcpy(tmp, s, e - s);
+    tmp[e - s] = '\0';
+    *pv = strtod(tmp, &te);
+    return te == tmp + (e - s) ? 0 : -1;
+}
+
+
+static int json_skip_value(json_parser_t *);
+
+static int
+json_skip_container(json_parser_t *jp, char close)
+{
+    if (++jp->depth > MRKDATA_MAXDEPTH) {
+        return -1;
+    }
+    json_ws(jp);
+    if (jp->p < jp->end && *jp->p == close) {
+        ++jp->p;
+        --jp->depth;
+        return 0;
+    }
+    while (1) {
+        if (close == '}') {
+            if (json_expect(jp, '"') != 0 ||
+                json_skip_string(jp) != 0 ||
+                json_expect(jp, ':') != 0) {
+                return -1;
+            }
+        }
+        if (json_skip_value(jp) != 0) {
+            return -1;
+        }
+        json_ws(jp);
+        if (jp->p == jp->end) {
+            return -1;
+        }
+        if (*jp->p == ',') {
+            ++jp->p;
+            continue;
+        }
+        if (*jp->p == close) {
+            ++jp->p;
+            --jp->depth;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+
+static int
+json_skip_value(json_parser_t *jp)
+{
+    const char *s;
+    int isint;
+
+    json_ws(jp);
+    if (jp->p == jp->end) {
+        return -1;
+    }
+    switch (*jp->p) {
+    case '"':
+        ++jp->p;
+        return json_skip_string(jp);
+    case '{':
+        ++jp->p;
+        return json_skip_container(jp, '}');
+    case '[':
+        ++jp->p;
+        return json_skip_container(jp, ']');
+    case 't':
+        return json_literal(jp, "true");
+    case 'f':
+        return json_literal(jp, "false");
+    case 'n':
+        return json_literal(jp, "null");
+    default:
+        return json_number(jp, &s, &isint);
+    }
+}
+
+
+/*
+ * Patch the header of the element at start, now that its body is
+ * written.
+ */
+static int
+json_patch(json_writer_t *jw, ssize_t start, mrkdata_tag_t tag)
+{
+    int64_t len = jw->pos - start - MRKDATA_EXPECT_SZ(tag);
+
+    if (jw->buf == NULL) {
+        return 0;
+    }
+    jw->buf[start] = tag;
+    switch (tag) {
+    case MRKDATA_STR8:
+        if (len > INT8_MAX) {
+            return -1;
+        }
+        break;
+    case MRKDATA_STR16:
+        if (len > INT16_MAX) {
+            return -1;
+        }
+        break;
+    case MRKDATA_STR32:
+        if (len > INT32_MAX) {
+            return -1;
+        }
+        break;
+    default:
+        break;
+    }
+    mrkdata_pack_uint(jw->buf + start + 1, len, mrkdata_tag_sz[tag]);
+    return 0;
+}
+
+
+/*
+ * Write a string of the smallest STRn: the body is written after the
+ * largest header, and moved down once its length is known.
+ */
+static int
+json_string_infer(json_parser_t *jp, json_writer_t *jw)
+{
+    ssize_t start = jw->pos, len, hsz;
+    mrkdata_tag_t tag;
+
+    if (jw_reserve(jw, MRKDATA_EXPECT_SZ(MRKDATA_STR64)) != 0 ||
+        json_string_body(jp, jw) != 0) {
+        return -1;
+    }
+    len = jw->pos - start - MRKDATA_EXPECT_SZ(MRKDATA_STR64);
+    tag = len <= INT8_MAX ? MRKDATA_STR8 :
+          len <= INT16_MAX ? MRKDATA_STR16 :
+          len <= INT32_MAX ? MRKDATA_STR32 :
+          MRKDATA_STR64;
+    hsz = MRKDATA_EXPECT_SZ(tag);
+    if (jw->buf != NULL && hsz < MRKDATA_EXPECT_SZ(MRKDATA_STR64)) {
+        memmove(jw->buf + start + hsz,
+                jw->buf + start + MRKDATA_EXPECT_SZ(MRKDATA_STR64),
+                len);
+    }
+    jw->pos = start + hsz + len;
+    return json_patch(jw, start, tag);
+}
+
+
+/*
+ * A STRUCT whose fields are all named.
+ */
+static int
+spec_is_object(const mrkdata_spec_t *spec)
+{
+    mrkdata_spec_t **field;
+    mnarray_iter_t it;
+
+    if (spec == NULL ||
+        spec->tag != MRKDATA_STRUCT ||
+        spec->fields.elnum == 0) {
+        return 0;
+    }
+    for (field = array_first(&spec->fields, &it);
+         field != NULL;
+         field = array_next(&spec->fields, &it)) {
+        if ((*field)->name == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+static int json_value(json_parser_t *,
+                      const mrkdata_spec_t *,
+                      json_writer_t *);
+
+/*
+ * Array into SEQ (spec is the SEQ spec or NULL), or array or object
+ * positionally into STRUCT, ignoring the keys.  jp->p is past the
+ * opening bracket, close is the closing one.
+ */
+static int
+json_array(json_parser_t *jp,
+           const mrkdata_spec_t *spec,
+           json_writer_t *jw,
+           char close)
+{
+    mrkdata_tag_t tag = spec != NULL ? spec->tag : MRKDATA_SEQ;
+    ssize_t start = jw->pos;
+    unsigned n = 0;
+
+    if (jw_reserve(jw, MRKDATA_EXPECT_SZ(tag)) != 0) {
+        return -1;
+    }
+
+    json_ws(jp);
+    if (jp->p < jp->end && *jp->p == close) {
+        ++jp->p;
+    } else {
+        while (1) {
+            mrkdata_spec_t **field = NULL;
+
+            if (close == '}' &&
+                (json_expect(jp, '"') != 0 ||
+                 json_skip_string(jp) != 0 ||
+                 json_expect(jp, ':') != 0)) {
+                return -1;
+            }
+            if (spec != NULL) {
+                field = array_get(&spec->fields,
+                                  tag == MRKDATA_STRUCT ? n : 0);
+                if (field == NULL) {
+                    return -1;
+                }
+            }
+            if (json_value(jp, field != NULL ? *field : NULL, jw) != 0) {
+                return -1;
+            }
+            ++n;
+            json_ws(jp);
+            if (jp->p < jp->end && *jp->p == ',') {
+                ++jp->p;
+                continue;
+            }
+            if (json_expect(jp, close) != 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+
+    if (tag == MRKDATA_STRUCT && n != spec->fields.elnum) {
+        return -1;
+    }
+    return json_patch(jw, start, tag);
+}
+
+
+/*
+ * Object into STRUCT by field names.  One pass finds the values of the
+ * fields, and they are then transcoded in the order of the spec.
+ */
+static int
+json_object_struct(json_parser_t *jp,
+                   const mrkdata_spec_t *spec,
+                   json_writer_t *jw)
+{
+    const char *values[64], **pvalues = values;
+    const char *end = NULL;
+    ssize_t start = jw->pos;
+    unsigned i, nfields = spec->fields.elnum;
+    int res = -1;
+
+    if (nfields > countof(values)) {
+        if ((pvalues = malloc(nfields * sizeof(const char *))) == NULL) {
+            FAIL("malloc");
+        }
+    }
+    for (i = 0; i < nfields; ++i) {
+        pvalues[i] = NULL;
+    }
+
+    if (jw_reserve(jw, MRKDATA_EXPECT_SZ(MRKDATA_STRUCT)) != 0) {
+        goto end;
+    }
+
+    json_ws(jp);
+    if (jp->p < jp->end && *jp->p == '}') {
+        ++jp->p;
+    } else {
+        while (1) {
+            const char *key, *keyend;
+
+            if (json_expect(jp, '"') != 0) {
+                goto end;
+            }
+            key = jp->p;
+            if (json_skip_string(jp) != 0) {
+                goto end;
+            }
+            keyend = jp->p - 1;
+            if (json_expect(jp, ':') != 0) {
+                goto end;
+            }
+            json_ws(jp);
+
+            /* keys with escapes never match */
+            for (i = 0; i < nfields; ++i) {
+                mrkdata_spec_t **field = array_get(&spec->fields, i);
+
+                if ((*field)->name != NULL &&
+                    strlen((*field)->name) == (size_t)(keyend - key) &&
+                    memcmp((*field)->name, key, keyend - key) == 0) {
+                    pvalues[i] = jp->p;
+                    break;
+                }
+            }
+            if (json_skip_value(jp) != 0) {
+                goto end;
+            }
+            json_ws(jp);
+            if (jp->p < jp->end && *jp->p == ',') {
+                ++jp->p;
+                continue;
+            }
+            if (json_expect(jp, '}') != 0) {
+                goto end;
+            }
+            break;
+        }
+    }
+    end = jp->p;
+
+    for (i = 0; i < nfields; ++i) {
+        mrkdata_spec_t **field = array_get(&spec->fields, i);
+
+        if (pvalues[i] == NULL) {
+            goto end;
+        }
+        jp->p = pvalues[i];
+        if (json_value(jp, *field, jw) != 0) {
+            goto end;
+        }
+    }
+    jp->p = end;
+    res = json_patch(jw, start, MRKDATA_STRUCT);
+
+end:
+    if (pvalues != values) {
+        free(pvalues);
+    }
+    return res;
+}
+
+
+/*
+ * Object into SEQ of STRUCT {key, value}, when there is no spec.
+ */
+static int
+json_object_infer(json_parser_t *jp, json_writer_t *jw)
+{
+    ssize_t start = jw->pos;
+
+    if (jw_reserve(jw, MRKDATA_EXPECT_SZ(MRKDATA_SEQ)) != 0) {
+        return -1;
+    }
+
+    json_ws(jp);
+    if (jp->p < jp->end && *jp->p == '}') {
+        ++jp->p;
+        return json_patch(jw, start, MRKDATA_SEQ);
+    }
+
+    while (1) {
+        ssize_t pair = jw->pos;
+
+        if (jw_reserve(jw, MRKDATA_EXPECT_SZ(MRKDATA_STRUCT)) != 0 ||
+            json_expect(jp, '"') != 0 ||
+            json_string_infer(jp, jw) != 0 ||
+            json_expect(jp, ':') != 0 ||
+            json_value(jp, NULL, jw) != 0 ||
+            json_patch(jw, pair, MRKDATA_STRUCT) != 0) {
+            return -1;
+        }
+        json_ws(jp);
+        if (jp->p < jp->end && *jp->p == ',') {
+            ++jp->p;
+            continue;
+        }
+        if (json_expect(jp, '}') != 0) {
+            return -1;
+        }
+        return json_patch(jw, start, MRKDATA_SEQ);
+    }
+}
+
+
+static int
+json_scalar(json_parser_t *jp,
+            const mrkdata_spec_t *spec,
+            json_writer_t *jw)
+{
+    unsigned char v[1 + sizeof(uint64_t)];
+    mrkdata_tag_t tag;
+    const char *s;
+    int isint, neg;
+    uint64_t u = 0;
+    double d;
+
+    if (jp->p < jp->end && (*jp->p == 't' || *jp->p == 'f')) {
+        if (spec != NULL && spec->tag != MRKDATA_UINT8) {
+            return -1;
+        }
+        u = *jp->p == 't';
+        if (json_literal(jp, u ? "true" : "false") != 0) {
+            return -1;
+        }
+        v[0] = MRKDATA_UINT8;
+        v[1] = u;
+        return jw_put(jw, v, 2);
+    }
+
+    if (json_number(jp, &s, &isint) != 0) {
+        return -1;
+    }
+
+    if (spec == NULL) {
+        tag = isint && json_int(s, jp->p, &neg, &u) == 0 &&
+              u <= (neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX) ?
+              MRKDATA_INT64 : MRKDATA_DOUBLE;
+    } else {
+        tag = spec->tag;
+    }
+
+    if (tag == MRKDATA_DOUBLE) {
+        if (json_double(s, jp->p, &d) != 0) {
+            return -1;
+        }
+        v[0] = tag;
+        memcpy(v + 1, &d, sizeof(d));
+        return jw_put(jw, v, MRKDATA_EXPECT_SZ(tag));
+    }
+
+    if (tag > MRKDATA_INT64 || !isint || json_int(s, jp->p, &neg, &u) != 0) {
+        return -1;
+    }
+
+    if (mrkdata_int_fit(tag, neg, &u) != 0) {
+        return -1;
+    }
+
+    v[0] = tag;
+    mrkdata_pack_uint(v + 1, u, mrkdata_tag_sz[tag]);
+    return jw_put(jw, v, MRKDATA_EXPECT_SZ(tag));
+}
+
+
+static int
+json_value(json_parser_t *jp,
+           const mrkdata_spec_t *spec,
+           json_writer_t *jw)
+{
+    ssize_t start;
+    int res;
+
+    json_ws(jp);
+    if (jp->p == jp->end) {
+        return -1;
+    }
+    if (++jp->depth > MRKDATA_MAXDEPTH) {
+        return -1;
+    }
+
+    switch (*jp->p) {
+    case '"':
+        ++jp->p;
+        if (spec == NULL) {
+            res = json_string_infer(jp, jw);
+            break;
+        }
+        if (spec->tag < MRKDATA_STR8 || spec->tag > MRKDATA_STR64) {
+            return -1;
+        }
+        start = jw->pos;
+        res = jw_reserve(jw, MRKDATA_EXPECT_SZ(spec->tag)) != 0 ||
+              json_string_body(jp, jw) != 0 ||
+              json_patch(jw, start, spec->tag) != 0 ? -1 : 0;
+        break;
+
+    case '[':
+        ++jp->p;
+        if (spec != NULL &&
+            spec->tag != MRKDATA_SEQ &&
+            spec->tag != MRKDATA_STRUCT) {
+            return -1;
+        }
+        res = json_array(jp, spec, jw, ']');
+        break;
+
+    case '{':
+        ++jp->p;
+        if (spec == NULL) {
+            res = json_object_infer(jp, jw);
+        } else if (spec_is_object(spec)) {
+            res = json_object_struct(jp, spec, jw);
+        } else if (spec->tag == MRKDATA_STRUCT) {
+            res = json_array(jp, spec, jw, '}');
+        } else {
+            return -1;
+        }
+        break;
+
+    case 'n':
+        if (spec != NULL || json_literal(jp, "null") != 0) {
+            return -1;
+        }
+        start = jw->pos;
+        res = jw_reserve(jw, MRKDATA_EXPECT_SZ(MRKDATA_SEQ)) != 0 ||
+              json_patch(jw, start, MRKDATA_SEQ) != 0 ? -1 : 0;
+        break;
+
+    default:
+        res = json_scalar(jp, spec, jw);
+    }
+
+    --jp->depth;
+    return res;
+}
+
+
+/*
+ * Transcode the JSON text of sz bytes at json into a packed record of
+ * spec in buf, or just count its size when buf is NULL.  spec may be
+ * NULL, see above.  Return the record size, or 0 if the text is not
+ * JSON, does not match the spec, or the record does not fit in bufsz.
+ */
+ssize_t
+mrkdata_json_to_buf(const mrkdata_spec_t *spec,
+                    const char *json,
+                    size_t sz,
+                    unsigned char *buf,
+                    ssize_t bufsz)
+{
+    json_parser_t jp = {json, json + sz, 0};
+    json_writer_t jw = {buf, bufsz, 0};
+
+    if (json_value(&jp, spec, &jw) != 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_JSON_TO_BUF + 1);
+        return 0;
+    }
+    json_ws(&jp);
+    if (jp.p != jp.end) {
+        MRKDATA_STATS_ERROR(MRKDATA_JSON_TO_BUF + 2);
+        return 0;
+    }
+    return jw.pos;
+}
+
+
+/* packed to JSON */
+
+typedef struct _json_emitter {
+    json_writer_t jw;
+    struct {
+        const mrkdata_spec_t *spec;
+        unsigned idx;
+        int object;
+    } stack[MRKDATA_MAXDEPTH];
+    const mrkdata_spec_t *spec;
+} json_emitter_t;
+
+
+static int
+emit_string(json_writer_t *jw, const unsigned char *s, ssize_t sz)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *p = (const char *)s, *end = p + sz;
+
+    if (jw_put_byte(jw, '"') != 0) {
+        return -1;
+    }
+    while (p < end) {
+        const char *q = json_scan_str(p, end);
+        char esc[6];
+        ssize_t escsz = 2;
+
+        if (jw_put(jw, p, q - p) != 0) {
+            return -1;
+        }
+        if (q == end) {
+            break;
+        }
+        esc[0] = '\\';
+        switch (*q) {
+        case '"':
+        case '\\':
+            esc[1] = *q;
+            break;
+        case '\n':
+            esc[1] = 'n';
+            break;
+        case '\r':
+            esc[1] = 'r';
+            break;
+        case '\t':
+            esc[1] = 't';
+            break;
+        default:
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = hex[(unsigned char)*q >> 4];
+            esc[5] = hex[*q & 0x0f];
+            escsz = 6;
+        }
+        if (jw_put(jw, esc, escsz) != 0) {
+            return -1;
+        }
+        p = q + 1;
+    }
+    return jw_put_byte(jw, '"');
+}
+
+
+static int
+emit_scalar(json_writer_t *jw, mrkdata_tag_t tag, const unsigned char *p)
+{
+    char tmp[32];
+    uint64_t u = 0;
+    ssize_t i, n;
+    int neg = 0;
+    double d;
+
+    if (tag == MRKDATA_DOUBLE) {
+        memcpy(&d, p, sizeof(d));
+        if (!isfinite(d)) {
+            return jw_put(jw, "null", 4);
+        }
+        n = snprintf(tmp, sizeof(tmp), "%.17g", d);
+        return jw_put(jw, tmp, n);
+    }
+
+    for (i = 0; i < mrkdata_tag_sz[tag]; ++i) {
+        u = (u << 8) | p[i];
+    }
+    if ((tag & 1) && (p[0] & 0x80)) {
+        /* sign-extend, then take the magnitude */
+        if (mrkdata_tag_sz[tag] < 8) {
+            u |= ~0ull << (mrkdata_tag_sz[tag] * 8);
+        }
+        u = -u;
+        neg = 1;
+    }
+
+    i = sizeof(tmp);
+    do {
+        tmp[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    if (neg) {
+        tmp[--i] = '-';
+    }
+    return jw_put(jw, tmp + i, sizeof(tmp) - i);
+}
+
+
+static int
+emit_cb(mrkdata_walk_event_t ev,
+        mrkdata_tag_t tag,
+        const unsigned char *p,
+        ssize_t sz,
+        unsigned depth,
+        void *udata)
+{
+    json_emitter_t *je = udata;
+    const mrkdata_spec_t *spec = NULL;
+
+    if (ev == MRKDATA_WALK_LEAVE) {
+        return jw_put_byte(&je->jw, je->stack[depth].object ? '}' : ']');
+    }
+
+    if (depth == 0) {
+        spec = je->spec;
+    } else {
+        const mrkdata_spec_t *parent = je->stack[depth - 1].spec;
+        unsigned idx = je->stack[depth - 1].idx++;
+
+        if (idx > 0 && jw_put_byte(&je->jw, ',') != 0) {
+            return -1;
+        }
+        if (parent != NULL) {
+            mrkdata_spec_t **field;
+
+            field = array_get(&parent->fields,
+                              parent->tag == MRKDATA_STRUCT ? idx : 0);
+            spec = field != NULL ? *field : NULL;
+        }
+        if (je->stack[depth - 1].object) {
+            int res;
+
+            if (spec != NULL) {
+                res = emit_string(&je->jw,
+                                  (const unsigned char *)spec->name,
+                                  strlen(spec->name));
+            } else {
+                /* past the fields of the spec */
+                char key[16];
+
+                res = emit_string(&je->jw,
+                                  (const unsigned char *)key,
+                                  snprintf(key, sizeof(key), "%u", idx));
+            }
+            if (res != 0 || jw_put_byte(&je->jw, ':') != 0) {
+                return -1;
+            }
+        }
+    }
+
+    /* the record need not match the spec, drop it if it does not */
+    if (spec != NULL && spec->tag != tag) {
+        spec = NULL;
+    }
+
+    if (ev == MRKDATA_WALK_ENTER) {
+        je->stack[depth].spec = spec;
+        je->stack[depth].idx = 0;
+        je->stack[depth].object = spec_is_object(spec);
+        return jw_put_byte(&je->jw, je->stack[depth].object ? '{' : '[');
+    }
+
+    if (tag >= MRKDATA_STR8 && tag <= MRKDATA_STR64) {
+        return emit_string(&je->jw, p, sz);
+    }
+    return emit_scalar(&je->jw, tag, p);
+}
+
+
+/*
+ * Write the packed record at buf as JSON text into out, or just count
+ * its size when out is NULL.  spec is only used for field names, and may
+ * be NULL.  Return the text size, or 0 if the record is malformed or
+ * the text does not fit in outsz.  The text is not NUL-terminated.
+ */
+ssize_t
+mrkdata_buf_to_json(const mrkdata_spec_t *spec,
+                    const unsigned char *buf,
+                    ssize_t sz,
+                    char *out,
+                    ssize_t outsz)
+{
+    json_emitter_t je;
+
+    je.jw.buf = (unsigned char *)out;
+    je.jw.sz = outsz;
+    je.jw.pos = 0;
+    je.spec = spec;
+
+    if (mrkdata_walk_buf(buf, sz, NULL, emit_cb, &je) == 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_BUF_TO_JSON + 1);
+        return 0;
+    }
+    return je.jw.pos;
+}
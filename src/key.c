@@ -0,0 +1,538 @@
+#include <assert.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Order-preserving key encoding.  Keys carry no tags or lengths, the
+ * spec is needed to decode them, and memcmp() of two keys of the same
+ * spec orders them by value:
+ *
+ *  - unsigned integers are big-endian;
+ *  - signed integers are big-endian with the sign bit flipped;
+ *  - doubles are big-endian, with the sign bit flipped if positive, and
+ *    all bits flipped if negative;
+ *  - strings have 0x00 escaped as 0x00 0xff, and end with 0x00 0x01;
+ *  - STRUCT fields follow each other;
+ *  - SEQ elements are preceded by 0x01 each, and followed by 0x00.
+ *
+ * Absent fields of a sparse STRUCT have no key.
+ */
+
+#define KEY_ESC 0x00
+#define KEY_ESC_ZERO 0xff
+#define KEY_ESC_END 0x01
+#define KEY_SEQ_ELEM 0x01
+#define KEY_SEQ_END 0x00
+
+typedef struct _key_writer {
+    unsigned char *buf;
+    ssize_t sz;
+    ssize_t pos;
+} key_writer_t;
+
+/*
+ * With no buffer, only count.
+ */
+static int
+key_put(key_writer_t *kw, const void *p, ssize_t sz)
+{
+    if (kw->buf != NULL) {
+        if (kw->sz - kw->pos < sz) {
+            return -1;
+        }
+        memcpy(kw->buf + kw->pos, p, sz);
+    }
+    kw->pos += sz;
+    return 0;
+}
+
+static int
+key_put_byte(key_writer_t *kw, unsigned char c)
+{
+    return key_put(kw, &c, 1);
+}
+
+static int
+key_put_str(key_writer_t *kw, const char *s, ssize_t sz)
+{
+    const char *end = s + sz;
+    const char *z;
+    static const unsigned char esc_zero[2] = {KEY_ESC, KEY_ESC_ZERO};
+    static const unsigned char esc_end[2] = {KEY_ESC, KEY_ESC_END};
+
+    while (s < end) {
+        if ((z = memchr(s, '\0', end - s)) == NULL) {
+            z = end;
+        }
+        if (key_put(kw, s, z - s) != 0) {
+            return -1;
+        }
+        if (z < end) {
+            if (key_put(kw, esc_zero, sizeof(esc_zero)) != 0) {
+                return -1;
+            }
+            ++z;
+        }
+        s = z;
+    }
+    return key_put(kw, esc_end, sizeof(esc_end));
+}
+
+static int
+key_encode(key_writer_t *kw, const mrkdata_datum_t *dat)
+{
+    union {
+        uint8_t u8;
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+    } v;
+
+    switch (dat->spec->tag) {
+        mrkdata_datum_t **field;
+        mnarray_iter_t it;
+
+    case MRKDATA_UINT8:
+        return key_put_byte(kw, dat->value.u8);
+
+    case MRKDATA_INT8:
+        return key_put_byte(kw, dat->value.u8 ^ 0x80);
+
+    case MRKDATA_UINT16:
+        v.u16 = htobe16(dat->value.u16);
+        return key_put(kw, &v.u16, sizeof(v.u16));
+
+    case MRKDATA_INT16:
+        v.u16 = htobe16(dat->value.u16 ^ 0x8000);
+        return key_put(kw, &v.u16, sizeof(v.u16));
+
+    case MRKDATA_UINT32:
+        v.u32 = htobe32(dat->value.u32);
+        return key_put(kw, &v.u32, sizeof(v.u32));
+
+    case MRKDATA_INT32:
+        v.u32 = htobe32(dat->value.u32 ^ 0x80000000u);
+        return key_put(kw, &v.u32, sizeof(v.u32));
+
+    case MRKDATA_UINT64:
+        v.u64 = htobe64(dat->value.u64);
+        return key_put(kw, &v.u64, sizeof(v.u64));
+
+    case MRKDATA_INT64:
+        v.u64 = htobe64(dat->value.u64 ^ 0x8000000000000000ull);
+        return key_put(kw, &v.u64, sizeof(v.u64));
+
+    case MRKDATA_DOUBLE:
+        memcpy(&v.u64, &dat->value.d, sizeof(double));
+        if (v.u64 & 0x8000000000000000ull) {
+            v.u64 = ~v.u64;
+        } else {
+            v.u64 |= 0x8000000000000000ull;
+        }
+        v.u64 = htobe64(v.u64);
+        return key_put(kw, &v.u64, sizeof(v.u64));
+
+    case MRKDATA_STR8:
+    case MRKDATA_STR16:
+    case MRKDATA_STR32:
+    case MRKDATA_STR64:
+        if (MRKDATA_STREAMED(dat)) {
+            return -1;
+        }
+        return key_put_str(kw,
+                           dat->data.str,
+                           dat->packsz - MRKDATA_EXPECT_SZ(dat->spec->tag));
+
+    case MRKDATA_STRUCT:
+        for (field = array_first(&dat->data.fields, &it);
+             field != NULL;
+             field = array_next(&dat->data.fields, &it)) {
+            if (*field == NULL || key_encode(kw, *field) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+
+    case MRKDATA_SEQ:
+        for (field = array_first(&dat->data.fields, &it);
+             field != NULL;
+             field = array_next(&dat->data.fields, &it)) {
+            if (*field == NULL ||
+                key_put_byte(kw, KEY_SEQ_ELEM) != 0 ||
+                key_encode(kw, *field) != 0) {
+                return -1;
+            }
+        }
+        return key_put_byte(kw, KEY_SEQ_END);
+
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Return the size of the key of dat, or -1 if it has none.  The key of
+ * an empty STRUCT is empty.
+ */
+ssize_t
+mrkdata_key_size(const mrkdata_datum_t *dat)
+{
+    key_writer_t kw = {NULL, 0, 0};
+
+    if (key_encode(&kw, dat) != 0) {
+        return -1;
+    }
+    return kw.pos;
+}
+
+/*
+ * Write the key of dat to buf.  Return its size, or -1 if it does not
+ * fit in sz.
+ */
+ssize_t
+mrkdata_key_encode(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
+{
+    key_writer_t kw = {buf, sz, 0};
+
+    if (key_encode(&kw, dat) != 0) {
+        return -1;
+    }
+    return kw.pos;
+}
+
+/*
+ * Write the key made of the given fields of the STRUCT dat, in the
+ * given order.  It decodes with a STRUCT spec of these fields.  Return
+ * its size, or -1.
+ */
+ssize_t
+mrkdata_key_encode_fields(const mrkdata_datum_t *dat,
+                          const unsigned *fields,
+                          unsigned nfields,
+                          unsigned char *buf,
+                          ssize_t sz)
+{
+    key_writer_t kw = {buf, sz, 0};
+    unsigned i;
+
+    if (dat->spec->tag != MRKDATA_STRUCT) {
+        return -1;
+    }
+
+    for (i = 0; i < nfields; ++i) {
+        mrkdata_datum_t **field;
+
+        if ((field = array_get(&dat->data.fields, fields[i])) == NULL ||
+            *field == NULL) {
+            return -1;
+        }
+        if (key_encode(&kw, *field) != 0) {
+            return -1;
+        }
+    }
+    return kw.pos;
+}
+
+
+/*
+ * Write the key of the packed scalar or string at elem, without
+ * unpacking it.  Return the key size, or -1 for containers, malformed
+ * elements, or if the key does not fit in sz.
+ */
+ssize_t
+mrkdata_key_encode_buf(const unsigned char *elem,
+                       ssize_t elemsz,
+                       unsigned char *buf,
+                       ssize_t sz)
+{
+    key_writer_t kw = {buf, sz, 0};
+    mrkdata_tag_t tag;
+    ssize_t recsz, hsz;
+    uint64_t u64;
+    double d;
+
+    if ((recsz = mrkdata_buf_size(elem, elemsz)) <= 0 || recsz > elemsz) {
+        return -1;
+    }
+
+    tag = elem[0];
+    hsz = MRKDATA_EXPECT_SZ(tag);
+
+    switch (tag) {
+    case MRKDATA_UINT8:
+    case MRKDATA_UINT16:
+    case MRKDATA_UINT32:
+    case MRKDATA_UINT64:
+        /* already big-endian */
+        if (key_put(&kw, elem + 1, mrkdata_tag_sz[tag]) != 0) {
+            return -1;
+        }
+        break;
+
+    case MRKDATA_INT8:
+    case MRKDATA_INT16:
+    case MRKDATA_INT32:
+    case MRKDATA_INT64:
+        if (key_put_byte(&kw, elem[1] ^ 0x80) != 0 ||
+            key_put(&kw, elem + 2, mrkdata_tag_sz[tag] - 1) != 0) {
+            return -1;
+        }
+        break;
+
+    case MRKDATA_DOUBLE:
+        memcpy(&d, elem + 1, sizeof(double));
+        memcpy(&u64, &d, sizeof(double));
+        if (u64 & 0x8000000000000000ull) {
+            u64 = ~u64;
+        } else {
+            u64 |= 0x8000000000000000ull;
+        }
+        u64 = htobe64(u64);
+        if (key_put(&kw, &u64, sizeof(u64)) != 0) {
+            return -1;
+        }
+        break;
+
+    case MRKDATA_STR8:
+    case MRKDATA_STR16:
+    case MRKDATA_STR32:
+    case MRKDATA_STR64:
+        if (key_put_str(&kw, (const char *)elem + hsz, recsz - hsz) != 0) {
+            return -1;
+        }
+        break;
+
+    default:
+        return -1;
+    }
+
+    return kw.pos;
+}
+
+/*
+ * Return the size of the escaped string at buf including its terminator,
+ * and its unescaped length in *plen, or 0 if it is malformed.
+ */
+static ssize_t
+key_scan_str(const unsigned char *buf, ssize_t sz, int64_t *plen)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = buf + sz;
+    const unsigned char *z;
+    int64_t len = 0;
+
+    while (p < end) {
+        if ((z = memchr(p, KEY_ESC, end - p)) == NULL || z + 1 >= end) {
+            return 0;
+        }
+        len += z - p;
+        if (z[1] == KEY_ESC_END) {
+            *plen = len;
+            return z + 2 - buf;
+        } else if (z[1] == KEY_ESC_ZERO) {
+            ++len;
+            p = z + 2;
+        } else {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void
+key_unescape(char *dst, const unsigned char *src, int64_t len)
+{
+    int64_t i;
+
+    for (i = 0; i < len; ++i, ++src) {
+        dst[i] = *src;
+        if (*src == KEY_ESC) {
+            ++src;
+        }
+    }
+}
+
+static ssize_t
+key_decode(const mrkdata_spec_t *spec,
+           const unsigned char *buf,
+           ssize_t sz,
+           mrkdata_datum_t **pdat)
+{
+    mrkdata_datum_t *dat = NULL;
+    ssize_t nread = 0;
+    union {
+        uint8_t u8;
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+        double d;
+    } v;
+
+    if (!MRKDATA_TAG_SUPPORTED(spec->tag)) {
+        return -1;
+    }
+
+    if (spec->tag < MRKDATA_STR8 && sz < mrkdata_tag_sz[spec->tag]) {
+        return -1;
+    }
+
+    switch (spec->tag) {
+        mrkdata_spec_t **fspec;
+        mnarray_iter_t it;
+        int64_t len;
+
+    case MRKDATA_UINT8:
+        dat = mrkdata_datum_make_u8(buf[0]);
+        nread = sizeof(uint8_t);
+        break;
+
+    case MRKDATA_INT8:
+        dat = mrkdata_datum_make_i8((int8_t)(buf[0] ^ 0x80));
+        nread = sizeof(int8_t);
+        break;
+
+    case MRKDATA_UINT16:
+    case MRKDATA_INT16:
+        memcpy(&v.u16, buf, sizeof(v.u16));
+        v.u16 = be16toh(v.u16);
+        dat = spec->tag == MRKDATA_UINT16 ?
+            mrkdata_datum_make_u16(v.u16) :
+            mrkdata_datum_make_i16((int16_t)(v.u16 ^ 0x8000));
+        nread = sizeof(uint16_t);
+        break;
+
+    case MRKDATA_UINT32:
+    case MRKDATA_INT32:
+        memcpy(&v.u32, buf, sizeof(v.u32));
+        v.u32 = be32toh(v.u32);
+        dat = spec->tag == MRKDATA_UINT32 ?
+            mrkdata_datum_make_u32(v.u32) :
+            mrkdata_datum_make_i32((int32_t)(v.u32 ^ 0x80000000u));
+        nread = sizeof(uint32_t);
+        break;
+
+    case MRKDATA_UINT64:
+    case MRKDATA_INT64:
+        memcpy(&v.u64, buf, sizeof(v.u64));
+        v.u64 = be64toh(v.u64);
+        dat = spec->tag == MRKDATA_UINT64 ?
+            mrkdata_datum_make_u64(v.u64) :
+            mrkdata_datum_make_i64(
+                (int64_t)(v.u64 ^ 0x8000000000000000ull));
+        nread = sizeof(uint64_t);
+        break;
+
+    case MRKDATA_DOUBLE:
+        memcpy(&v.u64, buf, sizeof(v.u64));
+        v.u64 = be64toh(v.u64);
+        if (v.u64 & 0x8000000000000000ull) {
+            v.u64 &= ~0x8000000000000000ull;
+        } else {
+            v.u64 = ~v.u64;
+        }
+        dat = mrkdata_datum_make_double(v.d);
+        nread = sizeof(double);
+        break;
+
+    case MRKDATA_STR8:
+    case MRKDATA_STR16:
+    case MRKDATA_STR32:
+    case MRKDATA_STR64:
+        if ((nread = key_scan_str(buf, sz, &len)) == 0) {
+            return -1;
+        }
+        if ((spec->tag == MRKDATA_STR8 && len > INT8_MAX) ||
+            (spec->tag == MRKDATA_STR16 && len > INT16_MAX) ||
+            (spec->tag == MRKDATA_STR32 && len > INT32_MAX)) {
+            return -1;
+        }
+        dat = spec->tag == MRKDATA_STR8 ? mrkdata_datum_make_str8(NULL, len) :
+              spec->tag == MRKDATA_STR16 ? mrkdata_datum_make_str16(NULL, len) :
+              spec->tag == MRKDATA_STR32 ? mrkdata_datum_make_str32(NULL, len) :
+              mrkdata_datum_make_str64(NULL, len);
+        key_unescape(dat->data.str, buf, len);
+        break;
+
+    case MRKDATA_STRUCT:
+        dat = mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+
+        for (fspec = array_first(&spec->fields, &it);
+             fspec != NULL;
+             fspec = array_next(&spec->fields, &it)) {
+            mrkdata_datum_t *field = NULL;
+            ssize_t n;
+
+            if ((n = key_decode(*fspec, buf + nread, sz - nread,
+                                &field)) < 0) {
+                mrkdata_datum_destroy(&dat);
+                return -1;
+            }
+            mrkdata_datum_add_field(dat, field);
+            nread += n;
+        }
+        break;
+
+    case MRKDATA_SEQ:
+        if ((fspec = array_first(&spec->fields, &it)) == NULL) {
+            return -1;
+        }
+        dat = mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+
+        while (1) {
+            mrkdata_datum_t *field = NULL;
+            ssize_t n;
+
+            if (nread >= sz) {
+                mrkdata_datum_destroy(&dat);
+                return -1;
+            }
+            if (buf[nread] == KEY_SEQ_END) {
+                ++nread;
+                break;
+            }
+            if (buf[nread++] != KEY_SEQ_ELEM) {
+                mrkdata_datum_destroy(&dat);
+                return -1;
+            }
+            if ((n = key_decode(*fspec, buf + nread, sz - nread,
+                                &field)) < 0) {
+                mrkdata_datum_destroy(&dat);
+                return -1;
+            }
+            mrkdata_datum_add_field(dat, field);
+            nread += n;
+        }
+        break;
+
+    default:
+        return -1;
+    }
+
+    *pdat = dat;
+    return nread;
+}
+
+/*
+ * Decode the key at buf into a new datum of spec.  Return the size of
+ * the key, or -1 if it is malformed.
+ */
+ssize_t
+mrkdata_key_decode(const mrkdata_spec_t *spec,
+                   const unsigned char *buf,
+                   ssize_t sz,
+                   mrkdata_datum_t **pdat)
+{
+    ssize_t res;
+
+    if ((res = key_decode(spec, buf, sz, pdat)) < 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_KEY_DECODE + 1);
+    }
+    return res;
+}
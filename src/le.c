@@ -0,0 +1,327 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Little-endian records.
+ *
+ * A little-endian record is the LE tag followed by an element encoded
+ * as usual, but for the integers and the lengths, which are stored
+ * little-endian, that is as they are in memory on the hosts we run on.
+ * Doubles are in host order, as in the plain records.
+ *
+ * A non-empty SEQ of fixed-size scalars is written as an ARRAY: the
+ * tag, the 8-byte length of the rest, the tag of the items, and the
+ * items back to back with no tags of their own.  The items can be read
+ * in place, see mrkdata_le_get_array().  They are not aligned.
+ */
+
+#define LE_ARRAY_HDRSZ (MRKDATA_EXPECT_SZ(MRKDATA_ARRAY) + sizeof(uint8_t))
+
+/*
+ * Return the item tag of spec if it is a SEQ to be written as an
+ * ARRAY, or MRKDATA_TAG_END.
+ */
+mrkdata_tag_t
+mrkdata_le_array_item(const mrkdata_spec_t *spec)
+{
+    mrkdata_spec_t **item;
+
+    if (spec->tag != MRKDATA_SEQ ||
+        (item = array_get(&spec->fields, 0)) == NULL ||
+        (*item)->tag > MRKDATA_DOUBLE) {
+        return MRKDATA_TAG_END;
+    }
+    return (*item)->tag;
+}
+
+
+/*
+ * Write the SEQ dat as an ARRAY.  Return its size, or 0.
+ */
+ssize_t
+mrkdata_le_pack_array(const mrkdata_datum_t *dat,
+                      unsigned char *buf,
+                      ssize_t sz)
+{
+    mrkdata_tag_t tag;
+    mrkdata_datum_t **field;
+    mnarray_iter_t it;
+    ssize_t itemsz, res;
+    unsigned char *p;
+
+    tag = mrkdata_le_array_item(dat->spec);
+    assert(tag != MRKDATA_TAG_END);
+    itemsz = mrkdata_tag_sz[tag];
+    res = LE_ARRAY_HDRSZ + dat->data.fields.elnum * itemsz;
+    if (sz < res) {
+        MRKDATA_STATS_ERROR(MRKDATA_PACK_DATUM + 1);
+        return 0;
+    }
+
+    MRKDATA_STATS_VALUE(MRKDATA_ARRAY);
+    buf[0] = MRKDATA_ARRAY;
+    *((uint64_t *)(buf + 1)) =
+        htole64(res - MRKDATA_EXPECT_SZ(MRKDATA_ARRAY));
+    buf[MRKDATA_EXPECT_SZ(MRKDATA_ARRAY)] = tag;
+
+    p = buf + LE_ARRAY_HDRSZ;
+    for (field = array_first(&dat->data.fields, &it);
+         field != NULL;
+         field = array_next(&dat->data.fields, &it)) {
+        const mrkdata_datum_t *f = *field;
+
+        if (f == NULL || f->spec->tag != tag) {
+            MRKDATA_STATS_ERROR(MRKDATA_PACK_DATUM + 5);
+            return 0;
+        }
+        switch (tag) {
+        case MRKDATA_UINT8:
+        case MRKDATA_INT8:
+            *p = f->value.u8;
+            break;
+
+        case MRKDATA_UINT16:
+        case MRKDATA_INT16:
+            *((uint16_t *)p) = htole16(f->value.u16);
+            break;
+
+        case MRKDATA_UINT32:
+        case MRKDATA_INT32:
+            *((uint32_t *)p) = htole32(f->value.u32);
+            break;
+
+        case MRKDATA_UINT64:
+        case MRKDATA_INT64:
+            *((uint64_t *)p) = htole64(f->value.u64);
+            break;
+
+        default:
+            *((double *)p) = f->value.d;
+        }
+        p += itemsz;
+    }
+    return res;
+}
+
+
+/*
+ * Read the ARRAY at buf into a new SEQ datum of spec.  Return its size,
+ * or 0.
+ */
+ssize_t
+mrkdata_le_unpack_array(const mrkdata_spec_t *spec,
+                        const unsigned char *buf,
+                        ssize_t sz,
+                        mrkdata_datum_t **pdat)
+{
+    mrkdata_tag_t tag;
+    mrkdata_spec_t *item;
+    mrkdata_datum_t *dat;
+    uint64_t len, i, n;
+    ssize_t itemsz;
+    const unsigned char *p;
+
+    if (sz < (ssize_t)LE_ARRAY_HDRSZ ||
+        *pdat != NULL ||
+        (tag = mrkdata_le_array_item(spec)) == MRKDATA_TAG_END ||
+        buf[MRKDATA_EXPECT_SZ(MRKDATA_ARRAY)] != tag) {
+        MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 10);
+        return 0;
+    }
+    itemsz = mrkdata_tag_sz[tag];
+    len = le64toh(*((const uint64_t *)(buf + 1)));
+    if (len < sizeof(uint8_t) ||
+        len > (uint64_t)(sz - MRKDATA_EXPECT_SZ(MRKDATA_ARRAY)) ||
+        (len - sizeof(uint8_t)) % itemsz != 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 10);
+        return 0;
+    }
+    n = (len - sizeof(uint8_t)) / itemsz;
+    item = *(mrkdata_spec_t **)array_get(&spec->fields, 0);
+
+    MRKDATA_STATS_VALUE(MRKDATA_ARRAY);
+    dat = mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+    p = buf + LE_ARRAY_HDRSZ;
+    for (i = 0; i < n; ++i) {
+        uint64_t v;
+
+        switch (tag) {
+        case MRKDATA_UINT8:
+        case MRKDATA_INT8:
+            v = *p;
+            break;
+
+        case MRKDATA_UINT16:
+        case MRKDATA_INT16:
+            v = le16toh(*((const uint16_t *)p));
+            break;
+
+        case MRKDATA_UINT32:
+        case MRKDATA_INT32:
+            v = le32toh(*((const uint32_t *)p));
+            break;
+
+        case MRKDATA_UINT64:
+        case MRKDATA_INT64:
+            v = le64toh(*((const uint64_t *)p));
+            break;
+
+        default:
+            mrkdata_datum_add_field(dat,
+                mrkdata_datum_make_double(*((const double *)p)));
+            p += itemsz;
+            continue;
+        }
+        mrkdata_datum_add_field(dat,
+            mrkdata_datum_from_spec(item, (void *)(uintptr_t)v, 0));
+        p += itemsz;
+    }
+
+    *pdat = dat;
+    return MRKDATA_EXPECT_SZ(MRKDATA_ARRAY) + len;
+}
+
+
+/*
+ * mrkdata_buf_size() of a little-endian element.
+ */
+static ssize_t
+le_elem_size(const unsigned char *buf, ssize_t sz)
+{
+    mrkdata_tag_t tag;
+    int64_t len;
+
+    if (sz <= 0) {
+        return 0;
+    }
+
+    tag = (mrkdata_tag_t)(*buf);
+
+    if (!MRKDATA_TAG_SUPPORTED(tag) && tag != MRKDATA_ARRAY) {
+        return -1;
+    }
+
+    if (sz < MRKDATA_EXPECT_SZ(tag)) {
+        return 0;
+    }
+
+    switch (tag) {
+    case MRKDATA_STR8:
+        len = (int8_t)buf[1];
+        break;
+
+    case MRKDATA_STR16:
+        len = (int16_t)le16toh(*((const uint16_t *)(buf + 1)));
+        break;
+
+    case MRKDATA_STR32:
+        len = (int32_t)le32toh(*((const uint32_t *)(buf + 1)));
+        break;
+
+    case MRKDATA_STR64:
+    case MRKDATA_STRUCT:
+    case MRKDATA_SEQ:
+    case MRKDATA_ARRAY:
+        len = (int64_t)le64toh(*((const uint64_t *)(buf + 1)));
+        break;
+
+    default:
+        len = 0;
+    }
+
+    if (len < 0 || len > SSIZE_MAX - MRKDATA_EXPECT_SZ(tag)) {
+        return -1;
+    }
+
+    return MRKDATA_EXPECT_SZ(tag) + len;
+}
+
+
+/*
+ * mrkdata_buf_get_field() of a little-endian record, or of an element
+ * inside one.
+ */
+const unsigned char *
+mrkdata_le_buf_get_field(const unsigned char *buf,
+                         ssize_t sz,
+                         unsigned idx,
+                         ssize_t *psz)
+{
+    ssize_t recsz, fsz;
+    const unsigned char *end;
+
+    if (sz > 0 && buf[0] == MRKDATA_LE) {
+        ++buf;
+        --sz;
+    }
+
+    if ((recsz = le_elem_size(buf, sz)) <= 0 || recsz > sz) {
+        return NULL;
+    }
+
+    if (buf[0] != MRKDATA_STRUCT && buf[0] != MRKDATA_SEQ) {
+        return NULL;
+    }
+
+    end = buf + recsz;
+    buf += MRKDATA_EXPECT_SZ(MRKDATA_STRUCT);
+
+    while (1) {
+        if ((fsz = le_elem_size(buf, end - buf)) <= 0 ||
+            fsz > end - buf) {
+            return NULL;
+        }
+        if (idx == 0) {
+            *psz = fsz;
+            return buf;
+        }
+        buf += fsz;
+        --idx;
+    }
+}
+
+
+/*
+ * Return the items of the ARRAY at buf, a little-endian record or an
+ * element inside one, with their tag in *ptag and their number in *pn.
+ * Return NULL if buf is not an ARRAY, or it does not fit in sz.
+ */
+const void *
+mrkdata_le_get_array(const unsigned char *buf,
+                     ssize_t sz,
+                     mrkdata_tag_t *ptag,
+                     uint64_t *pn)
+{
+    ssize_t recsz;
+    mrkdata_tag_t tag;
+
+    if (sz > 0 && buf[0] == MRKDATA_LE) {
+        ++buf;
+        --sz;
+    }
+
+    if ((recsz = le_elem_size(buf, sz)) < (ssize_t)LE_ARRAY_HDRSZ ||
+        recsz > sz ||
+        buf[0] != MRKDATA_ARRAY) {
+        return NULL;
+    }
+
+    tag = buf[MRKDATA_EXPECT_SZ(MRKDATA_ARRAY)];
+    if (tag > MRKDATA_DOUBLE ||
+        (recsz - LE_ARRAY_HDRSZ) % mrkdata_tag_sz[tag] != 0) {
+        return NULL;
+    }
+    *ptag = tag;
+    *pn = (recsz - LE_ARRAY_HDRSZ) / mrkdata_tag_sz[tag];
+    return buf + LE_ARRAY_HDRSZ;
+}
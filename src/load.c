@@ -0,0 +1,718 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Bulk loader of delimited text lines, such as the deflog files, into
+ * packed records.
+ *
+ * Each line is split by the delimiters of a format tree that parallels
+ * the spec, and packed straight into an output buffer, headers first
+ * reserved and then patched.  A STRUCT takes one field per delimited
+ * part, the last field taking the rest of the part.  A SEQ takes one
+ * item per part.  A dict is a SEQ of STRUCT {key, value} whose item has
+ * its own delimiter.
+ *
+ * The file is cut in chunks of chunksz bytes, and a line belongs to the
+ * chunk it starts in.  Worker threads read and pack chunks into a ring
+ * of depth slots, and the calling thread hands out the records of the
+ * slots in file order.
+ */
+
+#define LOAD_DEFAULT_CHUNKSZ (4 * 1024 * 1024)
+#define LOAD_DEFAULT_DEPTH 8
+#define LOAD_DEFAULT_NTHREADS 4
+#define LOAD_READSZ (64 * 1024)
+
+#define LOAD_FREE 0
+#define LOAD_BUSY 1
+#define LOAD_DONE 2
+#define LOAD_ERROR 3
+
+typedef struct _load_writer {
+    unsigned char *buf;
+    ssize_t sz;
+    ssize_t pos;
+    /* realloc buf as needed, or fail when it is full */
+    int grow;
+} load_writer_t;
+
+typedef struct _load_slot {
+    char *in;
+    ssize_t insz;
+    load_writer_t out;
+    uint64_t nbad;
+    int state;
+} load_slot_t;
+
+typedef struct _load {
+    int fd;
+    off_t end;
+    ssize_t chunksz;
+    unsigned depth;
+    const mrkdata_spec_t *spec;
+    const mrkdata_load_fmt_t *fmt;
+    uint64_t nchunks;
+    uint64_t issue;
+    uint64_t consume;
+    int stop;
+    load_slot_t *slots;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+} load_t;
+
+
+/*
+ * The first c in [p, end), or end.
+ */
+static const char *
+load_find(const char *p, const char *end, char c)
+{
+#if defined(__AVX2__)
+    const __m256i vc = _mm256_set1_epi8(c);
+
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask;
+
+        if ((mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vc))) != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i vc = _mm_set1_epi8(c);
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask;
+
+        if ((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vc))) != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != c) {
+        ++p;
+    }
+    return p;
+}
+
+
+static int
+lw_reserve(load_writer_t *lw, ssize_t sz)
+{
+    if (lw->sz - lw->pos < sz) {
+        ssize_t nsz;
+
+        if (!lw->grow) {
+            return -1;
+        }
+        for (nsz = MAX(lw->sz, 4096); nsz - lw->pos < sz; nsz *= 2) {
+            ;
+        }
+        if ((lw->buf = realloc(lw->buf, nsz)) == NULL) {
+            FAIL("realloc");
+        }
+        MRKDATA_STATS_ALLOC(nsz - lw->sz);
+        lw->sz = nsz;
+    }
+    return 0;
+}
+
+
+/*
+ * Digits of [p, end) as a number, at most 19 of them.
+ */
+static int
+load_digits(const char *p, const char *end, uint64_t *pv)
+{
+    uint64_t v = 0;
+
+    if (p == end || end - p > 19) {
+        return -1;
+    }
+    for (; p < end; ++p) {
+        unsigned d = (unsigned char)*p - '0';
+
+        if (d > 9) {
+            return -1;
+        }
+        v = v * 10 + d;
+    }
+    *pv = v;
+    return 0;
+}
+
+
+/*
+ * Days since 1970-01-01 of a proleptic Gregorian date.
+ */
+static int64_t
+days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+    int64_t era;
+    unsigned yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned)(y - era * 400);
+    doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+
+/*
+ * "YYYY-MM-DD[T ]hh:mm:ss[.fff][Z|+hh:mm|-hh:mm]" as UTC seconds since
+ * the epoch.  The fraction is dropped.
+ */
+static int
+load_timestamp(const char *p, const char *end, int64_t *pv)
+{
+    uint64_t y, mo, d, h, mi, s, oh = 0, om = 0;
+    int64_t off = 0;
+
+    if (end - p < 19 ||
+        p[4] != '-' || p[7] != '-' ||
+        (p[10] != 'T' && p[10] != ' ') ||
+        p[13] != ':' || p[16] != ':' ||
+        load_digits(p, p + 4, &y) != 0 ||
+        load_digits(p + 5, p + 7, &mo) != 0 ||
+        load_digits(p + 8, p + 10, &d) != 0 ||
+        load_digits(p + 11, p + 13, &h) != 0 ||
+        load_digits(p + 14, p + 16, &mi) != 0 ||
+        load_digits(p + 17, p + 19, &s) != 0) {
+        return -1;
+    }
+    if (mo < 1 || mo > 12 || d < 1 || d > 31 ||
+        h > 23 || mi > 59 || s > 60) {
+        return -1;
+    }
+
+    p += 19;
+    if (p < end && *p == '.') {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+            ;
+        }
+    }
+    if (p < end && *p == 'Z') {
+        ++p;
+    } else if (p < end && (*p == '+' || *p == '-')) {
+        int neg = *p == '-';
+
+        if (end - p == 6 && p[3] == ':') {
+            if (load_digits(p + 1, p + 3, &oh) != 0 ||
+                load_digits(p + 4, p + 6, &om) != 0) {
+                return -1;
+            }
+        } else if (end - p == 5) {
+            if (load_digits(p + 1, p + 3, &oh) != 0 ||
+                load_digits(p + 3, p + 5, &om) != 0) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+        off = (int64_t)(oh * 3600 + om * 60);
+        off = neg ? -off : off;
+        p = end;
+    }
+    if (p != end) {
+        return -1;
+    }
+
+    *pv = days_from_civil(y, mo, d) * 86400 +
+          (int64_t)(h * 3600 + mi * 60 + s) - off;
+    return 0;
+}
+
+
+static int
+load_double(const char *p, const char *end, double *pv)
+{
+    char tmp[64];
+    char *te;
+
+    if (p == end || end - p >= (ssize_t)sizeof(tmp)) {
+        return -1;
+    }
+    memcpy(tmp, p, end - p);
+    tmp[end - p] = '\0';
+    *pv = strtod(tmp, &te);
+    return te == tmp + (end - p) ? 0 : -1;
+}
+
+
+static int
+load_scalar(const mrkdata_spec_t *spec,
+            const mrkdata_load_fmt_t *fmt,
+            const char *p,
+            const char *end,
+            load_writer_t *lw)
+{
+    mrkdata_tag_t tag = spec->tag;
+    unsigned char *b;
+    uint64_t u;
+    int neg = 0;
+
+    if (lw_reserve(lw, MRKDATA_EXPECT_SZ(tag)) != 0) {
+        return -1;
+    }
+    b = lw->buf + lw->pos;
+    b[0] = tag;
+
+    if (tag == MRKDATA_DOUBLE) {
+        double d;
+
+        if (load_double(p, end, &d) != 0) {
+            return -1;
+        }
+        memcpy(b + 1, &d, sizeof(d));
+        lw->pos += MRKDATA_EXPECT_SZ(tag);
+        return 0;
+    }
+
+    if (tag > MRKDATA_INT64) {
+        return -1;
+    }
+
+    if (fmt != NULL &&
+        (fmt->flags & MRKDATA_LOAD_TIMESTAMP) &&
+        load_digits(p, end, &u) != 0) {
+        int64_t ts;
+
+        if (load_timestamp(p, end, &ts) != 0) {
+            return -1;
+        }
+        neg = ts < 0;
+        u = neg ? -(uint64_t)ts : (uint64_t)ts;
+    } else {
+        if (p < end && (*p == '-' || *p == '+')) {
+            neg = *p == '-';
+            ++p;
+        }
+        if (load_digits(p, end, &u) != 0) {
+            return -1;
+        }
+    }
+
+    if (mrkdata_int_fit(tag, neg, &u) != 0) {
+        return -1;
+    }
+
+    mrkdata_pack_uint(b + 1, u, mrkdata_tag_sz[tag]);
+    lw->pos += MRKDATA_EXPECT_SZ(tag);
+    return 0;
+}
+
+
+static int
+load_string(const mrkdata_spec_t *spec,
+            const char *p,
+            const char *end,
+            load_writer_t *lw)
+{
+    mrkdata_tag_t tag = spec->tag;
+    int64_t len = end - p;
+
+    if ((tag == MRKDATA_STR8 && len > INT8_MAX) ||
+        (tag == MRKDATA_STR16 && len > INT16_MAX) ||
+        (tag == MRKDATA_STR32 && len > INT32_MAX)) {
+        return -1;
+    }
+    if (lw_reserve(lw, MRKDATA_EXPECT_SZ(tag) + len) != 0) {
+        return -1;
+    }
+    lw->buf[lw->pos] = tag;
+    mrkdata_pack_uint(lw->buf + lw->pos + 1, len, mrkdata_tag_sz[tag]);
+    memcpy(lw->buf + lw->pos + MRKDATA_EXPECT_SZ(tag), p, len);
+    lw->pos += MRKDATA_EXPECT_SZ(tag) + len;
+    return 0;
+}
+
+
+static int load_elem(const mrkdata_spec_t *,
+                     const mrkdata_load_fmt_t *,
+                     const char *,
+                     const char *,
+                     load_writer_t *,
+                     unsigned);
+
+static int
+load_container(const mrkdata_spec_t *spec,
+               const mrkdata_load_fmt_t *fmt,
+               const char *p,
+               const char *end,
+               load_writer_t *lw,
+               unsigned depth)
+{
+    ssize_t start = lw->pos;
+    unsigned i, nfields = spec->fields.elnum;
+
+    if (fmt == NULL ||
+        nfields == 0 ||
+        lw_reserve(lw, MRKDATA_EXPECT_SZ(spec->tag)) != 0) {
+        return -1;
+    }
+    lw->pos += MRKDATA_EXPECT_SZ(spec->tag);
+
+    if (spec->tag == MRKDATA_STRUCT) {
+        for (i = 0; i < nfields; ++i) {
+            mrkdata_spec_t **field = array_get(&spec->fields, i);
+            const char *q;
+
+            if (i == nfields - 1) {
+                q = end;
+            } else if ((q = load_find(p, end, fmt->delim)) == end) {
+                return -1;
+            }
+            if (load_elem(*field,
+                          fmt->fields != NULL ? fmt->fields[i] : NULL,
+                          p, q, lw, depth + 1) != 0) {
+                return -1;
+            }
+            p = q + 1;
+        }
+    } else {
+        mrkdata_spec_t **item = array_get(&spec->fields, 0);
+
+        while (p < end) {
+            const char *q = load_find(p, end, fmt->delim);
+
+            if (load_elem(*item,
+                          fmt->fields != NULL ? fmt->fields[0] : NULL,
+                          p, q, lw, depth + 1) != 0) {
+                return -1;
+            }
+            p = q + 1;
+        }
+    }
+
+    lw->buf[start] = spec->tag;
+    mrkdata_pack_uint(lw->buf + start + 1,
+                      lw->pos - start - MRKDATA_EXPECT_SZ(spec->tag),
+                      mrkdata_tag_sz[spec->tag]);
+    return 0;
+}
+
+
+static int
+load_elem(const mrkdata_spec_t *spec,
+          const mrkdata_load_fmt_t *fmt,
+          const char *p,
+          const char *end,
+          load_writer_t *lw,
+          unsigned depth)
+{
+    if (depth >= MRKDATA_MAXDEPTH) {
+        return -1;
+    }
+    if (spec->tag == MRKDATA_STRUCT || spec->tag == MRKDATA_SEQ) {
+        return load_container(spec, fmt, p, end, lw, depth);
+    }
+    if (spec->tag >= MRKDATA_STR8 && spec->tag <= MRKDATA_STR64) {
+        return load_string(spec, p, end, lw);
+    }
+    return load_scalar(spec, fmt, p, end, lw);
+}
+
+
+/*
+ * Pack the line of sz bytes at line, with no line terminator, into buf
+ * as a record of spec, as described by fmt.  Return the record size, or
+ * 0 if the line does not match or the record does not fit in bufsz.
+ */
+ssize_t
+mrkdata_load_line(const mrkdata_spec_t *spec,
+                  const mrkdata_load_fmt_t *fmt,
+                  const char *line,
+                  size_t sz,
+                  unsigned char *buf,
+                  ssize_t bufsz)
+{
+    load_writer_t lw = {buf, bufsz, 0, 0};
+
+    if (load_elem(spec, fmt, line, line + sz, &lw, 0) != 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_LOAD_LINE + 1);
+        return 0;
+    }
+    return lw.pos;
+}
+
+
+/*
+ * Read sz bytes at off into the slot input buffer at pos.
+ */
+static int
+load_read(load_t *ld, load_slot_t *slot, ssize_t pos, off_t off, ssize_t sz)
+{
+    ssize_t nread;
+
+    if (pos + sz > slot->insz) {
+        if ((slot->in = realloc(slot->in, pos + sz)) == NULL) {
+            FAIL("realloc");
+        }
+        MRKDATA_STATS_ALLOC(pos + sz - slot->insz);
+        slot->insz = pos + sz;
+    }
+    while (sz > 0) {
+        if ((nread = pread(ld->fd, slot->in + pos, sz, off)) <= 0) {
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        pos += nread;
+        off += nread;
+        sz -= nread;
+    }
+    return 0;
+}
+
+
+/*
+ * Pack the lines starting in chunk n.  The read starts a byte early to
+ * see whether the chunk starts a line, and goes on past the chunk to
+ * the end of its last line.
+ */
+static int
+load_chunk(load_t *ld, load_slot_t *slot, uint64_t n)
+{
+    off_t off = (off_t)(n * ld->chunksz);
+    off_t rdoff = n > 0 ? off - 1 : off;
+    ssize_t len, lim, pos;
+
+    len = MIN(off + ld->chunksz, ld->end) - rdoff;
+    if (load_read(ld, slot, 0, rdoff, len) != 0) {
+        return -1;
+    }
+    /* lines starting before lim are ours */
+    lim = len;
+
+    pos = 0;
+    if (n > 0) {
+        pos = load_find(slot->in, slot->in + len, '\n') - slot->in + 1;
+    }
+
+    while (pos < lim) {
+        const char *p = slot->in + pos, *q;
+        ssize_t linestart = slot->out.pos;
+
+        q = load_find(p, slot->in + len, '\n');
+        if (q == slot->in + len && rdoff + len < ld->end) {
+            ssize_t more = MIN((off_t)LOAD_READSZ, ld->end - rdoff - len);
+
+            if (load_read(ld, slot, len, rdoff + len, more) != 0) {
+                return -1;
+            }
+            len += more;
+            continue;
+        }
+
+        if (q > p && q[-1] == '\r') {
+            --q;
+        }
+        if (q > p && load_elem(ld->spec, ld->fmt, p, q,
+                               &slot->out, 0) != 0) {
+            slot->out.pos = linestart;
+            ++slot->nbad;
+        }
+        pos = load_find(q, slot->in + len, '\n') - slot->in + 1;
+    }
+    return 0;
+}
+
+
+static void *
+load_worker(void *arg)
+{
+    load_t *ld = arg;
+
+    pthread_mutex_lock(&ld->mtx);
+    while (1) {
+        load_slot_t *slot;
+        uint64_t n;
+        int res;
+
+        while (!ld->stop &&
+               ld->issue < ld->nchunks &&
+               ld->slots[ld->issue % ld->depth].state != LOAD_FREE) {
+            pthread_cond_wait(&ld->cond, &ld->mtx);
+        }
+        if (ld->stop || ld->issue >= ld->nchunks) {
+            break;
+        }
+
+        n = ld->issue++;
+        slot = &ld->slots[n % ld->depth];
+        slot->state = LOAD_BUSY;
+        pthread_mutex_unlock(&ld->mtx);
+
+        slot->out.pos = 0;
+        slot->nbad = 0;
+        res = load_chunk(ld, slot, n);
+
+        pthread_mutex_lock(&ld->mtx);
+        slot->state = res == 0 ? LOAD_DONE : LOAD_ERROR;
+        pthread_cond_broadcast(&ld->cond);
+    }
+    pthread_mutex_unlock(&ld->mtx);
+
+    return NULL;
+}
+
+
+static int
+load_consume(load_t *ld,
+             mrkdata_frecord_cb_t cb,
+             void *udata,
+             uint64_t *pnbad)
+{
+    int res = 0;
+
+    while (ld->consume < ld->nchunks) {
+        load_slot_t *slot;
+        const unsigned char *buf, *end;
+        ssize_t recsz;
+
+        slot = &ld->slots[ld->consume % ld->depth];
+
+        pthread_mutex_lock(&ld->mtx);
+        while (slot->state == LOAD_FREE || slot->state == LOAD_BUSY) {
+            pthread_cond_wait(&ld->cond, &ld->mtx);
+        }
+        pthread_mutex_unlock(&ld->mtx);
+
+        if (slot->state == LOAD_ERROR) {
+            return MRKDATA_LOAD_FD + 2;
+        }
+
+        if (pnbad != NULL) {
+            *pnbad += slot->nbad;
+        }
+        buf = slot->out.buf;
+        end = buf + slot->out.pos;
+        for (; buf < end; buf += recsz) {
+            recsz = mrkdata_buf_size(buf, end - buf);
+            assert(recsz > 0 && recsz <= end - buf);
+            if ((res = cb(buf, recsz, udata)) != 0) {
+                return res;
+            }
+        }
+
+        pthread_mutex_lock(&ld->mtx);
+        slot->state = LOAD_FREE;
+        ++ld->consume;
+        pthread_cond_broadcast(&ld->cond);
+        pthread_mutex_unlock(&ld->mtx);
+    }
+    return res;
+}
+
+
+/*
+ * Pack every line of the file at fd as a record of spec, as described
+ * by fmt, and call cb on the records in file order in the calling
+ * thread.  Empty lines are skipped, and lines that do not match are
+ * skipped and counted in *pnbad, if not NULL.  A non-zero return from
+ * cb stops the load and is returned.
+ */
+int
+mrkdata_load_fd(int fd,
+                const mrkdata_spec_t *spec,
+                const mrkdata_load_fmt_t *fmt,
+                const mrkdata_load_params_t *params,
+                mrkdata_frecord_cb_t cb,
+                void *udata,
+                uint64_t *pnbad)
+{
+    load_t ld;
+    struct stat sb;
+    pthread_t *threads;
+    unsigned i, nthreads;
+    int res;
+
+    if (pnbad != NULL) {
+        *pnbad = 0;
+    }
+
+    ld.fd = fd;
+    ld.spec = spec;
+    ld.fmt = fmt;
+    ld.chunksz = params != NULL && params->chunksz > 0 ?
+        params->chunksz : LOAD_DEFAULT_CHUNKSZ;
+    ld.depth = params != NULL && params->depth > 0 ?
+        params->depth : LOAD_DEFAULT_DEPTH;
+    nthreads = params != NULL && params->nthreads > 0 ?
+        params->nthreads : LOAD_DEFAULT_NTHREADS;
+    nthreads = MIN(nthreads, ld.depth);
+
+    if (spec == NULL || fstat(fd, &sb) != 0) {
+        TRRET(MRKDATA_LOAD_FD + 1);
+    }
+    ld.end = sb.st_size;
+    ld.nchunks = (ld.end + ld.chunksz - 1) / ld.chunksz;
+    ld.issue = 0;
+    ld.consume = 0;
+    ld.stop = 0;
+
+    if ((ld.slots = calloc(ld.depth, sizeof(load_slot_t))) == NULL) {
+        FAIL("calloc");
+    }
+    for (i = 0; i < ld.depth; ++i) {
+        ld.slots[i].out.grow = 1;
+        ld.slots[i].state = LOAD_FREE;
+    }
+
+    pthread_mutex_init(&ld.mtx, NULL);
+    pthread_cond_init(&ld.cond, NULL);
+
+    if ((threads = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+        FAIL("calloc");
+    }
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, load_worker, &ld) != 0) {
+            FAIL("pthread_create");
+        }
+    }
+
+    res = load_consume(&ld, cb, udata, pnbad);
+
+    pthread_mutex_lock(&ld.mtx);
+    ld.stop = 1;
+    pthread_cond_broadcast(&ld.cond);
+    pthread_mutex_unlock(&ld.mtx);
+
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    pthread_cond_destroy(&ld.cond);
+    pthread_mutex_destroy(&ld.mtx);
+    for (i = 0; i < ld.depth; ++i) {
+        free(ld.slots[i].in);
+        free(ld.slots[i].out.buf);
+    }
+    free(ld.slots);
+
+    TRRET(res);
+}
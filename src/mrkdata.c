@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <sys/endian.h>
 
@@ -19,8 +20,8 @@ static unsigned mflags = 0;
 /*
  * Sync with enum _mrkdata_tag
  */
-static ssize_t
-tag_sz[] = {
+const ssize_t
+mrkdata_tag_sz[] = {
     sizeof(uint8_t),    /* UINT8 */
     sizeof(int8_t),     /* INT8 */
     sizeof(uint16_t),   /* UINT16 */
@@ -38,13 +39,29 @@ tag_sz[] = {
     sizeof(uint64_t),   /* SEQ sz */
     sizeof(uint64_t),   /* DICT sz */
     sizeof(uint64_t),   /* FUNC sz */
+    sizeof(uint16_t),   /* STRREF index */
+    sizeof(uint64_t),   /* INTSEQ sz */
+    sizeof(uint64_t),   /* SEQIDX sz */
+    sizeof(uint64_t),   /* SPARSE sz */
+    sizeof(uint64_t),   /* ARRAY sz */
+    0,                  /* LE */
+    sizeof(uint64_t),   /* CRC sz */
 };
 
 static mrkdata_spec_t builtin_specs[MRKDATA_BUILTIN_TAG_END];
 static mnarray_t specs;
 
-#define EXPECT_SZ(t) ((ssize_t)(sizeof(char) + tag_sz[t]))
+#define EXPECT_SZ(t) MRKDATA_EXPECT_SZ(t)
+
+/* byte order of the integers and lengths, see le.c */
+#define WIRE16(f, v) ((f) & MRKDATA_WIRE_LE ? htole16(v) : htobe16(v))
+#define WIRE32(f, v) ((f) & MRKDATA_WIRE_LE ? htole32(v) : htobe32(v))
+#define WIRE64(f, v) ((f) & MRKDATA_WIRE_LE ? htole64(v) : htobe64(v))
+#define UNWIRE16(f, v) ((f) & MRKDATA_WIRE_LE ? le16toh(v) : be16toh(v))
+#define UNWIRE32(f, v) ((f) & MRKDATA_WIRE_LE ? le32toh(v) : be32toh(v))
+#define UNWIRE64(f, v) ((f) & MRKDATA_WIRE_LE ? le64toh(v) : be64toh(v))
 #define EXPECT_EXTERNAL (-1)
+#define TAG_SUPPORTED(t) MRKDATA_TAG_SUPPORTED(t)
 
 static int datum_init(mrkdata_datum_t *);
 
@@ -55,27 +72,88 @@ null_pointer_initializer(void **p)
     return 0;
 }
 
+/* drop the packed bytes of dat, see mrkdata_unpack_buf_cached() */
+static void
+datum_uncache(mrkdata_datum_t *dat)
+{
+    if (dat->packedbuf != NULL) {
+        if (__atomic_sub_fetch(&dat->packedbuf->nref,
+                               1,
+                               __ATOMIC_ACQ_REL) == 0) {
+            free(dat->packedbuf);
+        }
+        dat->packedbuf = NULL;
+        dat->packed = NULL;
+    }
+}
+
+/*
+ * A datum may be shared by several parents, so there is no way up the
+ * tree from it.  Size changes are propagated by the callers that know
+ * the path, see mrkdata_datum_set_path().  Every change to a container
+ * goes through here, and makes its packed bytes stale.
+ */
 static void
 mrkdata_datum_adjust_packsz(mrkdata_datum_t *dat, ssize_t sz)
 {
+    datum_uncache(dat);
     dat->packsz += sz;
     if (dat->spec->tag == MRKDATA_STRUCT || dat->spec->tag == MRKDATA_SEQ) {
         dat->value.sz64 += sz;
     }
-
-    if (dat->parent != NULL) {
-        mrkdata_datum_adjust_packsz(dat->parent, sz);
-    }
 }
 
-ssize_t
-mrkdata_pack_datum(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
+/*
+ * With a string dictionary, strings may be written as references, and
+ * with MRKDATA_WIRE_LE, SEQs of scalars as ARRAYs.  The containers are
+ * then shorter than their packsz.
+ */
+static ssize_t
+pack_datum(const mrkdata_datum_t *dat,
+           unsigned char *buf,
+           ssize_t sz,
+           mrkdata_strdict_t *dict,
+           unsigned flags)
 {
+    unsigned char *start = buf;
 
     if (dat->packsz > sz) {
+        MRKDATA_STATS_ERROR(MRKDATA_PACK_DATUM + 1);
+        return 0;
+    }
+
+    /* only a stream writer has the body */
+    if (MRKDATA_STREAMED(dat)) {
+        MRKDATA_STATS_ERROR(MRKDATA_PACK_DATUM + 6);
         return 0;
     }
 
+    /* unchanged since unpacked */
+    if (dat->packed != NULL && dict == NULL && flags == 0) {
+        MRKDATA_STATS_VALUE(dat->spec->tag);
+        memcpy(buf, dat->packed, dat->packsz);
+        return dat->packsz;
+    }
+
+    if (dict != NULL &&
+        dat->spec->tag >= MRKDATA_STR8 &&
+        dat->spec->tag <= MRKDATA_STR64) {
+        ssize_t nref;
+
+        if ((nref = mrkdata_strdict_pack_ref(dict, dat, buf)) > 0) {
+            MRKDATA_STATS_VALUE(MRKDATA_STRREF);
+            return nref;
+        }
+    }
+
+    if ((flags & MRKDATA_WIRE_LE) &&
+        mrkdata_le_array_item(dat->spec) != MRKDATA_TAG_END &&
+        dat->data.fields.elnum > 0) {
+        return mrkdata_le_pack_array(dat, buf, sz);
+    }
+
+    MRKDATA_STATS_VALUE(dat->spec->tag);
+
     *buf = dat->spec->tag;
     ++buf;
     --sz;
@@ -94,27 +172,27 @@ mrkdata_pack_datum(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
             break;
 
         case MRKDATA_UINT16:
-            *((uint16_t *)buf) = htons(dat->value.u16);
+            *((uint16_t *)buf) = WIRE16(flags, dat->value.u16);
             break;
 
         case MRKDATA_INT16:
-            *((int16_t *)buf) = htons(dat->value.i16);
+            *((int16_t *)buf) = WIRE16(flags, dat->value.i16);
             break;
 
         case MRKDATA_UINT32:
-            *((uint32_t *)buf) = htonl(dat->value.u32);
+            *((uint32_t *)buf) = WIRE32(flags, dat->value.u32);
             break;
 
         case MRKDATA_INT32:
-            *((int32_t *)buf) = htonl(dat->value.i32);
+            *((int32_t *)buf) = WIRE32(flags, dat->value.i32);
             break;
 
         case MRKDATA_UINT64:
-            *((uint64_t *)buf) = htobe64(dat->value.u64);
+            *((uint64_t *)buf) = WIRE64(flags, dat->value.u64);
             break;
 
         case MRKDATA_INT64:
-            *((int64_t *)buf) = htobe64(dat->value.i64);
+            *((int64_t *)buf) = WIRE64(flags, dat->value.i64);
             break;
 
         case MRKDATA_DOUBLE:
@@ -128,26 +206,26 @@ mrkdata_pack_datum(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
             break;
 
         case MRKDATA_STR16:
-            *((int16_t *)buf) = htons(dat->value.sz16);
+            *((int16_t *)buf) = WIRE16(flags, dat->value.sz16);
             buf += sizeof(int16_t);
             memcpy(buf, dat->data.str, dat->value.sz16);
             break;
 
         case MRKDATA_STR32:
-            *((int32_t *)buf) = htonl(dat->value.sz32);
+            *((int32_t *)buf) = WIRE32(flags, dat->value.sz32);
             buf += sizeof(int32_t);
             memcpy(buf, dat->data.str, dat->value.sz32);
             break;
 
         case MRKDATA_STR64:
-            *((int64_t *)buf) = htobe64(dat->value.sz64);
+            *((int64_t *)buf) = WIRE64(flags, dat->value.sz64);
             buf += sizeof(int64_t);
             memcpy(buf, dat->data.str, dat->value.sz64);
             break;
 
         case MRKDATA_STRUCT:
         case MRKDATA_SEQ:
-            *((int64_t *)buf) = htobe64(dat->value.sz64);
+            *((int64_t *)buf) = WIRE64(flags, dat->value.sz64);
             buf += sizeof(int64_t);
             sz -= sizeof(int64_t);
             for (field = array_first(&dat->data.fields, &it);
@@ -155,16 +233,29 @@ mrkdata_pack_datum(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
                  field = array_next(&dat->data.fields, &it)) {
 
                 if (sz <= 0) {
+                    MRKDATA_STATS_ERROR(MRKDATA_PACK_DATUM + 2);
+                    return 0;
+                }
+
+                /* absent, only in a sparse STRUCT */
+                if (*field == NULL) {
+                    MRKDATA_STATS_ERROR(MRKDATA_PACK_DATUM + 4);
                     return 0;
                 }
 
-                if ((nwritten = mrkdata_pack_datum(*field, buf, sz)) == 0) {
+                if ((nwritten = pack_datum(*field, buf, sz, dict, flags)) == 0) {
+                    return 0;
                 }
 
                 buf += nwritten;
                 sz -= nwritten;
             }
 
+            if (dict != NULL || flags != 0) {
+                *((int64_t *)(start + 1)) =
+                    WIRE64(flags, buf - start - EXPECT_SZ(dat->spec->tag));
+                return buf - start;
+            }
             break;
 
         default:
@@ -173,6 +264,7 @@ mrkdata_pack_datum(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
              *  MRKDATA_DICT
              *  MRKDATA_FUNC
              */
+            MRKDATA_STATS_ERROR(MRKDATA_PACK_DATUM + 3);
             return 0;
 
     }
@@ -180,23 +272,81 @@ mrkdata_pack_datum(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
 }
 
 ssize_t
-mrkdata_unpack_buf(const mrkdata_spec_t *spec,
-                   const unsigned char *buf,
-                   ssize_t sz,
-                   mrkdata_datum_t **pdat)
+mrkdata_pack_datum(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
+{
+    ssize_t res;
+    int slot = -1;
+    struct timespec ts;
+    mrkdata_stats_t *st;
+
+    if (__atomic_load_n(&mrkdata_stats_nhist, __ATOMIC_RELAXED) > 0) {
+        slot = mrkdata_stats_sample_begin(dat->spec, &ts);
+    }
+
+    res = pack_datum(dat, buf, sz, NULL, 0);
+
+    if (slot >= 0) {
+        mrkdata_stats_sample_end(slot, MRKDATA_STATS_PACK, &ts);
+    }
+
+    if (res > 0) {
+        st = MRKDATA_STATS();
+        ++st->npacked;
+        st->bpacked += res;
+    }
+
+    return res;
+}
+
+/*
+ * With a string dictionary, references are resolved to the kept string
+ * datums, and with MRKDATA_WIRE_LE, ARRAYs to SEQs.  The datums get the
+ * sizes of their plain packing.
+ */
+static ssize_t
+unpack_buf(const mrkdata_spec_t *spec,
+           const unsigned char *buf,
+           ssize_t sz,
+           mrkdata_datum_t **pdat,
+           mrkdata_strdict_t *dict,
+           unsigned flags)
 {
     mrkdata_tag_t tag;
     ssize_t valsz;
     mrkdata_datum_t *dat;
+    const unsigned char *start = buf;
 
     assert(pdat != NULL);
 
     if (sz <= 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 1);
         return 0;
     }
 
+    if (dict != NULL && *buf == MRKDATA_STRREF) {
+        mrkdata_datum_t *ref;
+
+        if (sz < EXPECT_SZ(MRKDATA_STRREF) ||
+            *pdat != NULL ||
+            (ref = mrkdata_strdict_get(dict, buf + 1)) == NULL ||
+            ref->spec->tag != spec->tag) {
+            MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 8);
+            return 0;
+        }
+        MRKDATA_STATS_VALUE(MRKDATA_STRREF);
+        *pdat = mrkdata_datum_clone(ref);
+        return EXPECT_SZ(MRKDATA_STRREF);
+    }
+
+    if ((flags & MRKDATA_WIRE_LE) && *buf == MRKDATA_ARRAY) {
+        return mrkdata_le_unpack_array(spec, buf, sz, pdat);
+    }
+
     if (*pdat == NULL) {
-        *pdat = malloc(sizeof(mrkdata_datum_t));
+        if ((*pdat = malloc(sizeof(mrkdata_datum_t))) == NULL) {
+            FAIL("malloc");
+        }
+        MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
         datum_init(*pdat);
 
     }
@@ -205,6 +355,7 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
     tag = (mrkdata_tag_t)(*buf);
 
     if (tag != spec->tag) {
+        MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 2);
         return 0;
     }
     (*pdat)->spec = spec;
@@ -212,9 +363,12 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
     valsz = EXPECT_SZ(spec->tag);
 
     if (sz < valsz) {
+        MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 3);
         return 0;
     }
 
+    MRKDATA_STATS_VALUE(tag);
+
     /* must be *after* the above test */
     buf += sizeof(char);
     sz -= sizeof(char);
@@ -243,103 +397,117 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
         buf += sizeof(int8_t);
         sz -= sizeof(int8_t);
         if (sz < dat->value.sz8 || dat->value.sz8 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 4);
             return 0;
         }
         dat->packsz += dat->value.sz8;
         if ((dat->data.str = malloc(dat->value.sz8)) == NULL) {
             FAIL("malloc");
         }
+        MRKDATA_STATS_ALLOC(dat->value.sz8);
         memcpy(dat->data.str, buf, dat->value.sz8);
         buf += dat->value.sz8;
         sz -= dat->value.sz8;
         break;
 
     case MRKDATA_UINT16:
-        dat->value.u16 = ntohs(*((uint16_t *)buf));
+        dat->value.u16 = UNWIRE16(flags, *((uint16_t *)buf));
         buf += sizeof(uint16_t);
         sz -= sizeof(uint16_t);
         break;
 
     case MRKDATA_INT16:
-        dat->value.i16 = (int16_t)ntohs(*((uint16_t *)buf));
+        dat->value.i16 = (int16_t)UNWIRE16(flags, *((uint16_t *)buf));
         buf += sizeof(int16_t);
         sz -= sizeof(int16_t);
         break;
 
     case MRKDATA_STR16:
-        dat->value.sz16 = ntohs(*((int16_t *)buf));
+        dat->value.sz16 = UNWIRE16(flags, *((int16_t *)buf));
         buf += sizeof(int16_t);
         sz -= sizeof(int16_t);
         if (sz < dat->value.sz16 || dat->value.sz16 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 4);
             return 0;
         }
         dat->packsz += dat->value.sz16;
         if ((dat->data.str = malloc(dat->value.sz16)) == NULL) {
             FAIL("malloc");
         }
+        MRKDATA_STATS_ALLOC(dat->value.sz16);
         memcpy(dat->data.str, buf, dat->value.sz16);
         buf += dat->value.sz16;
         sz -= dat->value.sz16;
         break;
 
     case MRKDATA_UINT32:
-        dat->value.u32 = ntohl(*((uint32_t *)buf));
+        dat->value.u32 = UNWIRE32(flags, *((uint32_t *)buf));
         buf += sizeof(uint32_t);
         sz -= sizeof(uint32_t);
         break;
 
     case MRKDATA_INT32:
-        dat->value.i32 = (int32_t)ntohl(*((uint32_t *)buf));
+        dat->value.i32 = (int32_t)UNWIRE32(flags, *((uint32_t *)buf));
         buf += sizeof(int32_t);
         sz -= sizeof(int32_t);
         break;
 
     case MRKDATA_STR32:
-        dat->value.sz32 = ntohl(*((int32_t *)buf));
+        dat->value.sz32 = UNWIRE32(flags, *((int32_t *)buf));
         buf += sizeof(int32_t);
         sz -= sizeof(int32_t);
         if (sz < dat->value.sz32 || dat->value.sz32 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 4);
             return 0;
         }
         dat->packsz += dat->value.sz32;
         if ((dat->data.str = malloc(dat->value.sz32)) == NULL) {
             FAIL("malloc");
         }
+        MRKDATA_STATS_ALLOC(dat->value.sz32);
         memcpy(dat->data.str, buf, dat->value.sz32);
         buf += dat->value.sz32;
         sz -= dat->value.sz32;
         break;
 
     case MRKDATA_UINT64:
-        dat->value.u64 = be64toh(*((uint64_t *)buf));
+        dat->value.u64 = UNWIRE64(flags, *((uint64_t *)buf));
         buf += sizeof(uint64_t);
         sz -= sizeof(uint64_t);
         break;
 
     case MRKDATA_INT64:
-        dat->value.i64 = (int64_t)be64toh(*((uint64_t *)buf));
+        dat->value.i64 = (int64_t)UNWIRE64(flags, *((uint64_t *)buf));
         buf += sizeof(int64_t);
         sz -= sizeof(int64_t);
         break;
 
+    case MRKDATA_DOUBLE:
+        dat->value.d = *((double *)buf);
+        buf += sizeof(double);
+        sz -= sizeof(double);
+        break;
+
     case MRKDATA_STR64:
-        dat->value.sz64 = be64toh(*((int64_t *)buf));
+        dat->value.sz64 = UNWIRE64(flags, *((int64_t *)buf));
         buf += sizeof(int64_t);
         sz -= sizeof(int64_t);
         if (sz < dat->value.sz64 || dat->value.sz64 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 4);
             return 0;
         }
         dat->packsz += dat->value.sz64;
         if ((dat->data.str = malloc(dat->value.sz64)) == NULL) {
             FAIL("malloc");
         }
+        MRKDATA_STATS_ALLOC(dat->value.sz64);
         memcpy(dat->data.str, buf, dat->value.sz64);
         buf += dat->value.sz64;
         sz -= dat->value.sz64;
         break;
 
     case MRKDATA_STRUCT:
-        dat->value.sz64 = be64toh(*((int64_t *)buf));
+        dat->value.sz64 = UNWIRE64(flags, *((int64_t *)buf));
         buf += sizeof(int64_t);
         sz -= sizeof(int64_t);
 
@@ -350,6 +518,7 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
         }
 
         if (sz < dat->value.sz64 || dat->value.sz64 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 5);
             return 0;
         }
 
@@ -362,6 +531,7 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
             mrkdata_datum_t **field_dat;
 
             if (sz <= 0) {
+                MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 7);
                 return 0;
             }
 
@@ -369,10 +539,12 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
                 FAIL("array_incr");
             }
 
-            if ((nread = mrkdata_unpack_buf(*field_spec,
-                                            buf,
-                                            sz,
-                                            field_dat)) == 0) {
+            if ((nread = unpack_buf(*field_spec,
+                                    buf,
+                                    sz,
+                                    field_dat,
+                                    dict,
+                                    flags)) == 0) {
                 return 0;
             }
 
@@ -384,7 +556,7 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
 
 
     case MRKDATA_SEQ:
-        dat->value.sz64 = be64toh(*((int64_t *)buf));
+        dat->value.sz64 = UNWIRE64(flags, *((int64_t *)buf));
         buf += sizeof(int64_t);
         sz -= sizeof(int64_t);
 
@@ -395,10 +567,12 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
         }
 
         if (sz < dat->value.sz64 || dat->value.sz64 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 5);
             return 0;
         }
 
         if (spec->fields.elnum != 1) {
+            MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 6);
             return 0;
         }
 
@@ -415,10 +589,12 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
                 FAIL("array_incr");
             }
 
-            if ((nread_single = mrkdata_unpack_buf(*field_spec,
-                                            buf,
-                                            sz,
-                                            field_dat)) == 0) {
+            if ((nread_single = unpack_buf(*field_spec,
+                                           buf,
+                                           sz,
+                                           field_dat,
+                                           dict,
+                                           flags)) == 0) {
                 return 0;
             }
 
@@ -440,9 +616,253 @@ mrkdata_unpack_buf(const mrkdata_spec_t *spec,
         assert(0);
     }
 
+    if (dict != NULL || flags != 0) {
+        if (tag == MRKDATA_STRUCT || tag == MRKDATA_SEQ) {
+            mrkdata_datum_t **field;
+            mnarray_iter_t it;
+
+            if (buf - start - valsz != dat->value.sz64) {
+                MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 9);
+                return 0;
+            }
+            dat->value.sz64 = 0;
+            for (field = array_first(&dat->data.fields, &it);
+                 field != NULL;
+                 field = array_next(&dat->data.fields, &it)) {
+                dat->value.sz64 += (*field)->packsz;
+            }
+            dat->packsz = valsz + dat->value.sz64;
+        } else if (dict != NULL &&
+                   tag >= MRKDATA_STR8 && tag <= MRKDATA_STR64) {
+            mrkdata_strdict_add(dict, dat);
+        }
+        return buf - start;
+    }
+
     return dat->packsz;
 }
 
+ssize_t
+mrkdata_unpack_buf(const mrkdata_spec_t *spec,
+                   const unsigned char *buf,
+                   ssize_t sz,
+                   mrkdata_datum_t **pdat)
+{
+    ssize_t res;
+    int slot = -1;
+    struct timespec ts;
+    mrkdata_stats_t *st;
+
+    if (__atomic_load_n(&mrkdata_stats_nhist, __ATOMIC_RELAXED) > 0) {
+        slot = mrkdata_stats_sample_begin(spec, &ts);
+    }
+
+    res = unpack_buf(spec, buf, sz, pdat, NULL, 0);
+
+    if (slot >= 0) {
+        mrkdata_stats_sample_end(slot, MRKDATA_STATS_UNPACK, &ts);
+    }
+
+    if (res > 0) {
+        st = MRKDATA_STATS();
+        ++st->nunpacked;
+        st->bunpacked += res;
+    }
+
+    return res;
+}
+
+
+/*
+ * Attach the packed bytes at buf to dat and to the containers below.
+ */
+static void
+datum_cache(mrkdata_datum_t *dat,
+            const unsigned char *buf,
+            mrkdata_packed_t *packed)
+{
+    mrkdata_datum_t **field;
+    mnarray_iter_t it;
+
+    if (dat->spec->tag != MRKDATA_STRUCT && dat->spec->tag != MRKDATA_SEQ) {
+        return;
+    }
+
+    dat->packed = buf;
+    dat->packedbuf = packed;
+    __atomic_add_fetch(&packed->nref, 1, __ATOMIC_RELAXED);
+
+    buf += EXPECT_SZ(dat->spec->tag);
+    for (field = array_first(&dat->data.fields, &it);
+         field != NULL;
+         field = array_next(&dat->data.fields, &it)) {
+        datum_cache(*field, buf, packed);
+        buf += (*field)->packsz;
+    }
+}
+
+
+/*
+ * mrkdata_unpack_buf() that keeps a copy of the record, so that the
+ * STRUCTs and SEQs still unchanged are packed again with a memcpy.  The
+ * tree must be changed with mrkdata_datum_set_path() or
+ * mrkdata_datum_add_path(), which drop the copy along the path, and
+ * leave the rest of it to be reused.
+ */
+ssize_t
+mrkdata_unpack_buf_cached(const mrkdata_spec_t *spec,
+                          const unsigned char *buf,
+                          ssize_t sz,
+                          mrkdata_datum_t **pdat)
+{
+    mrkdata_packed_t *packed;
+    ssize_t res;
+
+    if ((res = mrkdata_unpack_buf(spec, buf, sz, pdat)) <= 0) {
+        return res;
+    }
+
+    if ((packed = malloc(sizeof(mrkdata_packed_t) + res)) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_packed_t) + res);
+    memcpy(packed->buf, buf, res);
+    packed->nref = 1;
+    datum_cache(*pdat, packed->buf, packed);
+    if (__atomic_sub_fetch(&packed->nref, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(packed);
+    }
+    return res;
+}
+
+
+ssize_t
+mrkdata_pack_elem(const mrkdata_datum_t *dat, unsigned char *buf, ssize_t sz)
+{
+    return pack_datum(dat, buf, sz, NULL, 0);
+}
+
+
+ssize_t
+mrkdata_unpack_elem(const mrkdata_spec_t *spec,
+                    const unsigned char *buf,
+                    ssize_t sz,
+                    mrkdata_datum_t **pdat)
+{
+    return unpack_buf(spec, buf, sz, pdat, NULL, 0);
+}
+
+
+/*
+ * Pack dat as the next record of the dictionary-encoded stream of dict.
+ * As with mrkdata_pack_datum(), sz must be at least dat->packsz, the
+ * record is only shorter.  Return the record size, or 0, after which
+ * the stream is broken.
+ */
+ssize_t
+mrkdata_strdict_pack_datum(mrkdata_strdict_t *dict,
+                           const mrkdata_datum_t *dat,
+                           unsigned char *buf,
+                           ssize_t sz)
+{
+    ssize_t res;
+    mrkdata_stats_t *st;
+
+    if ((res = pack_datum(dat, buf, sz, dict, 0)) > 0) {
+        st = MRKDATA_STATS();
+        ++st->npacked;
+        st->bpacked += res;
+    }
+    return res;
+}
+
+
+/*
+ * Unpack the next record of the dictionary-encoded stream of dict.
+ * Strings that were seen before in the stream are shared with the
+ * dictionary, not copied.  Return the record size, or 0, after which
+ * the stream is broken.
+ */
+ssize_t
+mrkdata_strdict_unpack_buf(mrkdata_strdict_t *dict,
+                           const mrkdata_spec_t *spec,
+                           const unsigned char *buf,
+                           ssize_t sz,
+                           mrkdata_datum_t **pdat)
+{
+    ssize_t res;
+    mrkdata_stats_t *st;
+
+    if ((res = unpack_buf(spec, buf, sz, pdat, dict, 0)) > 0) {
+        st = MRKDATA_STATS();
+        ++st->nunpacked;
+        st->bunpacked += res;
+    }
+    return res;
+}
+
+
+/*
+ * Pack dat as a little-endian record, see le.c.  sz must be at least
+ * dat->packsz + 1, the record is only shorter.  Return the record size,
+ * or 0.
+ */
+ssize_t
+mrkdata_le_pack_datum(const mrkdata_datum_t *dat,
+                      unsigned char *buf,
+                      ssize_t sz)
+{
+    ssize_t res;
+    mrkdata_stats_t *st;
+
+    if (sz < 1) {
+        MRKDATA_STATS_ERROR(MRKDATA_PACK_DATUM + 1);
+        return 0;
+    }
+    *buf = MRKDATA_LE;
+    if ((res = pack_datum(dat, buf + 1, sz - 1, NULL, MRKDATA_WIRE_LE)) == 0) {
+        return 0;
+    }
+    ++res;
+    st = MRKDATA_STATS();
+    ++st->npacked;
+    st->bpacked += res;
+    return res;
+}
+
+
+/*
+ * Unpack the little-endian record at buf.  Return the record size, or
+ * 0.
+ */
+ssize_t
+mrkdata_le_unpack_buf(const mrkdata_spec_t *spec,
+                      const unsigned char *buf,
+                      ssize_t sz,
+                      mrkdata_datum_t **pdat)
+{
+    ssize_t res;
+    mrkdata_stats_t *st;
+
+    if (sz < 1 || *buf != MRKDATA_LE) {
+        MRKDATA_STATS_ERROR(MRKDATA_UNPACK_BUF + 10);
+        return 0;
+    }
+    if ((res = unpack_buf(spec,
+                          buf + 1,
+                          sz - 1,
+                          pdat,
+                          NULL,
+                          MRKDATA_WIRE_LE)) == 0) {
+        return 0;
+    }
+    ++res;
+    st = MRKDATA_STATS();
+    ++st->nunpacked;
+    st->bunpacked += res;
+    return res;
+}
+
 
 ssize_t
 mrkdata_parse_buf(const unsigned char *buf,
@@ -456,6 +876,7 @@ mrkdata_parse_buf(const unsigned char *buf,
     mrkdata_tag_t tag;
     ssize_t valsz;
     ssize_t parsesz;
+    mrkdata_stats_t *st;
 
     if (sz == 0) {
         return 0;
@@ -463,9 +884,15 @@ mrkdata_parse_buf(const unsigned char *buf,
 
     tag = (mrkdata_tag_t)(*buf);
 
+    if (!TAG_SUPPORTED(tag)) {
+        MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 3);
+        return 0;
+    }
+
     valsz = EXPECT_SZ(tag);
 
     if (sz < valsz) {
+        MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 1);
         return 0;
     }
 
@@ -474,6 +901,8 @@ mrkdata_parse_buf(const unsigned char *buf,
     sz -= sizeof(char);
     parsesz = valsz;
 
+    MRKDATA_STATS_VALUE(tag);
+
     switch (tag) {
         int8_t sz8;
         int16_t sz16;
@@ -501,6 +930,7 @@ mrkdata_parse_buf(const unsigned char *buf,
         buf += sizeof(int8_t);
         sz -= sizeof(int8_t);
         if (sz < sz8 || sz8 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 2);
             return 0;
         }
         if (cb(buf, tag, (ssize_t)sz8, udata) != 0) {
@@ -532,6 +962,7 @@ mrkdata_parse_buf(const unsigned char *buf,
         buf += sizeof(int16_t);
         sz -= sizeof(int16_t);
         if (sz < sz16 || sz16 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 2);
             return 0;
         }
         if (cb(buf, tag, (ssize_t)sz16, udata) != 0) {
@@ -563,6 +994,7 @@ mrkdata_parse_buf(const unsigned char *buf,
         buf += sizeof(int32_t);
         sz -= sizeof(int32_t);
         if (sz < sz32 || sz32 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 2);
             return 0;
         }
         if (cb(buf, tag, (ssize_t)sz32, udata) != 0) {
@@ -589,11 +1021,20 @@ mrkdata_parse_buf(const unsigned char *buf,
         sz -= sizeof(int64_t);
         break;
 
+    case MRKDATA_DOUBLE:
+        if (cb(buf, tag, valsz, udata) != 0) {
+            return 0;
+        }
+        buf += sizeof(double);
+        sz -= sizeof(double);
+        break;
+
     case MRKDATA_STR64:
         sz64 = be64toh(*((int64_t *)buf));
         buf += sizeof(int64_t);
         sz -= sizeof(int64_t);
         if (sz < sz64 || sz64 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 2);
             return 0;
         }
         if (cb(buf, tag, (ssize_t)sz64, udata) != 0) {
@@ -610,46 +1051,485 @@ mrkdata_parse_buf(const unsigned char *buf,
         sz -= sizeof(int64_t);
 
         if (sz < sz64 || sz64 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 2);
+            return 0;
+        }
+
+        if (cb(buf, tag, (ssize_t)sz64, udata) != 0) {
             return 0;
         }
 
-        if (cb(buf, tag, (ssize_t)sz64, udata) != 0) {
-            return 0;
+        parsesz += sz64;
+
+        break;
+
+
+    case MRKDATA_SEQ:
+        sz64 = be64toh(*((int64_t *)buf));
+        buf += sizeof(int64_t);
+        sz -= sizeof(int64_t);
+
+        if (sz < sz64 || sz64 < 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 2);
+            return 0;
+        }
+
+        if (cb(buf, tag, (ssize_t)sz64, udata) != 0) {
+            return 0;
+        }
+
+        parsesz += sz64;
+
+        break;
+
+
+    default:
+        /*
+         * Not supported:
+         *  MRKDATA_DICT
+         *  MRKDATA_FUNC
+         */
+        MRKDATA_STATS_ERROR(MRKDATA_PARSE_BUF + 3);
+        return 0;
+    }
+
+    st = MRKDATA_STATS();
+    ++st->nparsed;
+    st->bparsed += parsesz;
+
+    return parsesz;
+}
+
+
+
+/*
+ * Read the tag and the payload length of the element at buf[*ppos], and
+ * check that the element ends before lim.  Return 0 or a
+ * MRKDATA_VALIDATE_E* subcode.  A bad length moves *ppos to the length
+ * field.
+ */
+static int
+elem_header(const unsigned char *buf,
+            ssize_t *ppos,
+            ssize_t lim,
+            mrkdata_tag_t *ptag,
+            int64_t *plen)
+{
+    ssize_t pos = *ppos;
+    mrkdata_tag_t tag;
+    int64_t len;
+
+    if (pos >= lim) {
+        return MRKDATA_VALIDATE_ETRUNC;
+    }
+
+    tag = (mrkdata_tag_t)buf[pos];
+
+    if (!TAG_SUPPORTED(tag)) {
+        return MRKDATA_VALIDATE_ETAG;
+    }
+
+    if (lim - pos < EXPECT_SZ(tag)) {
+        return MRKDATA_VALIDATE_ETRUNC;
+    }
+
+    switch (tag) {
+    case MRKDATA_STR8:
+        len = (int8_t)buf[pos + 1];
+        break;
+
+    case MRKDATA_STR16:
+        len = (int16_t)ntohs(*((uint16_t *)(buf + pos + 1)));
+        break;
+
+    case MRKDATA_STR32:
+        len = (int32_t)ntohl(*((uint32_t *)(buf + pos + 1)));
+        break;
+
+    case MRKDATA_STR64:
+    case MRKDATA_STRUCT:
+    case MRKDATA_SEQ:
+        len = (int64_t)be64toh(*((uint64_t *)(buf + pos + 1)));
+        break;
+
+    default:
+        len = 0;
+    }
+
+    if (len < 0) {
+        *ppos = pos + 1;
+        return MRKDATA_VALIDATE_ESZ;
+    }
+
+    if (len > lim - pos - EXPECT_SZ(tag)) {
+        *ppos = pos + 1;
+        return MRKDATA_VALIDATE_ETRUNC;
+    }
+
+    *ptag = tag;
+    *plen = len;
+    return 0;
+}
+
+/*
+ * Return the size of the record at buf as told by its header, which may
+ * be more than sz.  Return 0 if sz is too short to hold the header, and
+ * -1 if the header is malformed.
+ */
+ssize_t
+mrkdata_buf_size(const unsigned char *buf, ssize_t sz)
+{
+    mrkdata_tag_t tag;
+    int64_t len;
+
+    if (sz <= 0) {
+        return 0;
+    }
+
+    tag = (mrkdata_tag_t)(*buf);
+
+    if (!TAG_SUPPORTED(tag)) {
+        return -1;
+    }
+
+    if (sz < EXPECT_SZ(tag)) {
+        return 0;
+    }
+
+    switch (tag) {
+    case MRKDATA_STR8:
+        len = (int8_t)buf[1];
+        break;
+
+    case MRKDATA_STR16:
+        len = (int16_t)ntohs(*((uint16_t *)(buf + 1)));
+        break;
+
+    case MRKDATA_STR32:
+        len = (int32_t)ntohl(*((uint32_t *)(buf + 1)));
+        break;
+
+    case MRKDATA_STR64:
+    case MRKDATA_STRUCT:
+    case MRKDATA_SEQ:
+        len = (int64_t)be64toh(*((uint64_t *)(buf + 1)));
+        break;
+
+    default:
+        len = 0;
+    }
+
+    if (len < 0 || len > SSIZE_MAX - EXPECT_SZ(tag)) {
+        return -1;
+    }
+
+    return EXPECT_SZ(tag) + len;
+}
+
+/*
+ * Return the idx-th element of the STRUCT or SEQ record at buf, and its
+ * size in *psz, without decoding anything else.  Return NULL if there is
+ * no such element, or the record does not fit in sz.
+ */
+const unsigned char *
+mrkdata_buf_get_field(const unsigned char *buf,
+                      ssize_t sz,
+                      unsigned idx,
+                      ssize_t *psz)
+{
+    ssize_t recsz, fsz;
+    const unsigned char *end;
+
+    if ((recsz = mrkdata_buf_size(buf, sz)) <= 0 || recsz > sz) {
+        return NULL;
+    }
+
+    if (buf[0] != MRKDATA_STRUCT && buf[0] != MRKDATA_SEQ) {
+        return NULL;
+    }
+
+    end = buf + recsz;
+    buf += EXPECT_SZ(MRKDATA_STRUCT);
+
+    while (1) {
+        if ((fsz = mrkdata_buf_size(buf, end - buf)) <= 0 ||
+            fsz > end - buf) {
+            return NULL;
+        }
+        if (idx == 0) {
+            *psz = fsz;
+            return buf;
+        }
+        buf += fsz;
+        --idx;
+    }
+}
+
+/*
+ * Check that buf starts with a well-formed record of the given spec, or
+ * just a well-formed record of any shape when spec is NULL.  Nothing is
+ * allocated, and nesting is tracked on a fixed-size stack instead of
+ * recursion.  On success, return 0 and set *psz to the record size.
+ * On failure, return MRKDATA_VALIDATE_BUF + MRKDATA_VALIDATE_E*, and set
+ * *psz to the offset of the offending tag or length.
+ */
+int
+mrkdata_validate_buf(const mrkdata_spec_t *spec,
+                     const unsigned char *buf,
+                     ssize_t sz,
+                     const mrkdata_limits_t *limits,
+                     ssize_t *psz)
+{
+    struct {
+        const mrkdata_spec_t *spec;
+        ssize_t end;
+        unsigned idx;
+    } stack[MRKDATA_MAXDEPTH];
+    unsigned depth = 0;
+    unsigned maxdepth = MRKDATA_MAXDEPTH;
+    uint64_t nelems = 0;
+    uint64_t maxelems = 0;
+    int64_t maxstrsz = 0;
+    ssize_t pos = 0;
+    ssize_t lim;
+    int res = 0;
+
+    if (limits != NULL) {
+        if (limits->maxdepth > 0 && limits->maxdepth < maxdepth) {
+            maxdepth = limits->maxdepth;
+        }
+        maxelems = limits->maxelems;
+        maxstrsz = limits->maxstrsz;
+    }
+
+    while (1) {
+        mrkdata_tag_t tag;
+        int64_t len;
+
+        lim = depth > 0 ? stack[depth - 1].end : sz;
+
+        if ((res = elem_header(buf, &pos, lim, &tag, &len)) != 0) {
+            goto ERR;
+        }
+
+        if (spec != NULL && tag != spec->tag) {
+            res = MRKDATA_VALIDATE_ESPEC;
+            goto ERR;
+        }
+
+        if (maxelems > 0 && ++nelems > maxelems) {
+            res = MRKDATA_VALIDATE_ENELEMS;
+            goto ERR;
+        }
+
+        if (tag == MRKDATA_STRUCT || tag == MRKDATA_SEQ) {
+            if (depth >= maxdepth) {
+                res = MRKDATA_VALIDATE_EDEPTH;
+                goto ERR;
+            }
+            if (tag == MRKDATA_SEQ &&
+                spec != NULL &&
+                spec->fields.elnum != 1) {
+                res = MRKDATA_VALIDATE_ESPEC;
+                goto ERR;
+            }
+            stack[depth].spec = spec;
+            stack[depth].end = pos + EXPECT_SZ(tag) + len;
+            stack[depth].idx = 0;
+            ++depth;
+
+        } else if (maxstrsz > 0 && len > maxstrsz) {
+            ++pos;
+            res = MRKDATA_VALIDATE_ESTRSZ;
+            goto ERR;
+        }
+
+        pos += EXPECT_SZ(tag);
+        if (tag != MRKDATA_STRUCT && tag != MRKDATA_SEQ) {
+            pos += len;
+        }
+
+        /* pop finished containers, and find the spec of the next element */
+        while (depth > 0) {
+            const mrkdata_spec_t *cspec = stack[depth - 1].spec;
+
+            if (pos == stack[depth - 1].end) {
+                if (cspec != NULL &&
+                    cspec->tag == MRKDATA_STRUCT &&
+                    stack[depth - 1].idx != cspec->fields.elnum) {
+                    res = MRKDATA_VALIDATE_EFIELDS;
+                    goto ERR;
+                }
+                --depth;
+                continue;
+            }
+
+            if (cspec == NULL) {
+                spec = NULL;
+
+            } else if (cspec->tag == MRKDATA_STRUCT) {
+                mrkdata_spec_t **fspec;
+
+                if ((fspec = array_get(&cspec->fields,
+                                       stack[depth - 1].idx)) == NULL) {
+                    res = MRKDATA_VALIDATE_EFIELDS;
+                    goto ERR;
+                }
+                spec = *fspec;
+
+            } else {
+                spec = *((mrkdata_spec_t **)array_get(&cspec->fields, 0));
+            }
+            ++stack[depth - 1].idx;
+            break;
+        }
+
+        if (depth == 0) {
+            break;
+        }
+    }
+
+    *psz = pos;
+    return 0;
+
+ERR:
+    *psz = pos;
+    res += MRKDATA_VALIDATE_BUF;
+    MRKDATA_STATS_ERROR(res);
+    return res;
+}
+
+/*
+ * Visit every element of the record at buf depth-first, without
+ * recursion and without allocation.  Containers produce
+ * MRKDATA_WALK_ENTER and MRKDATA_WALK_LEAVE events with their body,
+ * scalars and strings produce MRKDATA_WALK_VALUE with the raw (network
+ * order) value or the string payload.  All pointers refer to buf.
+ *
+ * Return the size of the record, or 0 if it is malformed, exceeds the
+ * limits, or cb returns non-zero.  MRKDATA_WALK_SKIP returned on ENTER
+ * skips the container body and its LEAVE event.
+ */
+ssize_t
+mrkdata_walk_buf(const unsigned char *buf,
+                 ssize_t sz,
+                 const mrkdata_limits_t *limits,
+                 mrkdata_walk_cb_t cb,
+                 void *udata)
+{
+    struct {
+        ssize_t start;
+        ssize_t end;
+        mrkdata_tag_t tag;
+    } stack[MRKDATA_MAXDEPTH];
+    unsigned depth = 0;
+    unsigned maxdepth = MRKDATA_MAXDEPTH;
+    uint64_t nelems = 0;
+    uint64_t maxelems = 0;
+    int64_t maxstrsz = 0;
+    ssize_t pos = 0;
+    ssize_t lim;
+    mrkdata_stats_t *st;
+    int res;
+
+    if (limits != NULL) {
+        if (limits->maxdepth > 0 && limits->maxdepth < maxdepth) {
+            maxdepth = limits->maxdepth;
+        }
+        maxelems = limits->maxelems;
+        maxstrsz = limits->maxstrsz;
+    }
+
+    while (1) {
+        mrkdata_tag_t tag;
+        int64_t len;
+        ssize_t hsz;
+
+        lim = depth > 0 ? stack[depth - 1].end : sz;
+
+        if ((res = elem_header(buf, &pos, lim, &tag, &len)) != 0) {
+            goto ERR;
+        }
+
+        if (maxelems > 0 && ++nelems > maxelems) {
+            res = MRKDATA_VALIDATE_ENELEMS;
+            goto ERR;
         }
 
-        parsesz += sz64;
+        MRKDATA_STATS_VALUE(tag);
 
-        break;
+        hsz = EXPECT_SZ(tag);
 
+        if (tag == MRKDATA_STRUCT || tag == MRKDATA_SEQ) {
+            if (depth >= maxdepth) {
+                res = MRKDATA_VALIDATE_EDEPTH;
+                goto ERR;
+            }
 
-    case MRKDATA_SEQ:
-        sz64 = be64toh(*((int64_t *)buf));
-        buf += sizeof(int64_t);
-        sz -= sizeof(int64_t);
+            res = cb(MRKDATA_WALK_ENTER, tag, buf + pos + hsz, len,
+                     depth, udata);
 
-        if (sz < sz64 || sz64 < 0) {
-            return 0;
-        }
+            if (res == MRKDATA_WALK_SKIP) {
+                pos += hsz + len;
 
-        if (cb(buf, tag, (ssize_t)sz64, udata) != 0) {
-            return 0;
-        }
+            } else if (res != 0) {
+                return 0;
 
-        parsesz += sz64;
+            } else {
+                stack[depth].start = pos + hsz;
+                stack[depth].end = pos + hsz + len;
+                stack[depth].tag = tag;
+                ++depth;
+                pos += hsz;
+            }
 
-        break;
+        } else if (tag >= MRKDATA_STR8 && tag <= MRKDATA_STR64) {
+            if (maxstrsz > 0 && len > maxstrsz) {
+                ++pos;
+                res = MRKDATA_VALIDATE_ESTRSZ;
+                goto ERR;
+            }
 
+            if (cb(MRKDATA_WALK_VALUE, tag, buf + pos + hsz, len,
+                   depth, udata) != 0) {
+                return 0;
+            }
+            pos += hsz + len;
 
-    default:
-        /*
-         * Not supported:
-         *  MRKDATA_DICT
-         *  MRKDATA_FUNC
-         */
-        assert(0);
+        } else {
+            if (cb(MRKDATA_WALK_VALUE, tag, buf + pos + 1, mrkdata_tag_sz[tag],
+                   depth, udata) != 0) {
+                return 0;
+            }
+            pos += hsz;
+        }
+
+        while (depth > 0 && pos == stack[depth - 1].end) {
+            --depth;
+            if (cb(MRKDATA_WALK_LEAVE,
+                   stack[depth].tag,
+                   buf + stack[depth].start,
+                   stack[depth].end - stack[depth].start,
+                   depth,
+                   udata) != 0) {
+                return 0;
+            }
+        }
+
+        if (depth == 0) {
+            break;
+        }
     }
 
-    return parsesz;
+    st = MRKDATA_STATS();
+    ++st->nparsed;
+    st->bparsed += pos;
+
+    return pos;
+
+ERR:
+    MRKDATA_STATS_ERROR(MRKDATA_WALK_BUF + res);
+    return 0;
 }
 
 
@@ -689,6 +1569,10 @@ mrkdata_spec_destroy(mrkdata_spec_t **spec)
         if (MRKDATA_TAG_CUSTOM((*spec)->tag)) {
             array_fini(&(*spec)->fields);
             free(*spec);
+        } else if (*spec < builtin_specs ||
+                   *spec >= builtin_specs + countof(builtin_specs)) {
+            /* see mrkdata_make_named_spec() */
+            free(*spec);
         }
 
         *spec = NULL;
@@ -708,6 +1592,7 @@ mrkdata_make_spec(mrkdata_tag_t tag)
     if ((spec = malloc(sizeof(mrkdata_spec_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_spec_t));
     spec->name = NULL;
     spec->tag = tag;
     if (MRKDATA_TAG_CUSTOM(tag)) {
@@ -732,6 +1617,30 @@ mrkdata_spec_set_name(mrkdata_spec_t *spec, const char *name)
     }
 }
 
+/*
+ * A spec of its own with a name, for a STRUCT field.  Unlike
+ * mrkdata_make_spec(), scalars and strings do not get the shared
+ * built-in spec, whose name would be that of all such fields.
+ */
+mrkdata_spec_t *
+mrkdata_make_named_spec(mrkdata_tag_t tag, const char *name)
+{
+    mrkdata_spec_t *spec;
+
+    if (MRKDATA_TAG_CUSTOM(tag)) {
+        spec = mrkdata_make_spec(tag);
+    } else {
+        if ((spec = malloc(sizeof(mrkdata_spec_t))) == NULL) {
+            FAIL("malloc");
+        }
+        MRKDATA_STATS_ALLOC(sizeof(mrkdata_spec_t));
+        memset(spec, '\0', sizeof(mrkdata_spec_t));
+        spec->tag = tag;
+    }
+    mrkdata_spec_set_name(spec, name);
+    return spec;
+}
+
 
 void
 mrkdata_spec_add_field(mrkdata_spec_t *spec, mrkdata_spec_t *field)
@@ -752,7 +1661,12 @@ static int
 datum_init(mrkdata_datum_t *dat)
 {
     dat->spec = NULL;
-    dat->parent = NULL;
+    /* a datum left by a failed unpack must be safe to destroy */
+    memset(&dat->data, '\0', sizeof(dat->data));
+    dat->strfree = NULL;
+    dat->packed = NULL;
+    dat->packedbuf = NULL;
+    dat->nref = 1;
     dat->packsz = 0;
     return 0;
 }
@@ -765,6 +1679,7 @@ mrkdata_datum_from_spec(mrkdata_spec_t *spec, void *v, size_t sz)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = spec;
 
@@ -798,6 +1713,7 @@ mrkdata_datum_from_spec(mrkdata_spec_t *spec, void *v, size_t sz)
         res->value.sz8 = (int8_t)sz;
 
         if (res->value.sz8 <=0 ) {
+            MRKDATA_STATS_ERROR(MRKDATA_DATUM_FROM_SPEC + 1);
             goto ERR;
         }
 
@@ -806,12 +1722,14 @@ mrkdata_datum_from_spec(mrkdata_spec_t *spec, void *v, size_t sz)
         if ((res->data.str = malloc(res->value.sz8)) == NULL) {
             FAIL("malloc");
         }
+        MRKDATA_STATS_ALLOC(res->value.sz8);
         memcpy(res->data.str, v, res->value.sz8);
 
     } else if (spec->tag == MRKDATA_STR16) {
         res->value.sz16 = (int16_t)sz;
 
         if (res->value.sz16 <=0 ) {
+            MRKDATA_STATS_ERROR(MRKDATA_DATUM_FROM_SPEC + 1);
             goto ERR;
         }
 
@@ -820,12 +1738,14 @@ mrkdata_datum_from_spec(mrkdata_spec_t *spec, void *v, size_t sz)
         if ((res->data.str = malloc(res->value.sz16)) == NULL) {
             FAIL("malloc");
         }
+        MRKDATA_STATS_ALLOC(res->value.sz16);
         memcpy(res->data.str, v, res->value.sz16);
 
     } else if (spec->tag == MRKDATA_STR32) {
         res->value.sz32 = (int32_t)sz;
 
         if (res->value.sz32 <=0 ) {
+            MRKDATA_STATS_ERROR(MRKDATA_DATUM_FROM_SPEC + 1);
             goto ERR;
         }
 
@@ -834,12 +1754,14 @@ mrkdata_datum_from_spec(mrkdata_spec_t *spec, void *v, size_t sz)
         if ((res->data.str = malloc(res->value.sz32)) == NULL) {
             FAIL("malloc");
         }
+        MRKDATA_STATS_ALLOC(res->value.sz32);
         memcpy(res->data.str, v, res->value.sz32);
 
     } else if (spec->tag == MRKDATA_STR64) {
         res->value.sz64 = (int64_t)sz;
 
         if (res->value.sz64 <=0 ) {
+            MRKDATA_STATS_ERROR(MRKDATA_DATUM_FROM_SPEC + 1);
             goto ERR;
         }
 
@@ -848,6 +1770,7 @@ mrkdata_datum_from_spec(mrkdata_spec_t *spec, void *v, size_t sz)
         if ((res->data.str = malloc(res->value.sz64)) == NULL) {
             FAIL("malloc");
         }
+        MRKDATA_STATS_ALLOC(res->value.sz64);
         memcpy(res->data.str, v, res->value.sz64);
 
     } else if (MRKDATA_TAG_CUSTOM(spec->tag)) {
@@ -888,7 +1811,11 @@ datum_dump(mrkdata_datum_t *dat, int lvl)
         for (o = array_first(&dat->data.fields, &it);
              o != NULL;
              o = array_next(&dat->data.fields, &it)) {
-            datum_dump(*o, lvl + 1);
+            if (*o == NULL) {
+                LTRACE(lvl + 1, "<absent>");
+            } else {
+                datum_dump(*o, lvl + 1);
+            }
         }
     } else {
         LTRACEN(lvl, "<datum tag=%s value=", MRKDATA_TAG_STR(dat->spec->tag));
@@ -946,6 +1873,10 @@ datum_dump(mrkdata_datum_t *dat, int lvl)
             break;
 
         case MRKDATA_STR64:
+            if (MRKDATA_STREAMED(dat)) {
+                TRACEC("<streamed %ld>", dat->value.sz64);
+                break;
+            }
             TRACEC("...>");
             D64(dat->data.str, dat->value.sz64);
             break;
@@ -973,7 +1904,11 @@ datum_fini(mrkdata_datum_t *dat)
             dat->spec->tag == MRKDATA_STR64) {
 
             if (dat->data.str != NULL) {
-                free(dat->data.str);
+                if (dat->strfree != NULL) {
+                    dat->strfree(dat->data.str);
+                } else {
+                    free(dat->data.str);
+                }
                 dat->data.str = NULL;
             }
         } else if (MRKDATA_TAG_CUSTOM(dat->spec->tag)) {
@@ -982,35 +1917,293 @@ datum_fini(mrkdata_datum_t *dat)
 
         dat->spec = NULL;
     }
-    dat->parent = NULL;
+    datum_uncache(dat);
     dat->packsz = 0;
     return 0;
 }
 
+/*
+ * Drop a reference, and free the datum with the last one.
+ */
 int
 mrkdata_datum_destroy(mrkdata_datum_t **dat)
 {
     if (*dat != NULL) {
-        datum_fini(*dat);
-        free(*dat);
+        if (__atomic_sub_fetch(&(*dat)->nref, 1, __ATOMIC_ACQ_REL) == 0) {
+            datum_fini(*dat);
+            free(*dat);
+        }
         *dat = NULL;
     }
     return 0;
 }
 
-void
+/*
+ * Take another reference to the whole tree.  The tree must not be
+ * changed in place as long as it is shared: use mrkdata_datum_unshare(),
+ * mrkdata_datum_set_path() or mrkdata_datum_add_path() instead.
+ */
+mrkdata_datum_t *
+mrkdata_datum_clone(mrkdata_datum_t *dat)
+{
+    __atomic_add_fetch(&dat->nref, 1, __ATOMIC_RELAXED);
+    return dat;
+}
+
+static mrkdata_datum_t *
+datum_copy_shallow(const mrkdata_datum_t *dat)
+{
+    mrkdata_datum_t *res;
+
+    if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
+    *res = *dat;
+    res->strfree = NULL;
+    res->packed = NULL;
+    res->packedbuf = NULL;
+    res->nref = 1;
+
+    if (MRKDATA_STREAMED(dat)) {
+        /* nothing to copy */
+
+    } else if (dat->spec->tag >= MRKDATA_STR8 &&
+               dat->spec->tag <= MRKDATA_STR64) {
+        ssize_t sz = dat->packsz - EXPECT_SZ(dat->spec->tag);
+
+        if ((res->data.str = malloc(sz)) == NULL) {
+            FAIL("malloc");
+        }
+        MRKDATA_STATS_ALLOC(sz);
+        memcpy(res->data.str, dat->data.str, sz);
+
+    } else if (MRKDATA_TAG_CUSTOM(dat->spec->tag)) {
+        mrkdata_datum_t **field;
+        mnarray_iter_t it;
+
+        if (array_init(&res->data.fields, sizeof(mrkdata_datum_t *), 0,
+                      (array_initializer_t)null_pointer_initializer,
+                      (array_finalizer_t)mrkdata_datum_destroy) != 0) {
+            FAIL("array_init");
+        }
+
+        for (field = array_first(&dat->data.fields, &it);
+             field != NULL;
+             field = array_next(&dat->data.fields, &it)) {
+            mrkdata_datum_t **pfield;
+
+            if ((pfield = array_incr(&res->data.fields)) == NULL) {
+                FAIL("array_incr");
+            }
+            *pfield = *field == NULL ? NULL : mrkdata_datum_clone(*field);
+        }
+    }
+
+    return res;
+}
+
+/*
+ * Make *pdat private to the caller, copying the datum (but not its
+ * children) if it is shared.
+ */
+mrkdata_datum_t *
+mrkdata_datum_unshare(mrkdata_datum_t **pdat)
+{
+    if (__atomic_load_n(&(*pdat)->nref, __ATOMIC_ACQUIRE) > 1) {
+        mrkdata_datum_t *copy;
+
+        copy = datum_copy_shallow(*pdat);
+        mrkdata_datum_destroy(pdat);
+        *pdat = copy;
+    }
+    return *pdat;
+}
+
+/*
+ * Unshare the datums from *proot down to the one at path, and collect
+ * them in spine[0 .. depth].  Return the slot holding the last one.
+ */
+static mrkdata_datum_t **
+datum_unshare_path(mrkdata_datum_t **proot,
+                   const unsigned *path,
+                   unsigned depth,
+                   mrkdata_datum_t **spine)
+{
+    mrkdata_datum_t **slot = proot;
+    unsigned i;
+
+    for (i = 0; i <= depth; ++i) {
+        /* absent */
+        if (*slot == NULL) {
+            return NULL;
+        }
+        spine[i] = mrkdata_datum_unshare(slot);
+
+        if (i < depth) {
+            if (!MRKDATA_TAG_CUSTOM(spine[i]->spec->tag)) {
+                return NULL;
+            }
+            if ((slot = array_get(&spine[i]->data.fields, path[i])) == NULL) {
+                return NULL;
+            }
+        }
+    }
+    return slot;
+}
+
+/*
+ * Replace the datum at path below *proot with value, taking over the
+ * reference to value.  Only the datums on the path get copied if
+ * shared, and their sizes are adjusted.
+ */
+int
+mrkdata_datum_set_path(mrkdata_datum_t **proot,
+                       const unsigned *path,
+                       unsigned depth,
+                       mrkdata_datum_t *value)
+{
+    mrkdata_datum_t *spine[MRKDATA_MAXDEPTH + 1];
+    mrkdata_datum_t **slot;
+    ssize_t delta;
+    unsigned i;
+
+    if (depth == 0) {
+        mrkdata_datum_destroy(proot);
+        *proot = value;
+        return 0;
+    }
+
+    if (depth > MRKDATA_MAXDEPTH) {
+        TRRET(MRKDATA_DATUM_SET_PATH + 1);
+    }
+
+    if ((slot = datum_unshare_path(proot, path, depth - 1, spine)) == NULL ||
+        !MRKDATA_TAG_CUSTOM((*slot)->spec->tag)) {
+        TRRET(MRKDATA_DATUM_SET_PATH + 2);
+    }
+
+    if ((slot = array_get(&(*slot)->data.fields, path[depth - 1])) == NULL) {
+        TRRET(MRKDATA_DATUM_SET_PATH + 3);
+    }
+
+    /* either may be absent */
+    delta = (value != NULL ? value->packsz : 0) -
+            (*slot != NULL ? (*slot)->packsz : 0);
+    mrkdata_datum_destroy(slot);
+    *slot = value;
+
+    for (i = 0; i < depth; ++i) {
+        mrkdata_datum_adjust_packsz(spine[i], delta);
+    }
+
+    return 0;
+}
+
+/*
+ * Append field to the STRUCT or SEQ at path below *proot, see
+ * mrkdata_datum_set_path().
+ */
+int
+mrkdata_datum_add_path(mrkdata_datum_t **proot,
+                       const unsigned *path,
+                       unsigned depth,
+                       mrkdata_datum_t *field)
+{
+    mrkdata_datum_t *spine[MRKDATA_MAXDEPTH + 1];
+    unsigned i;
+
+    if (depth > MRKDATA_MAXDEPTH) {
+        TRRET(MRKDATA_DATUM_ADD_PATH + 1);
+    }
+
+    if (datum_unshare_path(proot, path, depth, spine) == NULL ||
+        !MRKDATA_TAG_CUSTOM(spine[depth]->spec->tag)) {
+        TRRET(MRKDATA_DATUM_ADD_PATH + 2);
+    }
+
+    mrkdata_datum_add_field(spine[depth], field);
+
+    if (field != NULL) {
+        for (i = 0; i < depth; ++i) {
+            mrkdata_datum_adjust_packsz(spine[i], field->packsz);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Drop the items past the first n of the SEQ at path below *proot, see
+ * mrkdata_datum_set_path().
+ */
+int
+mrkdata_datum_trunc_path(mrkdata_datum_t **proot,
+                         const unsigned *path,
+                         unsigned depth,
+                         uint64_t n)
+{
+    mrkdata_datum_t *spine[MRKDATA_MAXDEPTH + 1];
+    mrkdata_datum_t *seq;
+    ssize_t delta = 0;
+    unsigned i;
+
+    if (depth > MRKDATA_MAXDEPTH) {
+        TRRET(MRKDATA_DATUM_TRUNC_PATH + 1);
+    }
+
+    if (datum_unshare_path(proot, path, depth, spine) == NULL ||
+        spine[depth]->spec->tag != MRKDATA_SEQ ||
+        n > spine[depth]->data.fields.elnum) {
+        TRRET(MRKDATA_DATUM_TRUNC_PATH + 2);
+    }
+
+    seq = spine[depth];
+    while (seq->data.fields.elnum > n) {
+        mrkdata_datum_t **last;
+
+        last = array_get(&seq->data.fields, seq->data.fields.elnum - 1);
+        delta += (*last)->packsz;
+        mrkdata_datum_destroy(last);
+        array_decr(&seq->data.fields);
+    }
+
+    for (i = 0; i <= depth; ++i) {
+        mrkdata_datum_adjust_packsz(spine[i], -delta);
+    }
+
+    return 0;
+}
+
+/*
+ * Append field to dat in place.  dat must not be a child of another
+ * datum: its parents' sizes are not updated.  Use
+ * mrkdata_datum_add_path() for the datums inside a tree.  A NULL field
+ * is absent, and makes dat a sparse STRUCT, see sparse.c.  A shared dat
+ * is an error, see mrkdata_datum_unshare(), and field is then left to
+ * the caller.
+ */
+int
 mrkdata_datum_add_field(mrkdata_datum_t *dat, mrkdata_datum_t *field)
 {
     mrkdata_datum_t **pdat;
 
     assert(MRKDATA_TAG_CUSTOM(dat->spec->tag));
 
+    if (__atomic_load_n(&dat->nref, __ATOMIC_RELAXED) != 1) {
+        TRRET(MRKDATA_DATUM_ADD_FIELD + 1);
+    }
+
     if ((pdat = array_incr(&dat->data.fields)) == NULL) {
         FAIL("array_incr");
     }
 
     *pdat = field;
-    mrkdata_datum_adjust_packsz(dat, field->packsz);
+    datum_uncache(dat);
+    if (field != NULL) {
+        mrkdata_datum_adjust_packsz(dat, field->packsz);
+    }
+    return 0;
 }
 
 mrkdata_datum_t *
@@ -1035,6 +2228,7 @@ mrkdata_datum_make_u8(uint8_t v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_UINT8];
     res->packsz = EXPECT_SZ(MRKDATA_UINT8);
@@ -1050,6 +2244,7 @@ mrkdata_datum_make_i8(int8_t v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_INT8];
     res->packsz = EXPECT_SZ(MRKDATA_INT8);
@@ -1065,6 +2260,7 @@ mrkdata_datum_make_u16(uint16_t v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_UINT16];
     res->packsz = EXPECT_SZ(MRKDATA_UINT16);
@@ -1080,6 +2276,7 @@ mrkdata_datum_make_i16(int16_t v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_INT16];
     res->packsz = EXPECT_SZ(MRKDATA_INT16);
@@ -1095,6 +2292,7 @@ mrkdata_datum_make_u32(uint32_t v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_UINT32];
     res->packsz = EXPECT_SZ(MRKDATA_UINT32);
@@ -1110,6 +2308,7 @@ mrkdata_datum_make_i32(int32_t v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_INT32];
     res->packsz = EXPECT_SZ(MRKDATA_INT32);
@@ -1125,6 +2324,7 @@ mrkdata_datum_make_u64(uint64_t v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_UINT64];
     res->packsz = EXPECT_SZ(MRKDATA_UINT64);
@@ -1140,6 +2340,7 @@ mrkdata_datum_make_i64(int64_t v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_INT64];
     res->packsz = EXPECT_SZ(MRKDATA_INT64);
@@ -1155,6 +2356,7 @@ mrkdata_datum_make_double(double v)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_DOUBLE];
     res->packsz = EXPECT_SZ(MRKDATA_DOUBLE);
@@ -1170,6 +2372,7 @@ mrkdata_datum_make_str8(char *v, int8_t sz)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_STR8];
     res->packsz = EXPECT_SZ(MRKDATA_STR8) + sz;
@@ -1177,6 +2380,7 @@ mrkdata_datum_make_str8(char *v, int8_t sz)
     if ((res->data.str = malloc(sz)) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sz);
     if (v != NULL) {
         memcpy(res->data.str, v, sz);
     } else {
@@ -1193,6 +2397,7 @@ mrkdata_datum_make_str16(char *v, int16_t sz)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_STR16];
     res->packsz = EXPECT_SZ(MRKDATA_STR16) + sz;
@@ -1200,6 +2405,7 @@ mrkdata_datum_make_str16(char *v, int16_t sz)
     if ((res->data.str = malloc(sz)) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sz);
     if (v != NULL) {
         memcpy(res->data.str, v, sz);
     } else {
@@ -1216,6 +2422,7 @@ mrkdata_datum_make_str32(char *v, int32_t sz)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_STR32];
     res->packsz = EXPECT_SZ(MRKDATA_STR32) + sz;
@@ -1223,6 +2430,7 @@ mrkdata_datum_make_str32(char *v, int32_t sz)
     if ((res->data.str = malloc(sz)) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sz);
     if (v != NULL) {
         memcpy(res->data.str, v, sz);
     } else {
@@ -1239,6 +2447,7 @@ mrkdata_datum_make_str64(char *v, int64_t sz)
     if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
     datum_init(res);
     res->spec = &builtin_specs[MRKDATA_STR64];
     res->packsz = EXPECT_SZ(MRKDATA_STR64) + sz;
@@ -1246,6 +2455,7 @@ mrkdata_datum_make_str64(char *v, int64_t sz)
     if ((res->data.str = malloc(sz)) == NULL) {
         FAIL("malloc");
     }
+    MRKDATA_STATS_ALLOC(sz);
     if (v != NULL) {
         memcpy(res->data.str, v, sz);
     } else {
@@ -1254,6 +2464,111 @@ mrkdata_datum_make_str64(char *v, int64_t sz)
     return res;
 }
 
+/*
+ * STR64 of sz bytes whose body is not in memory.  It can only be
+ * written by a stream writer, that gets the body from its fill
+ * callback, see stream.c.
+ */
+mrkdata_datum_t *
+mrkdata_datum_make_str64_stream(int64_t sz)
+{
+    mrkdata_datum_t *res;
+
+    if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
+    datum_init(res);
+    res->spec = &builtin_specs[MRKDATA_STR64];
+    res->packsz = EXPECT_SZ(MRKDATA_STR64) + sz;
+    res->value.sz64 = sz;
+    return res;
+}
+
+static void
+str_nofree(UNUSED void *str)
+{
+}
+
+/*
+ * String datum of tag that takes over the sz bytes at v, with no copy.
+ * They are released with strfree, or free() if it is NULL, when the
+ * datum is destroyed.
+ */
+mrkdata_datum_t *
+mrkdata_datum_adopt_str(mrkdata_tag_t tag,
+                        char *v,
+                        int64_t sz,
+                        void (*strfree)(void *))
+{
+    mrkdata_datum_t *res;
+    int64_t maxsz;
+
+    switch (tag) {
+    case MRKDATA_STR8:
+        maxsz = INT8_MAX;
+        break;
+
+    case MRKDATA_STR16:
+        maxsz = INT16_MAX;
+        break;
+
+    case MRKDATA_STR32:
+        maxsz = INT32_MAX;
+        break;
+
+    case MRKDATA_STR64:
+        maxsz = INT64_MAX - EXPECT_SZ(MRKDATA_STR64);
+        break;
+
+    default:
+        MRKDATA_STATS_ERROR(MRKDATA_DATUM_ADOPT_STR + 1);
+        return NULL;
+    }
+
+    if (sz < 0 || sz > maxsz || (v == NULL && sz > 0)) {
+        MRKDATA_STATS_ERROR(MRKDATA_DATUM_ADOPT_STR + 2);
+        return NULL;
+    }
+
+    if ((res = malloc(sizeof(mrkdata_datum_t))) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_datum_t));
+    datum_init(res);
+    res->spec = &builtin_specs[tag];
+    res->packsz = EXPECT_SZ(tag) + sz;
+    switch (tag) {
+    case MRKDATA_STR8:
+        res->value.sz8 = sz;
+        break;
+
+    case MRKDATA_STR16:
+        res->value.sz16 = sz;
+        break;
+
+    case MRKDATA_STR32:
+        res->value.sz32 = sz;
+        break;
+
+    default:
+        res->value.sz64 = sz;
+    }
+    res->data.str = v;
+    res->strfree = strfree;
+    return res;
+}
+
+/*
+ * String datum of tag that refers to the sz bytes at v, with no copy.
+ * They must outlive the datum, and are left alone when it is destroyed.
+ */
+mrkdata_datum_t *
+mrkdata_datum_borrow_str(mrkdata_tag_t tag, const char *v, int64_t sz)
+{
+    return mrkdata_datum_adopt_str(tag, (char *)v, sz, str_nofree);
+}
+
 /* module */
 void
 mrkdata_init(void)
@@ -1284,6 +2599,7 @@ mrkdata_fini(void)
     if (!(mflags & MRKDATA_MFLAG_INITIALIZED)) {
         return;
     }
+    mrkdata_resolve_flush();
     array_fini(&specs);
     mflags &= ~MRKDATA_MFLAG_INITIALIZED;
 }
@@ -37,10 +37,41 @@ typedef enum _mrkdata_tag {
     MRKDATA_SEQ,
     MRKDATA_DICT,
     MRKDATA_FUNC,
+    /*
+     * Back-reference to a string of a dictionary-encoded stream, see
+     * strdict.c.  Not valid in plain records.
+     */
+    MRKDATA_STRREF,
+    /*
+     * Delta and frame-of-reference encoded SEQ of integers, see
+     * intseq.c.  Not valid in plain records.
+     */
+    MRKDATA_INTSEQ,
+    /*
+     * SEQ with an offset table, see seqidx.c.  Not valid in plain
+     * records.
+     */
+    MRKDATA_SEQIDX,
+    /*
+     * STRUCT with absent fields, see sparse.c.  Not valid in plain
+     * records.
+     */
+    MRKDATA_SPARSE,
+    /*
+     * Scalars with no tags of their own, and the mark of a little-endian
+     * record, see le.c.  Only valid in little-endian records.
+     */
+    MRKDATA_ARRAY,
+    MRKDATA_LE,
+    /*
+     * Record with a checksum, see crc.c.  Only valid at the top of a
+     * stream.
+     */
+    MRKDATA_CRC,
 } mrkdata_tag_t;
 
 #define MRKDATA_BUILTIN_TAG_END (MRKDATA_STR64 + 1)
-#define MRKDATA_TAG_END (MRKDATA_FUNC + 1)
+#define MRKDATA_TAG_END (MRKDATA_CRC + 1)
 
 #define MRKDATA_TAG_CUSTOM(tag) \
     ((tag) == MRKDATA_STRUCT || \
@@ -66,9 +97,17 @@ typedef enum _mrkdata_tag {
      tag == MRKDATA_SEQ ? "SEQ" : \
      tag == MRKDATA_DICT ? "DICT" : \
      tag == MRKDATA_FUNC ? "FUNC" : \
+     tag == MRKDATA_STRREF ? "STRREF" : \
+     tag == MRKDATA_INTSEQ ? "INTSEQ" : \
+     tag == MRKDATA_SEQIDX ? "SEQIDX" : \
+     tag == MRKDATA_SPARSE ? "SPARSE" : \
+     tag == MRKDATA_ARRAY ? "ARRAY" : \
+     tag == MRKDATA_LE ? "LE" : \
+     tag == MRKDATA_CRC ? "CRC" : \
      "<unknown>")
 
 struct _mrkdata_datum;
+struct _mrkdata_packed;
 
 typedef struct _mrkdata_spec {
     /*
@@ -101,10 +140,328 @@ typedef struct _mrkdata_datum {
         char *str;
         mnarray_t fields;
     } data;
+    /* releases data.str, free() if NULL, see mrkdata_datum_adopt_str() */
+    void (*strfree)(void *);
+    /*
+     * Packed bytes of a STRUCT or SEQ unchanged since it was unpacked,
+     * and the buffer that holds them, see mrkdata_unpack_buf_cached().
+     */
+    const unsigned char *packed;
+    struct _mrkdata_packed *packedbuf;
     ssize_t packsz;
-    struct _mrkdata_datum *parent;
+    /*
+     * Datums are reference-counted and may be shared between trees,
+     * see mrkdata_datum_clone().
+     */
+    unsigned nref;
 } mrkdata_datum_t;
 
+/*
+ * Limits for the records coming from untrusted sources.  Zero means the
+ * default: MRKDATA_MAXDEPTH for maxdepth, and no limit for the rest.
+ */
+#define MRKDATA_MAXDEPTH 64
+
+typedef struct _mrkdata_limits {
+    unsigned maxdepth;
+    uint64_t maxelems;
+    int64_t maxstrsz;
+} mrkdata_limits_t;
+
+/*
+ * mrkdata_validate_buf() error subcodes, see MRKDATA_DIAG_SUBCODE().
+ */
+#define MRKDATA_VALIDATE_ETRUNC 1   /* buffer or container too short */
+#define MRKDATA_VALIDATE_ETAG 2     /* unknown or unsupported tag */
+#define MRKDATA_VALIDATE_ESPEC 3    /* tag does not match the spec */
+#define MRKDATA_VALIDATE_ESZ 4      /* negative length */
+#define MRKDATA_VALIDATE_ESTRSZ 5   /* string longer than maxstrsz */
+#define MRKDATA_VALIDATE_EDEPTH 6   /* nested deeper than maxdepth */
+#define MRKDATA_VALIDATE_ENELEMS 7  /* more than maxelems elements */
+#define MRKDATA_VALIDATE_EFIELDS 8  /* STRUCT fields do not match the spec */
+
+#define MRKDATA_DIAG_SUBCODE(code) ((code) & 0xffff)
+
+/*
+ * mrkdata_walk_buf() events.
+ */
+typedef enum _mrkdata_walk_event {
+    MRKDATA_WALK_ENTER,
+    MRKDATA_WALK_LEAVE,
+    MRKDATA_WALK_VALUE,
+} mrkdata_walk_event_t;
+
+/* returned from MRKDATA_WALK_ENTER to skip the container */
+#define MRKDATA_WALK_SKIP (-2)
+
+typedef int (*mrkdata_walk_cb_t)(mrkdata_walk_event_t,
+                                 mrkdata_tag_t,
+                                 const unsigned char *,
+                                 ssize_t,
+                                 unsigned,
+                                 void *);
+
+/*
+ * Runtime statistics.
+ *
+ * Counters are kept per thread and merged on mrkdata_stats_snapshot().
+ * Latency histograms are only collected for the specs registered with
+ * mrkdata_stats_hist_enable(), one sample out of every "sample" top-level
+ * pack/unpack calls.
+ */
+#define MRKDATA_STATS_NHIST 8
+#define MRKDATA_STATS_NBUCKETS 32
+#define MRKDATA_STATS_NERRORS 64
+/* index in mrkdata_stats_t.errors[] to a diag class usable in diag_str() */
+#define MRKDATA_STATS_ERROR_CODE(idx) \
+    ((int)(0x80000000u + ((unsigned)(idx) << 16)))
+
+typedef struct _mrkdata_stats_hist {
+    const mrkdata_spec_t *spec;
+    /* bucket i counts samples in [2^(i-1), 2^i) nanoseconds */
+    uint64_t pack[MRKDATA_STATS_NBUCKETS];
+    uint64_t unpack[MRKDATA_STATS_NBUCKETS];
+} mrkdata_stats_hist_t;
+
+typedef struct _mrkdata_stats {
+    /* top-level records and their bytes */
+    uint64_t npacked;
+    uint64_t bpacked;
+    uint64_t nunpacked;
+    uint64_t bunpacked;
+    uint64_t nparsed;
+    uint64_t bparsed;
+    /* datum and payload allocations */
+    uint64_t nalloc;
+    uint64_t balloc;
+    /* values packed, unpacked or parsed, by tag */
+    uint64_t values[MRKDATA_TAG_END];
+    /* errors, by diag class */
+    uint64_t errors[MRKDATA_STATS_NERRORS];
+    mrkdata_stats_hist_t hist[MRKDATA_STATS_NHIST];
+} mrkdata_stats_t;
+
+/*
+ * Indexed record files.
+ *
+ * Records are packed back to back into blocks of about blocksz bytes,
+ * and the file ends with an index of the blocks, see file.c.  For every
+ * block the index keeps the min and max of up to MRKDATA_FILE_MAXINDEX
+ * fixed-size numeric fields of the top-level STRUCT, the first of which
+ * is meant to be the timestamp.
+ */
+#define MRKDATA_FILE_MAXINDEX 8
+
+/*
+ * Up to MRKDATA_FILE_MAXBLOOM top-level fields of any tag can also have
+ * a Bloom filter per block, for point lookups.
+ */
+#define MRKDATA_FILE_MAXBLOOM 4
+
+typedef struct _mrkdata_fblock {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t nrecs;
+    /* order-preserving keys, see mrkdata_key_encode() */
+    uint64_t min[MRKDATA_FILE_MAXINDEX];
+    uint64_t max[MRKDATA_FILE_MAXINDEX];
+    /* filters of the block, one after another, bloomsz bytes each */
+    uint64_t bloomoff;
+    uint64_t bloomsz;
+    /* CRC32C of the block, if the file has them */
+    uint32_t crc;
+} mrkdata_fblock_t;
+
+typedef struct _mrkdata_fwriter {
+    int fd;
+    const mrkdata_spec_t *spec;
+    unsigned char *buf;
+    ssize_t bufsz;
+    ssize_t blocksz;
+    ssize_t pos;
+    uint64_t offset;
+    unsigned nindex;
+    unsigned index[MRKDATA_FILE_MAXINDEX];
+    /* keys never went down so far */
+    int sorted[MRKDATA_FILE_MAXINDEX];
+    uint64_t prev[MRKDATA_FILE_MAXINDEX];
+    unsigned nbloom;
+    unsigned bloom[MRKDATA_FILE_MAXBLOOM];
+    /* field hashes of the current block, nbloom per record */
+    uint64_t *hashes;
+    size_t hashessz;
+    unsigned char *blooms;
+    size_t bloomssz;
+    /* checksum the blocks */
+    int crc;
+    mrkdata_fblock_t cur;
+    mnarray_t blocks;
+} mrkdata_fwriter_t;
+
+typedef struct _mrkdata_freader {
+    int fd;
+    const mrkdata_spec_t *spec;
+    unsigned nindex;
+    unsigned index[MRKDATA_FILE_MAXINDEX];
+    int sorted[MRKDATA_FILE_MAXINDEX];
+    unsigned nbloom;
+    unsigned bloom[MRKDATA_FILE_MAXBLOOM];
+    unsigned char *blooms;
+    /* verify the blocks as they are read */
+    int crc;
+    mnarray_t blocks;
+    unsigned char *buf;
+    ssize_t bufsz;
+    /* blocks actually read */
+    uint64_t nread;
+} mrkdata_freader_t;
+
+typedef int (*mrkdata_frecord_cb_t)(const unsigned char *, ssize_t, void *);
+
+/*
+ * mrkdata_scan_fd() parameters, zero means the default.
+ */
+typedef struct _mrkdata_scan_params {
+    /* range of the file, end is the file size by default */
+    off_t start;
+    off_t end;
+    /* size of every read, 1M by default */
+    ssize_t bufsz;
+    /* reads in flight, 4 by default */
+    unsigned depth;
+    /* reading threads, 2 by default */
+    unsigned nthreads;
+} mrkdata_scan_params_t;
+
+/*
+ * Record streams with STR64 bodies that are not in memory, see
+ * stream.c.  A fill callback puts up to sz bytes of the body of the
+ * datum in the buffer and returns how many, a chunk callback gets the
+ * next sz bytes of it.
+ */
+typedef ssize_t (*mrkdata_fill_cb_t)(const mrkdata_datum_t *,
+                                     unsigned char *,
+                                     ssize_t,
+                                     void *);
+typedef int (*mrkdata_chunk_cb_t)(const mrkdata_datum_t *,
+                                  const unsigned char *,
+                                  ssize_t,
+                                  void *);
+
+typedef struct _mrkdata_swriter {
+    int fd;
+    unsigned char *buf;
+    ssize_t bufsz;
+    ssize_t pos;
+    mrkdata_fill_cb_t fill;
+    void *udata;
+} mrkdata_swriter_t;
+
+typedef struct _mrkdata_sreader {
+    int fd;
+    unsigned char *buf;
+    ssize_t bufsz;
+    /* unread bytes are buf[pos, end) */
+    ssize_t pos;
+    ssize_t end;
+    /*
+     * The buffer grows up to maxbufsz for other strings than STR64
+     * longer than bufsz, larger ones are an error.
+     */
+    ssize_t maxbufsz;
+    mrkdata_chunk_cb_t chunk;
+    void *udata;
+} mrkdata_sreader_t;
+
+/*
+ * Stream string dictionary, see strdict.c.  The writer and the reader of
+ * a stream each keep one, and see the same records in the same order.
+ */
+#define MRKDATA_STRDICT_MAXENTRIES 65536
+/* shorter strings are always written in full */
+#define MRKDATA_STRDICT_MINSZ 2
+/* longer strings are always written in full, and not kept */
+#define MRKDATA_STRDICT_MAXSZ 256
+
+typedef struct _mrkdata_strdict {
+    /* a power of 2 */
+    unsigned nentries;
+    /* the entry to be replaced next */
+    unsigned next;
+    /* kept string datums, shared with the records */
+    mrkdata_datum_t **entries;
+    /* writer only, string hash to entry index + 1 */
+    uint32_t *index;
+} mrkdata_strdict_t;
+
+/*
+ * Items of an INTSEQ share a width per block of MRKDATA_INTSEQ_BLOCK,
+ * see intseq.c.
+ */
+#define MRKDATA_INTSEQ_BLOCK 128
+
+/*
+ * Size of the header of a CRC record: the tag, the length and the
+ * checksum, see crc.c.
+ */
+#define MRKDATA_CRC_HDRSZ 13
+
+/*
+ * Delimited text format of a record, see load.c.  A tree parallel to
+ * the spec: fields has the formats of the fields of a STRUCT, or the
+ * format of the item of a SEQ, and may be NULL or have NULL entries for
+ * scalars and strings.
+ */
+/* integer field is a date and time, or seconds since the epoch */
+#define MRKDATA_LOAD_TIMESTAMP 0x01
+
+typedef struct _mrkdata_load_fmt {
+    /* between the fields of a STRUCT, or the items of a SEQ */
+    char delim;
+    unsigned flags;
+    const struct _mrkdata_load_fmt **fields;
+} mrkdata_load_fmt_t;
+
+/*
+ * mrkdata_load_fd() parameters, zero means the default.
+ */
+typedef struct _mrkdata_load_params {
+    /* lines starting in a chunk are packed together, 4M by default */
+    ssize_t chunksz;
+    /* chunks in flight, 8 by default */
+    unsigned depth;
+    /* packing threads, 4 by default */
+    unsigned nthreads;
+} mrkdata_load_params_t;
+
+/*
+ * Message transport, see msg.c.  A request or a reply is a record of up
+ * to MRKDATA_MSG_MAXSZ bytes, and a 64-bit correlation id.
+ */
+#define MRKDATA_MSG_MAXSZ (64 * 1024 * 1024)
+
+typedef struct _mrkdata_conn mrkdata_conn_t;
+typedef struct _mrkdata_server mrkdata_server_t;
+typedef struct _mrkdata_client mrkdata_client_t;
+
+typedef int (*mrkdata_msg_cb_t)(mrkdata_conn_t *,
+                                uint64_t,
+                                const unsigned char *,
+                                ssize_t,
+                                void *);
+
+/*
+ * Shared-memory ring, see ring.c.
+ */
+#define MRKDATA_RING_SPSC 0x01  /* only one writer */
+
+typedef struct _mrkdata_ring mrkdata_ring_t;
+
+/*
+ * Mapping from a writer spec to a reader spec, see resolve.c.
+ */
+typedef struct _mrkdata_resolve mrkdata_resolve_t;
+
 
 void mrkdata_init(void);
 void mrkdata_fini(void);
@@ -119,17 +476,51 @@ ssize_t mrkdata_unpack_buf(const mrkdata_spec_t *,
                            const unsigned char *,
                            ssize_t,
                            mrkdata_datum_t **);
+ssize_t mrkdata_unpack_buf_cached(const mrkdata_spec_t *,
+                                  const unsigned char *,
+                                  ssize_t,
+                                  mrkdata_datum_t **);
 ssize_t mrkdata_pack_datum(const mrkdata_datum_t *,
                            unsigned char *,
                            ssize_t);
+int mrkdata_validate_buf(const mrkdata_spec_t *,
+                         const unsigned char *,
+                         ssize_t,
+                         const mrkdata_limits_t *,
+                         ssize_t *);
+ssize_t mrkdata_walk_buf(const unsigned char *,
+                         ssize_t,
+                         const mrkdata_limits_t *,
+                         mrkdata_walk_cb_t,
+                         void *);
+ssize_t mrkdata_buf_size(const unsigned char *, ssize_t);
+const unsigned char *mrkdata_buf_get_field(const unsigned char *,
+                                          ssize_t,
+                                          unsigned,
+                                          ssize_t *);
 mrkdata_spec_t *mrkdata_make_spec(mrkdata_tag_t);
 void mrkdata_spec_set_name(mrkdata_spec_t *, const char *);
+mrkdata_spec_t *mrkdata_make_named_spec(mrkdata_tag_t, const char *);
 void mrkdata_spec_add_field(mrkdata_spec_t *, mrkdata_spec_t *);
 int mrkdata_spec_destroy(mrkdata_spec_t **);
 int mrkdata_spec_dump(mrkdata_spec_t *);
 int mrkdata_datum_destroy(mrkdata_datum_t **);
 int mrkdata_datum_dump(mrkdata_datum_t *);
-void mrkdata_datum_add_field(mrkdata_datum_t *, mrkdata_datum_t *);
+mrkdata_datum_t *mrkdata_datum_clone(mrkdata_datum_t *);
+mrkdata_datum_t *mrkdata_datum_unshare(mrkdata_datum_t **);
+int mrkdata_datum_set_path(mrkdata_datum_t **,
+                           const unsigned *,
+                           unsigned,
+                           mrkdata_datum_t *);
+int mrkdata_datum_add_path(mrkdata_datum_t **,
+                           const unsigned *,
+                           unsigned,
+                           mrkdata_datum_t *);
+int mrkdata_datum_trunc_path(mrkdata_datum_t **,
+                             const unsigned *,
+                             unsigned,
+                             uint64_t);
+int mrkdata_datum_add_field(mrkdata_datum_t *, mrkdata_datum_t *);
 mrkdata_datum_t *mrkdata_datum_get_field(mrkdata_datum_t *, unsigned);
 mrkdata_datum_t *mrkdata_datum_from_spec(mrkdata_spec_t *, void *, size_t);
 mrkdata_datum_t *mrkdata_datum_make_u8(uint8_t);
@@ -145,6 +536,265 @@ mrkdata_datum_t *mrkdata_datum_make_str8(char *, int8_t);
 mrkdata_datum_t *mrkdata_datum_make_str16(char *, int16_t);
 mrkdata_datum_t *mrkdata_datum_make_str32(char *, int32_t);
 mrkdata_datum_t *mrkdata_datum_make_str64(char *, int64_t);
+mrkdata_datum_t *mrkdata_datum_make_str64_stream(int64_t);
+mrkdata_datum_t *mrkdata_datum_adopt_str(mrkdata_tag_t,
+                                         char *,
+                                         int64_t,
+                                         void (*)(void *));
+mrkdata_datum_t *mrkdata_datum_borrow_str(mrkdata_tag_t,
+                                          const char *,
+                                          int64_t);
+
+uint64_t mrkdata_datum_hash(const mrkdata_datum_t *, uint64_t);
+uint64_t mrkdata_buf_hash(const unsigned char *, ssize_t, uint64_t);
+int mrkdata_datum_cmp(const mrkdata_datum_t *, const mrkdata_datum_t *);
+int mrkdata_buf_cmp(const unsigned char *,
+                    ssize_t,
+                    const unsigned char *,
+                    ssize_t);
+
+ssize_t mrkdata_key_size(const mrkdata_datum_t *);
+ssize_t mrkdata_key_encode(const mrkdata_datum_t *, unsigned char *, ssize_t);
+ssize_t mrkdata_key_encode_fields(const mrkdata_datum_t *,
+                                  const unsigned *,
+                                  unsigned,
+                                  unsigned char *,
+                                  ssize_t);
+ssize_t mrkdata_key_encode_buf(const unsigned char *,
+                               ssize_t,
+                               unsigned char *,
+                               ssize_t);
+ssize_t mrkdata_key_decode(const mrkdata_spec_t *,
+                           const unsigned char *,
+                           ssize_t,
+                           mrkdata_datum_t **);
+
+int mrkdata_fwriter_init(mrkdata_fwriter_t *,
+                         int,
+                         const mrkdata_spec_t *,
+                         ssize_t);
+int mrkdata_fwriter_add_index(mrkdata_fwriter_t *, unsigned);
+int mrkdata_fwriter_add_bloom(mrkdata_fwriter_t *, unsigned);
+int mrkdata_fwriter_add_crc(mrkdata_fwriter_t *);
+int mrkdata_fwriter_write(mrkdata_fwriter_t *, const mrkdata_datum_t *);
+int mrkdata_fwriter_write_buf(mrkdata_fwriter_t *,
+                              const unsigned char *,
+                              ssize_t);
+int mrkdata_fwriter_fini(mrkdata_fwriter_t *);
+int mrkdata_freader_init(mrkdata_freader_t *, int, const mrkdata_spec_t *);
+int mrkdata_freader_read_block(mrkdata_freader_t *,
+                               unsigned,
+                               const unsigned char **,
+                               ssize_t *);
+int mrkdata_freader_scan(mrkdata_freader_t *,
+                         unsigned,
+                         const mrkdata_datum_t *,
+                         const mrkdata_datum_t *,
+                         mrkdata_frecord_cb_t,
+                         void *);
+int mrkdata_freader_lookup(mrkdata_freader_t *,
+                           unsigned,
+                           const mrkdata_datum_t *,
+                           mrkdata_frecord_cb_t,
+                           void *);
+int mrkdata_freader_fini(mrkdata_freader_t *);
+ssize_t mrkdata_diff(const mrkdata_datum_t *,
+                     const mrkdata_datum_t *,
+                     unsigned char *,
+                     ssize_t);
+int mrkdata_patch_datum(mrkdata_datum_t **, const unsigned char *, ssize_t);
+ssize_t mrkdata_patch_buf(unsigned char *,
+                          ssize_t,
+                          ssize_t,
+                          const unsigned char *,
+                          ssize_t);
+
+int mrkdata_swriter_init(mrkdata_swriter_t *,
+                         int,
+                         ssize_t,
+                         mrkdata_fill_cb_t,
+                         void *);
+int mrkdata_swriter_write(mrkdata_swriter_t *, const mrkdata_datum_t *);
+int mrkdata_swriter_flush(mrkdata_swriter_t *);
+int mrkdata_swriter_fini(mrkdata_swriter_t *);
+int mrkdata_sreader_init(mrkdata_sreader_t *,
+                         int,
+                         ssize_t,
+                         mrkdata_chunk_cb_t,
+                         void *);
+int mrkdata_sreader_read(mrkdata_sreader_t *,
+                         const mrkdata_spec_t *,
+                         mrkdata_datum_t **);
+int mrkdata_sreader_fini(mrkdata_sreader_t *);
+ssize_t mrkdata_fill_fd(const mrkdata_datum_t *,
+                        unsigned char *,
+                        ssize_t,
+                        void *);
+int mrkdata_chunk_fd(const mrkdata_datum_t *,
+                     const unsigned char *,
+                     ssize_t,
+                     void *);
+int mrkdata_scan_fd(int,
+                    const mrkdata_scan_params_t *,
+                    mrkdata_frecord_cb_t,
+                    void *);
+
+ssize_t mrkdata_intseq_encode(mrkdata_tag_t,
+                              const uint64_t *,
+                              uint64_t,
+                              unsigned char *,
+                              ssize_t);
+ssize_t mrkdata_intseq_decode(const unsigned char *,
+                              ssize_t,
+                              mrkdata_tag_t *,
+                              uint64_t *,
+                              uint64_t *);
+ssize_t mrkdata_intseq_pack_datum(const mrkdata_datum_t *,
+                                  unsigned char *,
+                                  ssize_t);
+ssize_t mrkdata_intseq_unpack_buf(const mrkdata_spec_t *,
+                                  const unsigned char *,
+                                  ssize_t,
+                                  mrkdata_datum_t **);
+
+ssize_t mrkdata_seqidx_pack_datum(const mrkdata_datum_t *,
+                                  unsigned,
+                                  unsigned char *,
+                                  ssize_t);
+int64_t mrkdata_seqidx_nitems(const unsigned char *, ssize_t);
+const unsigned char *mrkdata_seqidx_get(const unsigned char *,
+                                        ssize_t,
+                                        uint64_t,
+                                        ssize_t *);
+ssize_t mrkdata_seqidx_unpack_buf(const mrkdata_spec_t *,
+                                  const unsigned char *,
+                                  ssize_t,
+                                  mrkdata_datum_t **,
+                                  unsigned);
+
+ssize_t mrkdata_sparse_pack_datum(const mrkdata_datum_t *,
+                                  unsigned char *,
+                                  ssize_t);
+ssize_t mrkdata_sparse_unpack_buf(const mrkdata_spec_t *,
+                                  const unsigned char *,
+                                  ssize_t,
+                                  mrkdata_datum_t **);
+const unsigned char *mrkdata_sparse_get_field(const unsigned char *,
+                                              ssize_t,
+                                              unsigned,
+                                              ssize_t *);
+
+ssize_t mrkdata_le_pack_datum(const mrkdata_datum_t *,
+                              unsigned char *,
+                              ssize_t);
+ssize_t mrkdata_le_unpack_buf(const mrkdata_spec_t *,
+                              const unsigned char *,
+                              ssize_t,
+                              mrkdata_datum_t **);
+const unsigned char *mrkdata_le_buf_get_field(const unsigned char *,
+                                              ssize_t,
+                                              unsigned,
+                                              ssize_t *);
+const void *mrkdata_le_get_array(const unsigned char *,
+                                 ssize_t,
+                                 mrkdata_tag_t *,
+                                 uint64_t *);
+
+uint32_t mrkdata_crc32c(uint32_t, const void *, size_t);
+ssize_t mrkdata_crc_seal(unsigned char *, ssize_t);
+ssize_t mrkdata_crc_pack_datum(const mrkdata_datum_t *,
+                               unsigned char *,
+                               ssize_t);
+const unsigned char *mrkdata_crc_open(const unsigned char *,
+                                      ssize_t,
+                                      ssize_t *);
+ssize_t mrkdata_crc_unpack_buf(const mrkdata_spec_t *,
+                               const unsigned char *,
+                               ssize_t,
+                               mrkdata_datum_t **);
+
+const mrkdata_resolve_t *mrkdata_resolve(const mrkdata_spec_t *,
+                                         const mrkdata_spec_t *,
+                                         mrkdata_datum_t *);
+void mrkdata_resolve_flush(void);
+ssize_t mrkdata_resolve_unpack_buf(const mrkdata_resolve_t *,
+                                   const unsigned char *,
+                                   ssize_t,
+                                   mrkdata_datum_t **);
+
+ssize_t mrkdata_load_line(const mrkdata_spec_t *,
+                          const mrkdata_load_fmt_t *,
+                          const char *,
+                          size_t,
+                          unsigned char *,
+                          ssize_t);
+int mrkdata_load_fd(int,
+                    const mrkdata_spec_t *,
+                    const mrkdata_load_fmt_t *,
+                    const mrkdata_load_params_t *,
+                    mrkdata_frecord_cb_t,
+                    void *,
+                    uint64_t *);
+
+mrkdata_server_t *mrkdata_server_new(int, mrkdata_msg_cb_t, void *);
+int mrkdata_server_poll(mrkdata_server_t *, int);
+int mrkdata_server_destroy(mrkdata_server_t **);
+int mrkdata_conn_reply(mrkdata_conn_t *, uint64_t, const mrkdata_datum_t *);
+int mrkdata_conn_reply_buf(mrkdata_conn_t *,
+                           uint64_t,
+                           const unsigned char *,
+                           ssize_t);
+mrkdata_client_t *mrkdata_client_new(int);
+int mrkdata_client_send(mrkdata_client_t *,
+                        const mrkdata_datum_t *,
+                        uint64_t *);
+int mrkdata_client_flush(mrkdata_client_t *);
+int mrkdata_client_recv(mrkdata_client_t *,
+                        uint64_t *,
+                        const unsigned char **,
+                        ssize_t *);
+int mrkdata_client_destroy(mrkdata_client_t **);
+
+mrkdata_ring_t *mrkdata_ring_create(int, size_t, unsigned);
+mrkdata_ring_t *mrkdata_ring_attach(int);
+int mrkdata_ring_destroy(mrkdata_ring_t **);
+int mrkdata_ring_write(mrkdata_ring_t *, const mrkdata_datum_t *, int);
+int mrkdata_ring_write_buf(mrkdata_ring_t *,
+                           const unsigned char *,
+                           ssize_t,
+                           int);
+ssize_t mrkdata_ring_read(mrkdata_ring_t *, const unsigned char **, int);
+void mrkdata_ring_read_done(mrkdata_ring_t *);
+
+int mrkdata_strdict_init(mrkdata_strdict_t *, unsigned);
+int mrkdata_strdict_fini(mrkdata_strdict_t *);
+ssize_t mrkdata_strdict_pack_datum(mrkdata_strdict_t *,
+                                   const mrkdata_datum_t *,
+                                   unsigned char *,
+                                   ssize_t);
+ssize_t mrkdata_strdict_unpack_buf(mrkdata_strdict_t *,
+                                   const mrkdata_spec_t *,
+                                   const unsigned char *,
+                                   ssize_t,
+                                   mrkdata_datum_t **);
+
+ssize_t mrkdata_json_to_buf(const mrkdata_spec_t *,
+                            const char *,
+                            size_t,
+                            unsigned char *,
+                            ssize_t);
+ssize_t mrkdata_buf_to_json(const mrkdata_spec_t *,
+                            const unsigned char *,
+                            ssize_t,
+                            char *,
+                            ssize_t);
+
+int mrkdata_stats_hist_enable(const mrkdata_spec_t *, unsigned);
+int mrkdata_stats_hist_disable(const mrkdata_spec_t *);
+void mrkdata_stats_snapshot(mrkdata_stats_t *);
+void mrkdata_stats_merge(mrkdata_stats_t *, const mrkdata_stats_t *);
+void mrkdata_stats_reset(void);
+int mrkdata_stats_dump(const mrkdata_stats_t *);
 
 #ifdef __cplusplus
 }
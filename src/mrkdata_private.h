@@ -1,13 +1,163 @@
 #ifndef MRKDATA_PRIVATE_H
 #define MRKDATA_PRIVATE_H
 
+#include <time.h>
+
+#include <mrkdata.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * mrkdata.c
+ */
+extern const ssize_t mrkdata_tag_sz[];
+
+/* tag and fixed-size part of an element */
+#define MRKDATA_EXPECT_SZ(t) ((ssize_t)(sizeof(char) + mrkdata_tag_sz[t]))
+
+/*
+ * The integer of the magnitude *pu and the sign neg, as written for the
+ * integer tag, two's complement if it is signed.  Return -1 if it is out
+ * of the range of tag.
+ */
+static inline int
+mrkdata_int_fit(mrkdata_tag_t tag, int neg, uint64_t *pu)
+{
+    if (tag & 1) {
+        /* signed: INT8, INT16, INT32, INT64 */
+        uint64_t max = (1ull << (mrkdata_tag_sz[tag] * 8 - 1)) - 1;
+
+        if (*pu > max + neg) {
+            return -1;
+        }
+        *pu = neg ? -*pu : *pu;
+    } else if (neg && *pu != 0) {
+        return -1;
+    } else if (mrkdata_tag_sz[tag] < 8 &&
+               *pu >> (mrkdata_tag_sz[tag] * 8) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* the sz low bytes of v at p, big-endian */
+static inline void
+mrkdata_pack_uint(unsigned char *p, uint64_t v, ssize_t sz)
+{
+    ssize_t i;
+
+    for (i = sz - 1; i >= 0; --i) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+/*
+ * Tags that have a wire encoding.
+ */
+#define MRKDATA_TAG_SUPPORTED(t) \
+    ((t) < MRKDATA_BUILTIN_TAG_END || \
+     (t) == MRKDATA_STRUCT || \
+     (t) == MRKDATA_SEQ)
+
+/*
+ * Copy of a packed record, shared by the datums unpacked from it, see
+ * mrkdata_unpack_buf_cached().
+ */
+typedef struct _mrkdata_packed {
+    unsigned nref;
+    unsigned char buf[];
+} mrkdata_packed_t;
+
+/* STR64 whose body is not in memory, see stream.c */
+#define MRKDATA_STREAMED(dat) \
+    ((dat)->spec->tag == MRKDATA_STR64 && \
+     (dat)->data.str == NULL && \
+     (dat)->value.sz64 > 0)
+
+/* integers and lengths are little-endian, see le.c */
+#define MRKDATA_WIRE_LE 0x01
+
+/*
+ * Pack and unpack an element nested in a record, with no record stats.
+ */
+ssize_t mrkdata_pack_elem(const mrkdata_datum_t *, unsigned char *, ssize_t);
+ssize_t mrkdata_unpack_elem(const mrkdata_spec_t *,
+                            const unsigned char *,
+                            ssize_t,
+                            mrkdata_datum_t **);
+
+/*
+ * le.c
+ */
+mrkdata_tag_t mrkdata_le_array_item(const mrkdata_spec_t *);
+ssize_t mrkdata_le_pack_array(const mrkdata_datum_t *,
+                              unsigned char *,
+                              ssize_t);
+ssize_t mrkdata_le_unpack_array(const mrkdata_spec_t *,
+                                const unsigned char *,
+                                ssize_t,
+                                mrkdata_datum_t **);
+
+/*
+ * strdict.c
+ */
+ssize_t mrkdata_strdict_pack_ref(mrkdata_strdict_t *,
+                                 const mrkdata_datum_t *,
+                                 unsigned char *);
+mrkdata_datum_t *mrkdata_strdict_get(mrkdata_strdict_t *,
+                                     const unsigned char *);
+void mrkdata_strdict_add(mrkdata_strdict_t *, mrkdata_datum_t *);
+
+/*
+ * stats.c
+ */
+#define MRKDATA_STATS_PACK 0
+#define MRKDATA_STATS_UNPACK 1
+
+typedef struct _mrkdata_stats_local {
+    mrkdata_stats_t s;
+    unsigned countdown[MRKDATA_STATS_NHIST];
+    /* generation of the slot when the sample began */
+    unsigned gen[MRKDATA_STATS_NHIST];
+    int registered;
+    struct _mrkdata_stats_local *prev;
+    struct _mrkdata_stats_local *next;
+} mrkdata_stats_local_t;
+
+extern __thread mrkdata_stats_local_t mrkdata_stats_local;
+extern unsigned mrkdata_stats_nhist;
+
+mrkdata_stats_t *mrkdata_stats_local_init(void);
+int mrkdata_stats_sample_begin(const mrkdata_spec_t *, struct timespec *);
+void mrkdata_stats_sample_end(int, int, const struct timespec *);
+
+#define MRKDATA_STATS()                        \
+    (mrkdata_stats_local.registered ?          \
+     &mrkdata_stats_local.s :                  \
+     mrkdata_stats_local_init())
+
+#define MRKDATA_STATS_VALUE(tag) (++MRKDATA_STATS()->values[(tag)])
+
+#define MRKDATA_STATS_ALLOC(sz)                \
+    do {                                       \
+        mrkdata_stats_t *_st = MRKDATA_STATS();\
+        ++_st->nalloc;                         \
+        _st->balloc += (sz);                   \
+    } while (0)
+
+#define MRKDATA_STATS_ERROR_IDX(code)                                  \
+    ((((unsigned)(code) - 0x80000000u) >> 16) < MRKDATA_STATS_NERRORS ?\
+     (((unsigned)(code) - 0x80000000u) >> 16) :                        \
+     MRKDATA_STATS_NERRORS - 1)
+
+#define MRKDATA_STATS_ERROR(code) \
+    (++MRKDATA_STATS()->errors[MRKDATA_STATS_ERROR_IDX(code)])
+
 #ifdef __cplusplus
 }
 #endif
 
-#include <mrkdata.h>
 #endif
@@ -0,0 +1,700 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Message transport over stream sockets, TCP or Unix.
+ *
+ * A message is a packed UINT64 correlation id followed by a packed
+ * record, both self-delimiting, so that nothing else frames them.
+ * Requests are pipelined: a client may send any number of them before
+ * reading replies, and replies carry the ids of their requests.
+ *
+ * Sockets are non-blocking.  Reads drain the socket into a per-connection
+ * buffer that is decoded incrementally, and outgoing messages are queued
+ * and written out together with sendmsg().  The read buffer holds at most
+ * two messages of the maximum size: past that, reading stops until what
+ * is buffered has been dispatched.
+ */
+
+#define MSG_ID_SZ (sizeof(char) + sizeof(uint64_t))
+#define MSG_RBUFSZ 65536
+#define MSG_RBUFMAX (2 * (MSG_ID_SZ + MRKDATA_MSG_MAXSZ))
+#define MSG_NIOV 64
+
+#ifndef MSG_NOSIGNAL
+/* SO_NOSIGPIPE is set on the socket instead */
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct _msg_out {
+    unsigned char *buf;
+    ssize_t sz;
+} msg_out_t;
+
+struct _mrkdata_conn {
+    int fd;
+    unsigned char *rbuf;
+    ssize_t rbufsz;
+    /* unread data is [rpos, rlen) */
+    ssize_t rpos;
+    ssize_t rlen;
+    /* outgoing messages, [whead, wqlen) are not written yet */
+    msg_out_t *wq;
+    unsigned wqlen;
+    unsigned wqsz;
+    unsigned whead;
+    /* how much of wq[whead] is written */
+    ssize_t wpos;
+    /* the peer has shut down its side */
+    int eof;
+};
+
+struct _mrkdata_server {
+    int fd;
+    mrkdata_msg_cb_t cb;
+    void *udata;
+    mnarray_t conns;
+    struct pollfd *pfds;
+    unsigned npfds;
+};
+
+struct _mrkdata_client {
+    mrkdata_conn_t conn;
+    uint64_t id;
+};
+
+
+static int
+set_nonblock(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static int
+conn_init(mrkdata_conn_t *conn, int fd)
+{
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one)) != 0) {
+        return -1;
+    }
+#endif
+    if (set_nonblock(fd) != 0) {
+        return -1;
+    }
+    conn->fd = fd;
+    conn->rbufsz = MSG_RBUFSZ;
+    if ((conn->rbuf = malloc(conn->rbufsz)) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(conn->rbufsz);
+    conn->rpos = 0;
+    conn->rlen = 0;
+    conn->wq = NULL;
+    conn->wqlen = 0;
+    conn->wqsz = 0;
+    conn->whead = 0;
+    conn->wpos = 0;
+    conn->eof = 0;
+    return 0;
+}
+
+
+static void
+conn_fini(mrkdata_conn_t *conn)
+{
+    unsigned i;
+
+    for (i = conn->whead; i < conn->wqlen; ++i) {
+        free(conn->wq[i].buf);
+    }
+    if (conn->wq != NULL) {
+        free(conn->wq);
+        conn->wq = NULL;
+    }
+    free(conn->rbuf);
+    conn->rbuf = NULL;
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+
+/*
+ * Read all that is available, or until the buffer is full.  Return 0 if
+ * the socket would block or the buffer is full, 1 on EOF, and -1 on
+ * error.
+ */
+static int
+conn_read(mrkdata_conn_t *conn)
+{
+    ssize_t nread;
+
+    while (1) {
+        if (conn->rlen == conn->rbufsz) {
+            if (conn->rpos > 0) {
+                memmove(conn->rbuf,
+                        conn->rbuf + conn->rpos,
+                        conn->rlen - conn->rpos);
+                conn->rlen -= conn->rpos;
+                conn->rpos = 0;
+            } else if (conn->rbufsz >= (ssize_t)MSG_RBUFMAX) {
+                /* holds a complete message, resume after dispatch */
+                return 0;
+            } else {
+                conn->rbufsz *= 2;
+                if (conn->rbufsz > (ssize_t)MSG_RBUFMAX) {
+                    conn->rbufsz = MSG_RBUFMAX;
+                }
+                if ((conn->rbuf = realloc(conn->rbuf,
+                                          conn->rbufsz)) == NULL) {
+                    FAIL("realloc");
+                }
+            }
+        }
+
+        if ((nread = read(conn->fd,
+                          conn->rbuf + conn->rlen,
+                          conn->rbufsz - conn->rlen)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        if (nread == 0) {
+            conn->eof = 1;
+            return 1;
+        }
+        conn->rlen += nread;
+    }
+}
+
+
+/*
+ * Take the next complete message off the read buffer.  Return 1 if
+ * there is one, 0 if more data is needed, and -1 if the data is not a
+ * message.  The record stays valid until the next conn_read().
+ */
+static int
+conn_next(mrkdata_conn_t *conn,
+          uint64_t *pid,
+          const unsigned char **prec,
+          ssize_t *psz)
+{
+    const unsigned char *buf = conn->rbuf + conn->rpos;
+    ssize_t len = conn->rlen - conn->rpos;
+    ssize_t recsz;
+    uint64_t id;
+
+    if (len < (ssize_t)MSG_ID_SZ) {
+        return 0;
+    }
+    if (buf[0] != MRKDATA_UINT64) {
+        return -1;
+    }
+    if ((recsz = mrkdata_buf_size(buf + MSG_ID_SZ,
+                                  len - MSG_ID_SZ)) <= 0) {
+        return recsz < 0 ? -1 : 0;
+    }
+    if (recsz > MRKDATA_MSG_MAXSZ) {
+        return -1;
+    }
+    if (recsz > len - (ssize_t)MSG_ID_SZ) {
+        return 0;
+    }
+
+    memcpy(&id, buf + 1, sizeof(id));
+    *pid = be64toh(id);
+    *prec = buf + MSG_ID_SZ;
+    *psz = recsz;
+    conn->rpos += MSG_ID_SZ + recsz;
+    if (conn->rpos == conn->rlen) {
+        conn->rpos = 0;
+        conn->rlen = 0;
+    }
+    return 1;
+}
+
+
+static unsigned char *
+msg_header(unsigned char *buf, uint64_t id)
+{
+    buf[0] = MRKDATA_UINT64;
+    id = htobe64(id);
+    memcpy(buf + 1, &id, sizeof(id));
+    return buf + MSG_ID_SZ;
+}
+
+
+static void
+conn_enqueue(mrkdata_conn_t *conn, unsigned char *buf, ssize_t sz)
+{
+    if (conn->wqlen == conn->wqsz) {
+        conn->wqsz = conn->wqsz > 0 ? conn->wqsz * 2 : MSG_NIOV;
+        if ((conn->wq = realloc(conn->wq,
+                                conn->wqsz * sizeof(msg_out_t))) == NULL) {
+            FAIL("realloc");
+        }
+    }
+    conn->wq[conn->wqlen].buf = buf;
+    conn->wq[conn->wqlen].sz = sz;
+    ++conn->wqlen;
+}
+
+
+static int
+conn_send(mrkdata_conn_t *conn, uint64_t id, const mrkdata_datum_t *dat)
+{
+    unsigned char *buf;
+
+    if ((buf = malloc(MSG_ID_SZ + dat->packsz)) == NULL) {
+        FAIL("malloc");
+    }
+    if (mrkdata_pack_datum(dat,
+                           msg_header(buf, id),
+                           dat->packsz) != dat->packsz) {
+        free(buf);
+        return -1;
+    }
+    conn_enqueue(conn, buf, MSG_ID_SZ + dat->packsz);
+    return 0;
+}
+
+
+static int
+conn_send_buf(mrkdata_conn_t *conn,
+              uint64_t id,
+              const unsigned char *rec,
+              ssize_t sz)
+{
+    unsigned char *buf;
+
+    if (mrkdata_buf_size(rec, sz) != sz) {
+        return -1;
+    }
+    if ((buf = malloc(MSG_ID_SZ + sz)) == NULL) {
+        FAIL("malloc");
+    }
+    memcpy(msg_header(buf, id), rec, sz);
+    conn_enqueue(conn, buf, MSG_ID_SZ + sz);
+    return 0;
+}
+
+
+static int
+conn_pending(mrkdata_conn_t *conn)
+{
+    return conn->whead < conn->wqlen;
+}
+
+
+/*
+ * Write out the queue, up to MSG_NIOV messages per sendmsg().  Return 0
+ * when the queue is empty or the socket would block, and -1 on error.
+ * A peer that has gone away is an error, not SIGPIPE.
+ */
+static int
+conn_flush(mrkdata_conn_t *conn)
+{
+    struct iovec iov[MSG_NIOV];
+    struct msghdr msg;
+
+    memset(&msg, '\0', sizeof(msg));
+    msg.msg_iov = iov;
+
+    while (conn_pending(conn)) {
+        unsigned i, n;
+        ssize_t nwritten;
+
+        for (i = conn->whead, n = 0;
+             i < conn->wqlen && n < MSG_NIOV;
+             ++i, ++n) {
+            iov[n].iov_base = conn->wq[i].buf;
+            iov[n].iov_len = conn->wq[i].sz;
+        }
+        iov[0].iov_base = (unsigned char *)iov[0].iov_base + conn->wpos;
+        iov[0].iov_len -= conn->wpos;
+
+        msg.msg_iovlen = n;
+        if ((nwritten = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+
+        /* release what has been written */
+        nwritten += conn->wpos;
+        while (conn_pending(conn) && nwritten >= conn->wq[conn->whead].sz) {
+            nwritten -= conn->wq[conn->whead].sz;
+            free(conn->wq[conn->whead].buf);
+            ++conn->whead;
+        }
+        conn->wpos = nwritten;
+    }
+
+    /* all written, reuse the queue */
+    conn->wqlen = 0;
+    conn->whead = 0;
+    conn->wpos = 0;
+    return 0;
+}
+
+
+static int
+conn_wait(mrkdata_conn_t *conn, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = conn->fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/* server */
+
+static int
+conn_ptr_fini(mrkdata_conn_t **conn)
+{
+    if (*conn != NULL) {
+        conn_fini(*conn);
+        free(*conn);
+        *conn = NULL;
+    }
+    return 0;
+}
+
+
+/*
+ * Serve messages from the clients of the listening socket fd.  cb is
+ * called for every request, and may reply with mrkdata_conn_reply()
+ * right away or not at all.  A non-zero return from cb closes the
+ * connection.
+ */
+mrkdata_server_t *
+mrkdata_server_new(int fd, mrkdata_msg_cb_t cb, void *udata)
+{
+    mrkdata_server_t *srv;
+
+    if (set_nonblock(fd) != 0) {
+        return NULL;
+    }
+    if ((srv = malloc(sizeof(mrkdata_server_t))) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_server_t));
+    srv->fd = fd;
+    srv->cb = cb;
+    srv->udata = udata;
+    if (array_init(&srv->conns, sizeof(mrkdata_conn_t *), 0,
+                   NULL,
+                   (array_finalizer_t)conn_ptr_fini) != 0) {
+        FAIL("array_init");
+    }
+    srv->pfds = NULL;
+    srv->npfds = 0;
+    return srv;
+}
+
+
+static void
+server_accept(mrkdata_server_t *srv)
+{
+    int fd;
+
+    while ((fd = accept(srv->fd, NULL, NULL)) != -1) {
+        mrkdata_conn_t **conn, **slot = NULL;
+        mnarray_iter_t it;
+
+        /* reuse a closed slot */
+        for (conn = array_first(&srv->conns, &it);
+             conn != NULL;
+             conn = array_next(&srv->conns, &it)) {
+            if (*conn == NULL) {
+                slot = conn;
+                break;
+            }
+        }
+        if (slot == NULL && (slot = array_incr(&srv->conns)) == NULL) {
+            FAIL("array_incr");
+        }
+        if ((*slot = malloc(sizeof(mrkdata_conn_t))) == NULL) {
+            FAIL("malloc");
+        }
+        if (conn_init(*slot, fd) != 0) {
+            close(fd);
+            free(*slot);
+            *slot = NULL;
+        }
+    }
+}
+
+
+/*
+ * Read and dispatch all complete requests of the connection, then write
+ * the replies out.  Return -1 when the connection is to be closed.
+ */
+static int
+server_serve(mrkdata_server_t *srv, mrkdata_conn_t *conn)
+{
+    uint64_t id = 0;
+    const unsigned char *rec = NULL;
+    ssize_t sz = 0;
+    int res;
+
+    if (!conn->eof && conn_read(conn) < 0) {
+        return -1;
+    }
+
+    while ((res = conn_next(conn, &id, &rec, &sz)) == 1) {
+        if (srv->cb(conn, id, rec, sz, srv->udata) != 0) {
+            return -1;
+        }
+    }
+    if (res < 0) {
+        return -1;
+    }
+
+    if (conn_flush(conn) != 0) {
+        return -1;
+    }
+
+    /* a half-closed connection is done once its replies are out */
+    return conn->eof && !conn_pending(conn) ? -1 : 0;
+}
+
+
+/*
+ * Wait up to timeout milliseconds for events, and handle them.  Return
+ * the number of connections handled, or -1 on error.
+ */
+int
+mrkdata_server_poll(mrkdata_server_t *srv, int timeout)
+{
+    unsigned i, n;
+    int nready, res = 0;
+
+    if (srv->npfds < srv->conns.elnum + 1) {
+        srv->npfds = srv->conns.elnum + 1;
+        srv->pfds = realloc(srv->pfds, srv->npfds * sizeof(struct pollfd));
+        if (srv->pfds == NULL) {
+            FAIL("realloc");
+        }
+    }
+
+    srv->pfds[0].fd = srv->fd;
+    srv->pfds[0].events = POLLIN;
+    srv->pfds[0].revents = 0;
+    for (i = 0, n = 1; i < srv->conns.elnum; ++i, ++n) {
+        mrkdata_conn_t **conn = array_get(&srv->conns, i);
+
+        /* closed connections are skipped by poll() */
+        srv->pfds[n].fd = *conn != NULL ? (*conn)->fd : -1;
+        srv->pfds[n].events = *conn != NULL && (*conn)->eof ? 0 : POLLIN;
+        if (*conn != NULL && conn_pending(*conn)) {
+            srv->pfds[n].events |= POLLOUT;
+        }
+        srv->pfds[n].revents = 0;
+    }
+
+    if ((nready = poll(srv->pfds, n, timeout)) <= 0) {
+        return nready < 0 && errno != EINTR ? -1 : 0;
+    }
+
+    for (i = 1; i < n; ++i) {
+        mrkdata_conn_t **conn;
+
+        if (srv->pfds[i].revents == 0) {
+            continue;
+        }
+        conn = array_get(&srv->conns, i - 1);
+        if (server_serve(srv, *conn) != 0) {
+            conn_ptr_fini(conn);
+        }
+        ++res;
+    }
+
+    if (srv->pfds[0].revents & POLLIN) {
+        server_accept(srv);
+    }
+
+    return res;
+}
+
+
+int
+mrkdata_server_destroy(mrkdata_server_t **srv)
+{
+    if (*srv != NULL) {
+        array_fini(&(*srv)->conns);
+        if ((*srv)->pfds != NULL) {
+            free((*srv)->pfds);
+        }
+        free(*srv);
+        *srv = NULL;
+    }
+    return 0;
+}
+
+
+/*
+ * Queue the reply to the request id.  Replies are written out after
+ * the callback returns.
+ */
+int
+mrkdata_conn_reply(mrkdata_conn_t *conn,
+                   uint64_t id,
+                   const mrkdata_datum_t *dat)
+{
+    if (conn_send(conn, id, dat) != 0) {
+        TRRET(MRKDATA_CONN_REPLY + 1);
+    }
+    return 0;
+}
+
+
+int
+mrkdata_conn_reply_buf(mrkdata_conn_t *conn,
+                       uint64_t id,
+                       const unsigned char *rec,
+                       ssize_t sz)
+{
+    if (conn_send_buf(conn, id, rec, sz) != 0) {
+        TRRET(MRKDATA_CONN_REPLY_BUF + 1);
+    }
+    return 0;
+}
+
+
+/* client */
+
+/*
+ * Talk to a server over the connected socket fd.
+ */
+mrkdata_client_t *
+mrkdata_client_new(int fd)
+{
+    mrkdata_client_t *cli;
+
+    if ((cli = malloc(sizeof(mrkdata_client_t))) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_client_t));
+    if (conn_init(&cli->conn, fd) != 0) {
+        free(cli);
+        return NULL;
+    }
+    cli->id = 0;
+    return cli;
+}
+
+
+/*
+ * Queue a request, and return its id in *pid.  Requests are only sent
+ * on mrkdata_client_flush() or mrkdata_client_recv().
+ */
+int
+mrkdata_client_send(mrkdata_client_t *cli,
+                    const mrkdata_datum_t *dat,
+                    uint64_t *pid)
+{
+    if (conn_send(&cli->conn, cli->id, dat) != 0) {
+        TRRET(MRKDATA_CLIENT_SEND + 1);
+    }
+    *pid = cli->id++;
+    return 0;
+}
+
+
+int
+mrkdata_client_flush(mrkdata_client_t *cli)
+{
+    while (conn_pending(&cli->conn)) {
+        if (conn_flush(&cli->conn) != 0 ||
+            (conn_pending(&cli->conn) &&
+             conn_wait(&cli->conn, POLLOUT) != 0)) {
+            TRRET(MRKDATA_CLIENT_FLUSH + 1);
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Send what is queued, and wait for the next reply.  Replies come in
+ * the order the server sends them, which need not be the order of the
+ * requests.  The record is valid until the next call.
+ */
+int
+mrkdata_client_recv(mrkdata_client_t *cli,
+                    uint64_t *pid,
+                    const unsigned char **prec,
+                    ssize_t *psz)
+{
+    int res;
+
+    if (mrkdata_client_flush(cli) != 0) {
+        TRRET(MRKDATA_CLIENT_RECV + 1);
+    }
+
+    while ((res = conn_next(&cli->conn, pid, prec, psz)) == 0) {
+        if (conn_wait(&cli->conn, POLLIN) != 0 ||
+            conn_read(&cli->conn) != 0) {
+            /* the last replies may have come with EOF */
+            if ((res = conn_next(&cli->conn, pid, prec, psz)) == 1) {
+                return 0;
+            }
+            TRRET(MRKDATA_CLIENT_RECV + 2);
+        }
+    }
+    if (res < 0) {
+        TRRET(MRKDATA_CLIENT_RECV + 3);
+    }
+    return 0;
+}
+
+
+int
+mrkdata_client_destroy(mrkdata_client_t **cli)
+{
+    if (*cli != NULL) {
+        conn_fini(&(*cli)->conn);
+        free(*cli);
+        *cli = NULL;
+    }
+    return 0;
+}
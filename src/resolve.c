@@ -0,0 +1,704 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Schema resolution.
+ *
+ * A record packed with the writer spec is read into a datum of the
+ * reader spec.  STRUCT fields are matched by name when all the fields
+ * on both sides have one, and by position otherwise.  Writer fields the
+ * reader does not have are skipped by their length, and reader fields
+ * the writer does not have are filled in with defaults.  A field may be
+ * widened: an integer to a wider integer of the same or a wider
+ * signedness, an integer of up to 32 bits to a DOUBLE, a string to a
+ * string with a wider length.
+ *
+ * The mapping is worked out once per (writer, reader, defaults) and
+ * kept until mrkdata_resolve_flush().  The subtrees whose specs are the
+ * same on both sides are unpacked as they are, so that only the fields
+ * that actually changed cost anything.
+ */
+
+#define RESOLVE_SAME 0
+#define RESOLVE_WIDEN 1
+#define RESOLVE_STRUCT 2
+#define RESOLVE_SEQ 3
+
+/* STRUCTs of up to this many fields are put together on the stack */
+#define RESOLVE_NSLOTS 32
+
+typedef struct _resolve_node {
+    const mrkdata_spec_t *wspec;
+    const mrkdata_spec_t *rspec;
+    unsigned op;
+    unsigned nw;
+    unsigned nr;
+    /* STRUCT: reader index of the writer fields, or -1 to skip */
+    int *map;
+    /* STRUCT: defaults of the reader fields the writer does not have */
+    mrkdata_datum_t **dflt;
+    /* STRUCT: the writer fields, SEQ: the item */
+    struct _resolve_node *items;
+} resolve_node_t;
+
+struct _mrkdata_resolve {
+    struct _mrkdata_resolve *next;
+    const mrkdata_spec_t *writer;
+    const mrkdata_spec_t *reader;
+    const mrkdata_datum_t *defaults;
+    resolve_node_t root;
+};
+
+static pthread_mutex_t resolve_mtx = PTHREAD_MUTEX_INITIALIZER;
+static mrkdata_resolve_t *resolve_cache = NULL;
+
+
+static mrkdata_spec_t *
+spec_field(const mrkdata_spec_t *spec, unsigned idx)
+{
+    return *(mrkdata_spec_t **)array_get(&spec->fields, idx);
+}
+
+
+static int
+spec_named(const mrkdata_spec_t *spec)
+{
+    unsigned i;
+
+    for (i = 0; i < spec->fields.elnum; ++i) {
+        if (spec_field(spec, i)->name == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static int
+spec_same(const mrkdata_spec_t *a, const mrkdata_spec_t *b)
+{
+    unsigned i;
+
+    if (a == b) {
+        return 1;
+    }
+    if (a->tag != b->tag) {
+        return 0;
+    }
+    if (!MRKDATA_TAG_CUSTOM(a->tag)) {
+        return 1;
+    }
+    if (a->fields.elnum != b->fields.elnum) {
+        return 0;
+    }
+    for (i = 0; i < a->fields.elnum; ++i) {
+        mrkdata_spec_t *fa, *fb;
+
+        fa = spec_field(a, i);
+        fb = spec_field(b, i);
+        if ((fa->name == NULL) != (fb->name == NULL) ||
+            (fa->name != NULL && strcmp(fa->name, fb->name) != 0) ||
+            !spec_same(fa, fb)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Bits of an integer tag, negative if signed, or 0.
+ */
+static int
+int_bits(mrkdata_tag_t tag)
+{
+    switch (tag) {
+    case MRKDATA_UINT8:
+        return 8;
+    case MRKDATA_INT8:
+        return -8;
+    case MRKDATA_UINT16:
+        return 16;
+    case MRKDATA_INT16:
+        return -16;
+    case MRKDATA_UINT32:
+        return 32;
+    case MRKDATA_INT32:
+        return -32;
+    case MRKDATA_UINT64:
+        return 64;
+    case MRKDATA_INT64:
+        return -64;
+    default:
+        return 0;
+    }
+}
+
+
+static int
+widen_ok(mrkdata_tag_t w, mrkdata_tag_t r)
+{
+    int wb, rb;
+
+    if (w >= MRKDATA_STR8 && w <= MRKDATA_STR64) {
+        return r > w && r <= MRKDATA_STR64;
+    }
+    if ((wb = int_bits(w)) == 0) {
+        return 0;
+    }
+    if (r == MRKDATA_DOUBLE) {
+        return abs(wb) <= 32;
+    }
+    if ((rb = int_bits(r)) == 0) {
+        return 0;
+    }
+    /* signed to unsigned never fits */
+    if (wb < 0 && rb > 0) {
+        return 0;
+    }
+    return abs(rb) > abs(wb);
+}
+
+
+/*
+ * A datum of spec with zeros, empty strings and empty SEQs.
+ */
+static mrkdata_datum_t *
+resolve_zero(const mrkdata_spec_t *spec)
+{
+    mrkdata_datum_t *res = NULL;
+    unsigned char buf[sizeof(uint64_t) + 1];
+    unsigned i;
+
+    switch (spec->tag) {
+    case MRKDATA_STRUCT:
+        res = mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+        for (i = 0; i < spec->fields.elnum; ++i) {
+            mrkdata_datum_t *field;
+
+            if ((field = resolve_zero(spec_field(spec, i))) == NULL) {
+                mrkdata_datum_destroy(&res);
+                return NULL;
+            }
+            mrkdata_datum_add_field(res, field);
+        }
+        return res;
+
+    case MRKDATA_SEQ:
+        return mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+
+    default:
+        if (spec->tag > MRKDATA_STR64) {
+            return NULL;
+        }
+        memset(buf, 0, sizeof(buf));
+        buf[0] = spec->tag;
+        if (mrkdata_unpack_elem(spec,
+                                buf,
+                                MRKDATA_EXPECT_SZ(spec->tag),
+                                &res) == 0) {
+            mrkdata_datum_destroy(&res);
+        }
+        return res;
+    }
+}
+
+
+static void
+resolve_node_fini(resolve_node_t *node)
+{
+    unsigned i;
+
+    if (node->items != NULL) {
+        for (i = 0; i < node->nw; ++i) {
+            resolve_node_fini(&node->items[i]);
+        }
+        free(node->items);
+        node->items = NULL;
+    }
+    if (node->dflt != NULL) {
+        for (i = 0; i < node->nr; ++i) {
+            mrkdata_datum_destroy(&node->dflt[i]);
+        }
+        free(node->dflt);
+        node->dflt = NULL;
+    }
+    if (node->map != NULL) {
+        free(node->map);
+        node->map = NULL;
+    }
+}
+
+
+/*
+ * Whether any of the first nw writer fields goes to reader field j.
+ */
+static int
+resolve_mapped(const resolve_node_t *node, unsigned nw, unsigned j)
+{
+    unsigned i;
+
+    for (i = 0; i < nw; ++i) {
+        if (node->map[i] == (int)j) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Work out how to read w as r.  dflt is a datum of r, or NULL, that
+ * supplies the defaults below: the fields of a STRUCT, the first item
+ * of a SEQ for its items.
+ */
+static int
+resolve_node_init(resolve_node_t *node,
+                  const mrkdata_spec_t *w,
+                  const mrkdata_spec_t *r,
+                  mrkdata_datum_t *dflt)
+{
+    unsigned i, j;
+    int named;
+
+    memset(node, 0, sizeof(*node));
+    node->wspec = w;
+    node->rspec = r;
+
+    if (dflt != NULL && dflt->spec->tag != r->tag) {
+        MRKDATA_STATS_ERROR(MRKDATA_RESOLVE + 1);
+        return -1;
+    }
+
+    if (spec_same(w, r)) {
+        node->op = RESOLVE_SAME;
+        return 0;
+    }
+
+    if (w->tag != r->tag) {
+        if (!widen_ok(w->tag, r->tag)) {
+            MRKDATA_STATS_ERROR(MRKDATA_RESOLVE + 2);
+            return -1;
+        }
+        node->op = RESOLVE_WIDEN;
+        return 0;
+    }
+
+    if (r->tag == MRKDATA_SEQ) {
+        mrkdata_datum_t *item = NULL;
+
+        if (w->fields.elnum != 1 || r->fields.elnum != 1) {
+            MRKDATA_STATS_ERROR(MRKDATA_RESOLVE + 3);
+            return -1;
+        }
+        if (dflt != NULL && dflt->data.fields.elnum > 0) {
+            item = mrkdata_datum_get_field(dflt, 0);
+        }
+        node->op = RESOLVE_SEQ;
+        node->nw = 1;
+        if ((node->items = calloc(1, sizeof(resolve_node_t))) == NULL) {
+            FAIL("calloc");
+        }
+        return resolve_node_init(node->items,
+                                 spec_field(w, 0),
+                                 spec_field(r, 0),
+                                 item);
+    }
+
+    if (r->tag != MRKDATA_STRUCT) {
+        /* the same scalar or string tag is spec_same() */
+        MRKDATA_STATS_ERROR(MRKDATA_RESOLVE + 3);
+        return -1;
+    }
+
+    if (dflt != NULL && dflt->data.fields.elnum != r->fields.elnum) {
+        MRKDATA_STATS_ERROR(MRKDATA_RESOLVE + 1);
+        return -1;
+    }
+
+    node->op = RESOLVE_STRUCT;
+    node->nw = w->fields.elnum;
+    node->nr = r->fields.elnum;
+    if ((node->map = malloc(sizeof(int) * (node->nw + 1))) == NULL) {
+        FAIL("malloc");
+    }
+    if ((node->dflt = calloc(node->nr + 1,
+                             sizeof(mrkdata_datum_t *))) == NULL) {
+        FAIL("calloc");
+    }
+    if ((node->items = calloc(node->nw + 1,
+                              sizeof(resolve_node_t))) == NULL) {
+        FAIL("calloc");
+    }
+
+    named = spec_named(w) && spec_named(r);
+    for (i = 0; i < node->nw; ++i) {
+        const mrkdata_spec_t *wf = spec_field(w, i);
+
+        node->map[i] = -1;
+        if (!named) {
+            if (i < node->nr) {
+                node->map[i] = i;
+            }
+            continue;
+        }
+        for (j = 0; j < node->nr; ++j) {
+            if (strcmp(wf->name, spec_field(r, j)->name) == 0) {
+                break;
+            }
+        }
+        /* of two writer fields of the same name, the first one wins */
+        if (j < node->nr && !resolve_mapped(node, i, j)) {
+            node->map[i] = j;
+        }
+    }
+
+    /* everything the writer has, the reader gets as mapped */
+    for (i = 0; i < node->nw; ++i) {
+        mrkdata_datum_t *fdflt = NULL;
+
+        if (node->map[i] < 0) {
+            continue;
+        }
+        if (dflt != NULL) {
+            fdflt = mrkdata_datum_get_field(dflt, node->map[i]);
+        }
+        if (resolve_node_init(&node->items[i],
+                              spec_field(w, i),
+                              spec_field(r, node->map[i]),
+                              fdflt) != 0) {
+            return -1;
+        }
+    }
+
+    /* and the rest from the defaults */
+    for (j = 0; j < node->nr; ++j) {
+        if (resolve_mapped(node, node->nw, j)) {
+            continue;
+        }
+        if (dflt != NULL &&
+            mrkdata_datum_get_field(dflt, j) != NULL) {
+            node->dflt[j] =
+                mrkdata_datum_clone(mrkdata_datum_get_field(dflt, j));
+        } else if ((node->dflt[j] =
+                        resolve_zero(spec_field(r, j))) == NULL) {
+            MRKDATA_STATS_ERROR(MRKDATA_RESOLVE + 4);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Read the writer element at buf as node->wspec, and turn it into a
+ * wider node->rspec in place.
+ */
+static ssize_t
+resolve_widen(const resolve_node_t *node,
+              const unsigned char *buf,
+              ssize_t sz,
+              mrkdata_datum_t **pdat)
+{
+    mrkdata_datum_t *dat;
+    ssize_t res;
+    int64_t i;
+    uint64_t u;
+
+    if ((res = mrkdata_unpack_elem(node->wspec, buf, sz, pdat)) == 0) {
+        return 0;
+    }
+    dat = *pdat;
+
+    switch (node->wspec->tag) {
+    case MRKDATA_STR8:
+        i = dat->value.sz8;
+        break;
+    case MRKDATA_STR16:
+        i = dat->value.sz16;
+        break;
+    case MRKDATA_STR32:
+        i = dat->value.sz32;
+        break;
+    case MRKDATA_UINT8:
+        i = dat->value.u8;
+        break;
+    case MRKDATA_INT8:
+        i = dat->value.i8;
+        break;
+    case MRKDATA_UINT16:
+        i = dat->value.u16;
+        break;
+    case MRKDATA_INT16:
+        i = dat->value.i16;
+        break;
+    case MRKDATA_UINT32:
+        i = dat->value.u32;
+        break;
+    case MRKDATA_INT32:
+        i = dat->value.i32;
+        break;
+    default:
+        /* only a 64-bit unsigned is left, and only to go nowhere */
+        assert(0);
+        return 0;
+    }
+    u = (uint64_t)i;
+
+    dat->spec = node->rspec;
+    dat->packsz = MRKDATA_EXPECT_SZ(node->rspec->tag);
+
+    switch (node->rspec->tag) {
+    case MRKDATA_STR16:
+        dat->value.sz16 = (int16_t)i;
+        dat->packsz += i;
+        break;
+    case MRKDATA_STR32:
+        dat->value.sz32 = (int32_t)i;
+        dat->packsz += i;
+        break;
+    case MRKDATA_STR64:
+        dat->value.sz64 = i;
+        dat->packsz += i;
+        break;
+    case MRKDATA_UINT16:
+    case MRKDATA_INT16:
+        dat->value.u16 = (uint16_t)u;
+        break;
+    case MRKDATA_UINT32:
+    case MRKDATA_INT32:
+        dat->value.u32 = (uint32_t)u;
+        break;
+    case MRKDATA_UINT64:
+    case MRKDATA_INT64:
+        dat->value.u64 = u;
+        break;
+    default:
+        dat->value.d = (double)i;
+    }
+
+    return res;
+}
+
+
+static ssize_t
+resolve_unpack(const resolve_node_t *node,
+               const unsigned char *buf,
+               ssize_t sz,
+               mrkdata_datum_t **pdat)
+{
+    mrkdata_datum_t *stack[RESOLVE_NSLOTS], **slots;
+    mrkdata_datum_t *dat;
+    const unsigned char *p, *end;
+    uint64_t len;
+    unsigned i;
+    ssize_t nread;
+
+    assert(*pdat == NULL);
+
+    switch (node->op) {
+    case RESOLVE_SAME:
+        if ((nread = mrkdata_unpack_elem(node->rspec, buf, sz, pdat)) == 0) {
+            mrkdata_datum_destroy(pdat);
+        }
+        return nread;
+
+    case RESOLVE_WIDEN:
+        if ((nread = resolve_widen(node, buf, sz, pdat)) == 0) {
+            mrkdata_datum_destroy(pdat);
+        }
+        return nread;
+    }
+
+    if (sz < MRKDATA_EXPECT_SZ(node->wspec->tag) ||
+        buf[0] != node->wspec->tag) {
+        MRKDATA_STATS_ERROR(MRKDATA_RESOLVE_UNPACK_BUF + 1);
+        return 0;
+    }
+    len = be64toh(*((const uint64_t *)(buf + 1)));
+    if (len > (uint64_t)(sz - MRKDATA_EXPECT_SZ(node->wspec->tag))) {
+        MRKDATA_STATS_ERROR(MRKDATA_RESOLVE_UNPACK_BUF + 2);
+        return 0;
+    }
+    MRKDATA_STATS_VALUE(node->wspec->tag);
+    p = buf + MRKDATA_EXPECT_SZ(node->wspec->tag);
+    end = p + len;
+    dat = mrkdata_datum_from_spec((mrkdata_spec_t *)node->rspec, NULL, 0);
+
+    if (node->op == RESOLVE_SEQ) {
+        while (p < end) {
+            mrkdata_datum_t *item = NULL;
+
+            if ((nread = resolve_unpack(node->items,
+                                        p,
+                                        end - p,
+                                        &item)) == 0) {
+                mrkdata_datum_destroy(&dat);
+                return 0;
+            }
+            mrkdata_datum_add_field(dat, item);
+            p += nread;
+        }
+        *pdat = dat;
+        return end - buf;
+    }
+
+    if (node->nr <= RESOLVE_NSLOTS) {
+        slots = stack;
+    } else if ((slots = malloc(sizeof(mrkdata_datum_t *) *
+                               node->nr)) == NULL) {
+        FAIL("malloc");
+    }
+    for (i = 0; i < node->nr; ++i) {
+        slots[i] = NULL;
+    }
+
+    for (i = 0; i < node->nw; ++i) {
+        if (node->map[i] < 0) {
+            nread = mrkdata_buf_size(p, end - p);
+            if (nread > end - p) {
+                nread = 0;
+            }
+        } else {
+            nread = resolve_unpack(&node->items[i],
+                                   p,
+                                   end - p,
+                                   &slots[node->map[i]]);
+        }
+        if (nread <= 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_RESOLVE_UNPACK_BUF + 3);
+            goto err;
+        }
+        p += nread;
+    }
+    if (p != end) {
+        MRKDATA_STATS_ERROR(MRKDATA_RESOLVE_UNPACK_BUF + 3);
+        goto err;
+    }
+
+    for (i = 0; i < node->nr; ++i) {
+        mrkdata_datum_add_field(dat,
+                                slots[i] != NULL ?
+                                    slots[i] :
+                                    mrkdata_datum_clone(node->dflt[i]));
+    }
+    if (slots != stack) {
+        free(slots);
+    }
+    *pdat = dat;
+    return end - buf;
+
+err:
+    for (i = 0; i < node->nr; ++i) {
+        mrkdata_datum_destroy(&slots[i]);
+    }
+    if (slots != stack) {
+        free(slots);
+    }
+    mrkdata_datum_destroy(&dat);
+    return 0;
+}
+
+
+/*
+ * Return the mapping from writer to reader, worked out on the first
+ * call for them, or NULL if they are not compatible.  defaults is a
+ * datum of reader, or NULL for zeros: its fields are the defaults of
+ * the fields the writer does not have, at any depth, and the first item
+ * of a SEQ stands for all its items.  The defaults are shared by the
+ * datums read, and must be left alone as long as the mapping is kept.
+ */
+const mrkdata_resolve_t *
+mrkdata_resolve(const mrkdata_spec_t *writer,
+                const mrkdata_spec_t *reader,
+                mrkdata_datum_t *defaults)
+{
+    mrkdata_resolve_t *res;
+
+    pthread_mutex_lock(&resolve_mtx);
+    for (res = resolve_cache; res != NULL; res = res->next) {
+        if (res->writer == writer &&
+            res->reader == reader &&
+            res->defaults == defaults) {
+            pthread_mutex_unlock(&resolve_mtx);
+            return res;
+        }
+    }
+
+    if ((res = malloc(sizeof(mrkdata_resolve_t))) == NULL) {
+        FAIL("malloc");
+    }
+    res->writer = writer;
+    res->reader = reader;
+    res->defaults = defaults;
+    if (resolve_node_init(&res->root, writer, reader, defaults) != 0) {
+        resolve_node_fini(&res->root);
+        free(res);
+        pthread_mutex_unlock(&resolve_mtx);
+        return NULL;
+    }
+    res->next = resolve_cache;
+    resolve_cache = res;
+    pthread_mutex_unlock(&resolve_mtx);
+    return res;
+}
+
+
+/*
+ * Drop all the mappings.  Must be called before the specs or the
+ * defaults of any of them go away.
+ */
+void
+mrkdata_resolve_flush(void)
+{
+    mrkdata_resolve_t *res;
+
+    pthread_mutex_lock(&resolve_mtx);
+    while ((res = resolve_cache) != NULL) {
+        resolve_cache = res->next;
+        resolve_node_fini(&res->root);
+        free(res);
+    }
+    pthread_mutex_unlock(&resolve_mtx);
+}
+
+
+/*
+ * Unpack the record at buf, packed with the writer spec of res, into a
+ * new datum of its reader spec.  Return the size of the record, or 0,
+ * and then *pdat is left NULL.
+ */
+ssize_t
+mrkdata_resolve_unpack_buf(const mrkdata_resolve_t *res,
+                           const unsigned char *buf,
+                           ssize_t sz,
+                           mrkdata_datum_t **pdat)
+{
+    ssize_t nread;
+    mrkdata_stats_t *st;
+
+    assert(pdat != NULL);
+
+    if (sz <= 0 || *pdat != NULL) {
+        MRKDATA_STATS_ERROR(MRKDATA_RESOLVE_UNPACK_BUF + 4);
+        return 0;
+    }
+
+    if ((nread = resolve_unpack(&res->root, buf, sz, pdat)) > 0) {
+        st = MRKDATA_STATS();
+        ++st->nunpacked;
+        st->bunpacked += nread;
+    }
+    return nread;
+}
@@ -0,0 +1,485 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Shared-memory ring of packed records, for one reader and one or more
+ * writers, possibly in different processes mapping the same file (a
+ * memfd, a shm_open() object, or a plain file).
+ *
+ * Positions grow forever, and are taken modulo the data size.  A frame
+ * is an 8-byte header followed by the packed record, padded to 8 bytes.
+ * The header holds the record size and RING_READY, and is stored last
+ * so that the reader never sees a partly written record.  A record that
+ * does not fit before the end of the data is preceded by a RING_PAD
+ * frame that takes the rest of it, so that records are contiguous and
+ * can be decoded in place.  A frame may take up to half of the data, so
+ * that it always fits with its padding.  The reader zeroes the frames it
+ * releases, so that a stale payload is never taken for a header.
+ *
+ * Writers reserve frames by moving head with compare-and-swap, or with a
+ * plain store with MRKDATA_RING_SPSC.  The reader and blocked writers
+ * spin for a while, then sleep on process-shared condition variables;
+ * the other side only takes the mutex when someone is asleep.
+ */
+
+#define RING_MAGIC 0x4d524b52494e4731ull /* MRKRING1 */
+#define RING_HDRSZ 4096
+#define RING_ALIGN 8
+#define RING_FRAME_HDRSZ sizeof(uint64_t)
+#define RING_READY 0x01ull
+#define RING_PAD 0x02ull
+#define RING_SPIN 1000
+
+#define RING_FRAME_SZ(sz) \
+    (RING_FRAME_HDRSZ + (((sz) + RING_ALIGN - 1) & ~(RING_ALIGN - 1)))
+
+#define CACHELINE 64
+
+typedef struct _ring_hdr {
+    uint64_t magic;
+    uint64_t size;
+    unsigned flags;
+    char _pad0[CACHELINE - 2 * sizeof(uint64_t) - sizeof(unsigned)];
+    /* next position to reserve */
+    uint64_t head;
+    char _pad1[CACHELINE - sizeof(uint64_t)];
+    /* next position to read */
+    uint64_t tail;
+    char _pad2[CACHELINE - sizeof(uint64_t)];
+    /* sleepers */
+    unsigned rwaiting;
+    unsigned wwaiting;
+    char _pad3[CACHELINE - 2 * sizeof(unsigned)];
+    pthread_mutex_t mtx;
+    pthread_cond_t rcond;
+    pthread_cond_t wcond;
+} ring_hdr_t;
+
+struct _mrkdata_ring {
+    ring_hdr_t *hdr;
+    unsigned char *data;
+    size_t mapsz;
+    /* frame being read, to release */
+    uint64_t cursz;
+};
+
+
+static mrkdata_ring_t *
+ring_map(int fd, size_t mapsz)
+{
+    mrkdata_ring_t *ring;
+    void *p;
+
+    if ((p = mmap(NULL, mapsz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        return NULL;
+    }
+    if ((ring = malloc(sizeof(mrkdata_ring_t))) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(sizeof(mrkdata_ring_t));
+    ring->hdr = p;
+    ring->data = (unsigned char *)p + RING_HDRSZ;
+    ring->mapsz = mapsz;
+    ring->cursz = 0;
+    return ring;
+}
+
+
+/*
+ * Make a ring of sz data bytes in the file at fd, and map it.  Other
+ * processes map it with mrkdata_ring_attach().
+ */
+mrkdata_ring_t *
+mrkdata_ring_create(int fd, size_t sz, unsigned flags)
+{
+    mrkdata_ring_t *ring;
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+
+    assert(sizeof(ring_hdr_t) <= RING_HDRSZ);
+
+    sz &= ~(size_t)(RING_ALIGN - 1);
+    if (sz < 2 * RING_FRAME_HDRSZ) {
+        return NULL;
+    }
+
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, RING_HDRSZ + sz) != 0) {
+        return NULL;
+    }
+
+    if ((ring = ring_map(fd, RING_HDRSZ + sz)) == NULL) {
+        return NULL;
+    }
+
+    ring->hdr->size = sz;
+    ring->hdr->flags = flags;
+    ring->hdr->head = 0;
+    ring->hdr->tail = 0;
+    ring->hdr->rwaiting = 0;
+    ring->hdr->wwaiting = 0;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&ring->hdr->mtx, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&ring->hdr->rcond, &cattr);
+    pthread_cond_init(&ring->hdr->wcond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    __atomic_store_n(&ring->hdr->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+
+mrkdata_ring_t *
+mrkdata_ring_attach(int fd)
+{
+    mrkdata_ring_t *ring;
+    struct stat sb;
+
+    if (fstat(fd, &sb) != 0 || sb.st_size <= RING_HDRSZ) {
+        return NULL;
+    }
+    if ((ring = ring_map(fd, sb.st_size)) == NULL) {
+        return NULL;
+    }
+    if (__atomic_load_n(&ring->hdr->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+        ring->hdr->size != (uint64_t)(sb.st_size - RING_HDRSZ)) {
+        mrkdata_ring_destroy(&ring);
+        return NULL;
+    }
+    return ring;
+}
+
+
+/*
+ * Unmap the ring.  The file and the ring in it stay.
+ */
+int
+mrkdata_ring_destroy(mrkdata_ring_t **ring)
+{
+    if (*ring != NULL) {
+        munmap((*ring)->hdr, (*ring)->mapsz);
+        free(*ring);
+        *ring = NULL;
+    }
+    return 0;
+}
+
+
+/*
+ * Sleep on cond until ready(), or the absolute deadline.  ready() is
+ * checked under the mutex after *waiting is raised, and the other side
+ * looks at *waiting after its update, so that no wakeup is lost.
+ */
+static int
+ring_sleep(mrkdata_ring_t *ring,
+           pthread_cond_t *cond,
+           unsigned *waiting,
+           int (*ready)(mrkdata_ring_t *, size_t),
+           size_t sz,
+           const struct timespec *deadline)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&ring->hdr->mtx);
+    __atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+    while (!ready(ring, sz)) {
+        if (deadline == NULL) {
+            pthread_cond_wait(cond, &ring->hdr->mtx);
+        } else if (pthread_cond_timedwait(cond,
+                                          &ring->hdr->mtx,
+                                          deadline) == ETIMEDOUT) {
+            res = -1;
+            break;
+        }
+    }
+    __atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->hdr->mtx);
+    return res;
+}
+
+
+static void
+ring_wake(mrkdata_ring_t *ring, pthread_cond_t *cond, unsigned *waiting)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&ring->hdr->mtx);
+        pthread_cond_broadcast(cond);
+        pthread_mutex_unlock(&ring->hdr->mtx);
+    }
+}
+
+
+static void
+ring_deadline(int timeout, struct timespec *deadline)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+
+/*
+ * Room needed at head for a frame of sz, with the padding before it.
+ */
+static uint64_t
+ring_need(const ring_hdr_t *hdr, uint64_t head, uint64_t framesz)
+{
+    uint64_t off = head % hdr->size;
+
+    return off + framesz > hdr->size ? hdr->size - off + framesz : framesz;
+}
+
+
+static int
+ring_writable(mrkdata_ring_t *ring, size_t framesz)
+{
+    ring_hdr_t *hdr = ring->hdr;
+    uint64_t head, tail;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* the tail first, see ring_reserve() */
+    tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+    return head + ring_need(hdr, head, framesz) - tail <= hdr->size;
+}
+
+
+/*
+ * Reserve a frame of framesz.  Return the data offset of the frame, or
+ * -1 if there is no room before the deadline.
+ */
+static int64_t
+ring_reserve(mrkdata_ring_t *ring, uint64_t framesz, int timeout)
+{
+    ring_hdr_t *hdr = ring->hdr;
+    struct timespec deadline;
+    unsigned spin = 0;
+    uint64_t head, tail, need, off;
+
+    while (1) {
+        /*
+         * The tail first: a head loaded before it may already be behind
+         * it, and head + need - tail would wrap round.
+         */
+        tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+        need = ring_need(hdr, head, framesz);
+
+        if (head + need - tail > hdr->size) {
+            if (timeout == 0) {
+                return -1;
+            }
+            if (++spin < RING_SPIN) {
+                continue;
+            }
+            if (timeout > 0) {
+                ring_deadline(timeout, &deadline);
+            }
+            if (ring_sleep(ring, &hdr->wcond, &hdr->wwaiting,
+                           ring_writable, framesz,
+                           timeout > 0 ? &deadline : NULL) != 0) {
+                return -1;
+            }
+            spin = 0;
+            continue;
+        }
+
+        if (hdr->flags & MRKDATA_RING_SPSC) {
+            __atomic_store_n(&hdr->head, head + need, __ATOMIC_RELAXED);
+            break;
+        }
+        if (__atomic_compare_exchange_n(&hdr->head, &head, head + need, 0,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    off = head % hdr->size;
+    if (need != framesz) {
+        /* skip to the start, the pad frame is ready right away */
+        __atomic_store_n((uint64_t *)(ring->data + off),
+                         ((hdr->size - off) << 2) | RING_PAD | RING_READY,
+                         __ATOMIC_RELEASE);
+        off = 0;
+    }
+    return off;
+}
+
+
+static void
+ring_commit(mrkdata_ring_t *ring, uint64_t off, ssize_t sz)
+{
+    __atomic_store_n((uint64_t *)(ring->data + off),
+                     ((uint64_t)sz << 2) | RING_READY,
+                     __ATOMIC_RELEASE);
+    ring_wake(ring, &ring->hdr->rcond, &ring->hdr->rwaiting);
+}
+
+
+/*
+ * Pack dat straight into the ring.  Wait up to timeout milliseconds for
+ * room, forever if timeout is negative.
+ */
+int
+mrkdata_ring_write(mrkdata_ring_t *ring,
+                   const mrkdata_datum_t *dat,
+                   int timeout)
+{
+    uint64_t framesz = RING_FRAME_SZ((uint64_t)dat->packsz);
+    int64_t off;
+
+    if (framesz > ring->hdr->size / 2) {
+        TRRET(MRKDATA_RING_WRITE + 1);
+    }
+    if ((off = ring_reserve(ring, framesz, timeout)) < 0) {
+        TRRET(MRKDATA_RING_WRITE + 2);
+    }
+    if (mrkdata_pack_datum(dat,
+                           ring->data + off + RING_FRAME_HDRSZ,
+                           dat->packsz) != dat->packsz) {
+        /* the frame is reserved, pass it as padding */
+        __atomic_store_n((uint64_t *)(ring->data + off),
+                         (framesz << 2) | RING_PAD | RING_READY,
+                         __ATOMIC_RELEASE);
+        TRRET(MRKDATA_RING_WRITE + 3);
+    }
+    ring_commit(ring, off, dat->packsz);
+    return 0;
+}
+
+
+int
+mrkdata_ring_write_buf(mrkdata_ring_t *ring,
+                       const unsigned char *rec,
+                       ssize_t sz,
+                       int timeout)
+{
+    uint64_t framesz = RING_FRAME_SZ((uint64_t)sz);
+    int64_t off;
+
+    if (mrkdata_buf_size(rec, sz) != sz || framesz > ring->hdr->size / 2) {
+        TRRET(MRKDATA_RING_WRITE_BUF + 1);
+    }
+    if ((off = ring_reserve(ring, framesz, timeout)) < 0) {
+        TRRET(MRKDATA_RING_WRITE_BUF + 2);
+    }
+    memcpy(ring->data + off + RING_FRAME_HDRSZ, rec, sz);
+    ring_commit(ring, off, sz);
+    return 0;
+}
+
+
+static int
+ring_readable(mrkdata_ring_t *ring, UNUSED size_t sz)
+{
+    uint64_t tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n((uint64_t *)(ring->data + tail % ring->hdr->size),
+                           __ATOMIC_ACQUIRE) & RING_READY;
+}
+
+
+/*
+ * Give the frame at tail back to the writers.
+ */
+static void
+ring_release(mrkdata_ring_t *ring, uint64_t framesz)
+{
+    ring_hdr_t *hdr = ring->hdr;
+    uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+
+    memset(ring->data + tail % hdr->size, '\0', framesz);
+    __atomic_store_n(&hdr->tail, tail + framesz, __ATOMIC_RELEASE);
+    ring_wake(ring, &hdr->wcond, &hdr->wwaiting);
+}
+
+
+/*
+ * Wait up to timeout milliseconds for the next record, forever if
+ * timeout is negative.  Return its size and set *prec to it, in the
+ * ring.  Return 0 if there is none.  The record stays in place until
+ * mrkdata_ring_read_done().  Only one thread may read.
+ */
+ssize_t
+mrkdata_ring_read(mrkdata_ring_t *ring, const unsigned char **prec, int timeout)
+{
+    ring_hdr_t *hdr = ring->hdr;
+    struct timespec deadline;
+    unsigned spin = 0;
+    uint64_t tail, h;
+
+    if (ring->cursz != 0) {
+        mrkdata_ring_read_done(ring);
+    }
+
+    while (1) {
+        tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+        h = __atomic_load_n((uint64_t *)(ring->data + tail % hdr->size),
+                            __ATOMIC_ACQUIRE);
+
+        if (!(h & RING_READY)) {
+            if (timeout == 0) {
+                return 0;
+            }
+            if (++spin < RING_SPIN) {
+                continue;
+            }
+            if (timeout > 0) {
+                ring_deadline(timeout, &deadline);
+            }
+            if (ring_sleep(ring, &hdr->rcond, &hdr->rwaiting,
+                           ring_readable, 0,
+                           timeout > 0 ? &deadline : NULL) != 0) {
+                return 0;
+            }
+            spin = 0;
+            continue;
+        }
+
+        if (h & RING_PAD) {
+            ring_release(ring, h >> 2);
+            continue;
+        }
+
+        ring->cursz = h >> 2;
+        *prec = ring->data + tail % hdr->size + RING_FRAME_HDRSZ;
+        return ring->cursz;
+    }
+}
+
+
+/*
+ * Release the record returned by the last mrkdata_ring_read().
+ */
+void
+mrkdata_ring_read_done(mrkdata_ring_t *ring)
+{
+    if (ring->cursz != 0) {
+        ring_release(ring, RING_FRAME_SZ(ring->cursz));
+        ring->cursz = 0;
+    }
+}
@@ -0,0 +1,315 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Read-ahead record scanner.
+ *
+ * The range is cut in chunks of bufsz bytes.  Reader threads pread()
+ * chunks into a ring of depth buffers, chunk n into buffer n % depth,
+ * so that up to depth reads are in flight while the calling thread
+ * walks the records of the chunks in order.  A record that straddles
+ * chunks is assembled in a separate carry buffer.
+ *
+ * Buffers, bufsz and chunk offsets are SCAN_ALIGN aligned, so that the
+ * descriptor may be opened with O_DIRECT.
+ */
+
+#define SCAN_ALIGN 4096
+#define SCAN_DEFAULT_BUFSZ (1024 * 1024)
+#define SCAN_DEFAULT_DEPTH 4
+#define SCAN_DEFAULT_NTHREADS 2
+
+#define SCAN_FREE 0
+#define SCAN_READING 1
+#define SCAN_DONE 2
+#define SCAN_ERROR 3
+
+typedef struct _scan_slot {
+    unsigned char *buf;
+    ssize_t len;
+    int state;
+} scan_slot_t;
+
+typedef struct _scan {
+    int fd;
+    off_t start;
+    off_t end;
+    ssize_t bufsz;
+    unsigned depth;
+    uint64_t nchunks;
+    /* next chunk to read, and to consume */
+    uint64_t issue;
+    uint64_t consume;
+    int stop;
+    scan_slot_t *slots;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+} scan_t;
+
+
+static void *
+scan_worker(void *arg)
+{
+    scan_t *sc = arg;
+
+    pthread_mutex_lock(&sc->mtx);
+    while (1) {
+        scan_slot_t *slot;
+        uint64_t n;
+        off_t off;
+        ssize_t sz, nread, len;
+
+        while (!sc->stop &&
+               sc->issue < sc->nchunks &&
+               sc->slots[sc->issue % sc->depth].state != SCAN_FREE) {
+            pthread_cond_wait(&sc->cond, &sc->mtx);
+        }
+        if (sc->stop || sc->issue >= sc->nchunks) {
+            break;
+        }
+
+        n = sc->issue++;
+        slot = &sc->slots[n % sc->depth];
+        slot->state = SCAN_READING;
+        pthread_mutex_unlock(&sc->mtx);
+
+        off = sc->start + (off_t)(n * sc->bufsz);
+        sz = MIN((off_t)sc->bufsz, sc->end - off);
+        len = 0;
+        /*
+         * The last chunk is read whole too, an O_DIRECT read must be of
+         * aligned length, and then cut at the end of the range.
+         */
+        while (len < sz) {
+            if ((nread = pread(sc->fd, slot->buf + len, sc->bufsz - len,
+                               off + len)) <= 0) {
+                if (nread < 0 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            len += nread;
+        }
+
+        pthread_mutex_lock(&sc->mtx);
+        slot->len = MIN(len, sz);
+        slot->state = len >= sz ? SCAN_DONE : SCAN_ERROR;
+        pthread_cond_broadcast(&sc->cond);
+    }
+    pthread_mutex_unlock(&sc->mtx);
+
+    return NULL;
+}
+
+
+/*
+ * Grow the carry buffer to hold sz bytes.
+ */
+static void
+carry_reserve(unsigned char **pcarry, ssize_t *pcarrysz, ssize_t sz)
+{
+    if (sz > *pcarrysz) {
+        if ((*pcarry = realloc(*pcarry, sz)) == NULL) {
+            FAIL("realloc");
+        }
+        *pcarrysz = sz;
+    }
+}
+
+
+/*
+ * Walk the records of the chunks in order.  Return 0 at the end of the
+ * range, a non-zero return of cb, or an error code.
+ */
+static int
+scan_consume(scan_t *sc, mrkdata_frecord_cb_t cb, void *udata)
+{
+    unsigned char *carry = NULL;
+    ssize_t carrysz = 0, carrylen = 0;
+    int res = 0;
+
+    while (sc->consume < sc->nchunks) {
+        scan_slot_t *slot;
+        const unsigned char *buf, *end;
+        ssize_t recsz;
+
+        slot = &sc->slots[sc->consume % sc->depth];
+
+        pthread_mutex_lock(&sc->mtx);
+        while (slot->state == SCAN_FREE || slot->state == SCAN_READING) {
+            pthread_cond_wait(&sc->cond, &sc->mtx);
+        }
+        pthread_mutex_unlock(&sc->mtx);
+
+        if (slot->state == SCAN_ERROR) {
+            res = MRKDATA_SCAN_FD + 2;
+            break;
+        }
+
+        buf = slot->buf;
+        end = buf + slot->len;
+
+        /* complete the record left over from the previous chunks */
+        while (carrylen > 0 && buf < end) {
+            ssize_t need;
+
+            if ((recsz = mrkdata_buf_size(carry, carrylen)) < 0) {
+                res = MRKDATA_SCAN_FD + 3;
+                goto end;
+            }
+            if (recsz == 0) {
+                /* header still incomplete, take one more byte */
+                need = 1;
+            } else {
+                need = MIN(recsz - carrylen, end - buf);
+            }
+            carry_reserve(&carry, &carrysz, carrylen + need);
+            memcpy(carry + carrylen, buf, need);
+            carrylen += need;
+            buf += need;
+
+            if (recsz > 0 && carrylen == recsz) {
+                carrylen = 0;
+                if ((res = cb(carry, recsz, udata)) != 0) {
+                    goto end;
+                }
+            }
+        }
+
+        for (; buf < end; buf += recsz) {
+            if ((recsz = mrkdata_buf_size(buf, end - buf)) < 0) {
+                res = MRKDATA_SCAN_FD + 3;
+                goto end;
+            }
+            if (recsz == 0 || recsz > end - buf) {
+                carry_reserve(&carry, &carrysz, end - buf);
+                memcpy(carry, buf, end - buf);
+                carrylen = end - buf;
+                break;
+            }
+            if ((res = cb(buf, recsz, udata)) != 0) {
+                goto end;
+            }
+        }
+
+        pthread_mutex_lock(&sc->mtx);
+        slot->state = SCAN_FREE;
+        ++sc->consume;
+        pthread_cond_broadcast(&sc->cond);
+        pthread_mutex_unlock(&sc->mtx);
+    }
+
+    if (res == 0 && carrylen > 0) {
+        /* truncated last record */
+        res = MRKDATA_SCAN_FD + 4;
+    }
+
+end:
+    if (carry != NULL) {
+        free(carry);
+    }
+    return res;
+}
+
+
+/*
+ * Call cb on every record in the range of params of the file at fd.  The
+ * reads are done ahead by params->nthreads threads, and records are
+ * handed to cb in the calling thread in file order.  A non-zero return
+ * from cb stops the scan and is returned.
+ */
+int
+mrkdata_scan_fd(int fd,
+                const mrkdata_scan_params_t *params,
+                mrkdata_frecord_cb_t cb,
+                void *udata)
+{
+    scan_t sc;
+    struct stat sb;
+    pthread_t *threads;
+    unsigned i, nthreads;
+    int res;
+
+    sc.fd = fd;
+    sc.start = params != NULL ? params->start : 0;
+    sc.end = params != NULL ? params->end : 0;
+    sc.bufsz = params != NULL && params->bufsz > 0 ?
+        params->bufsz : SCAN_DEFAULT_BUFSZ;
+    sc.depth = params != NULL && params->depth > 0 ?
+        params->depth : SCAN_DEFAULT_DEPTH;
+    nthreads = params != NULL && params->nthreads > 0 ?
+        params->nthreads : SCAN_DEFAULT_NTHREADS;
+    nthreads = MIN(nthreads, sc.depth);
+
+    if (sc.end == 0) {
+        if (fstat(fd, &sb) != 0) {
+            TRRET(MRKDATA_SCAN_FD + 1);
+        }
+        sc.end = sb.st_size;
+    }
+    if (sc.start < 0 || sc.start % SCAN_ALIGN != 0 || sc.end < sc.start) {
+        TRRET(MRKDATA_SCAN_FD + 1);
+    }
+
+    sc.bufsz = (sc.bufsz + SCAN_ALIGN - 1) / SCAN_ALIGN * SCAN_ALIGN;
+    sc.nchunks = (sc.end - sc.start + sc.bufsz - 1) / sc.bufsz;
+    sc.issue = 0;
+    sc.consume = 0;
+    sc.stop = 0;
+
+    if ((sc.slots = calloc(sc.depth, sizeof(scan_slot_t))) == NULL) {
+        FAIL("calloc");
+    }
+    for (i = 0; i < sc.depth; ++i) {
+        if (posix_memalign((void **)&sc.slots[i].buf,
+                           SCAN_ALIGN,
+                           sc.bufsz) != 0) {
+            FAIL("posix_memalign");
+        }
+        sc.slots[i].state = SCAN_FREE;
+    }
+    MRKDATA_STATS_ALLOC(sc.depth * sc.bufsz);
+
+    pthread_mutex_init(&sc.mtx, NULL);
+    pthread_cond_init(&sc.cond, NULL);
+
+    if ((threads = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+        FAIL("calloc");
+    }
+    for (i = 0; i < nthreads; ++i) {
+        if (pthread_create(&threads[i], NULL, scan_worker, &sc) != 0) {
+            FAIL("pthread_create");
+        }
+    }
+
+    res = scan_consume(&sc, cb, udata);
+
+    pthread_mutex_lock(&sc.mtx);
+    sc.stop = 1;
+    pthread_cond_broadcast(&sc.cond);
+    pthread_mutex_unlock(&sc.mtx);
+
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    pthread_cond_destroy(&sc.cond);
+    pthread_mutex_destroy(&sc.mtx);
+    for (i = 0; i < sc.depth; ++i) {
+        free(sc.slots[i].buf);
+    }
+    free(sc.slots);
+
+    TRRET(res);
+}
@@ -0,0 +1,386 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * SEQ with an offset table.
+ *
+ * A SEQIDX element is the tag, the 8-byte length of the rest, the items
+ * packed as in a SEQ, and a trailer: the 8-byte offsets of every
+ * "every"-th item from the first one, the 8-byte number of items, and
+ * the 4-byte "every", all big-endian.  The trailer is written after the
+ * items, so that the writer does not need their sizes up front.
+ *
+ * Item i is found from the offset of item i - i % every, skipping over
+ * at most every - 1 items by their headers.  A large SEQIDX is decoded
+ * by several threads, each taking a slice of whole offset table spans.
+ */
+
+#define SEQIDX_DEFAULT_EVERY 16
+#define SEQIDX_DEFAULT_NTHREADS 4
+/* fewer items per thread are not worth a thread */
+#define SEQIDX_MINSLICE 256
+
+#define SEQIDX_TRAILERSZ (sizeof(uint64_t) + sizeof(uint32_t))
+
+typedef struct _seqidx {
+    /* items, and past them the offset table */
+    const unsigned char *items;
+    const unsigned char *end;
+    const unsigned char *offsets;
+    uint64_t nitems;
+    uint64_t noffsets;
+    unsigned every;
+} seqidx_t;
+
+typedef struct _seqidx_slice {
+    const mrkdata_spec_t *spec;
+    const unsigned char *buf;
+    const unsigned char *end;
+    mrkdata_datum_t **items;
+    uint64_t nitems;
+    int res;
+} seqidx_slice_t;
+
+
+/*
+ * Read the header and the trailer of the SEQIDX record at buf.  Return
+ * its size, or 0.
+ */
+static ssize_t
+seqidx_open(seqidx_t *si, const unsigned char *buf, ssize_t sz)
+{
+    ssize_t recsz;
+    int64_t len;
+    const unsigned char *trailer;
+
+    if (sz < MRKDATA_EXPECT_SZ(MRKDATA_SEQIDX) || buf[0] != MRKDATA_SEQIDX) {
+        return 0;
+    }
+    len = be64toh(*((const int64_t *)(buf + 1)));
+    if (len < (int64_t)SEQIDX_TRAILERSZ ||
+        len > sz - MRKDATA_EXPECT_SZ(MRKDATA_SEQIDX)) {
+        return 0;
+    }
+    recsz = MRKDATA_EXPECT_SZ(MRKDATA_SEQIDX) + len;
+    trailer = buf + recsz - SEQIDX_TRAILERSZ;
+
+    si->nitems = be64toh(*((const uint64_t *)trailer));
+    si->every = be32toh(*((const uint32_t *)(trailer + sizeof(uint64_t))));
+    if (si->every == 0) {
+        return 0;
+    }
+    si->noffsets = si->nitems == 0 ? 0 : (si->nitems - 1) / si->every + 1;
+    if (si->noffsets > (uint64_t)(len - SEQIDX_TRAILERSZ) /
+                       sizeof(uint64_t)) {
+        return 0;
+    }
+    si->items = buf + MRKDATA_EXPECT_SZ(MRKDATA_SEQIDX);
+    si->offsets = trailer - si->noffsets * sizeof(uint64_t);
+    si->end = si->offsets;
+    return recsz;
+}
+
+
+/*
+ * The item at the idx-th offset, or NULL if the offset is out of the
+ * items.
+ */
+static const unsigned char *
+seqidx_offset(const seqidx_t *si, uint64_t idx)
+{
+    uint64_t off;
+
+    off = be64toh(*((const uint64_t *)(si->offsets +
+                                       idx * sizeof(uint64_t))));
+    return off < (uint64_t)(si->end - si->items) ? si->items + off : NULL;
+}
+
+
+/*
+ * Pack dat, a SEQ, as a SEQIDX element with an offset for every
+ * "every"-th item, 16 by default.  Return its size, or 0.
+ */
+ssize_t
+mrkdata_seqidx_pack_datum(const mrkdata_datum_t *dat,
+                          unsigned every,
+                          unsigned char *buf,
+                          ssize_t sz)
+{
+    mrkdata_datum_t **field;
+    mnarray_iter_t it;
+    unsigned char *p;
+    uint64_t i, nitems, noffsets;
+    ssize_t recsz;
+    mrkdata_stats_t *st;
+
+    if (dat->spec->tag != MRKDATA_SEQ) {
+        MRKDATA_STATS_ERROR(MRKDATA_SEQIDX_PACK_DATUM + 1);
+        return 0;
+    }
+    if (every == 0) {
+        every = SEQIDX_DEFAULT_EVERY;
+    }
+    nitems = dat->data.fields.elnum;
+    noffsets = nitems == 0 ? 0 : (nitems - 1) / every + 1;
+    recsz = dat->packsz + noffsets * sizeof(uint64_t) + SEQIDX_TRAILERSZ;
+    if (sz < recsz) {
+        MRKDATA_STATS_ERROR(MRKDATA_SEQIDX_PACK_DATUM + 2);
+        return 0;
+    }
+
+    buf[0] = MRKDATA_SEQIDX;
+    *((int64_t *)(buf + 1)) =
+        htobe64(recsz - MRKDATA_EXPECT_SZ(MRKDATA_SEQIDX));
+
+    p = buf + MRKDATA_EXPECT_SZ(MRKDATA_SEQIDX);
+    i = 0;
+    for (field = array_first(&dat->data.fields, &it);
+         field != NULL;
+         field = array_next(&dat->data.fields, &it)) {
+        ssize_t nwritten;
+
+        if (i % every == 0) {
+            *((uint64_t *)(buf + dat->packsz + (i / every) *
+                           sizeof(uint64_t))) =
+                htobe64(p - buf - MRKDATA_EXPECT_SZ(MRKDATA_SEQIDX));
+        }
+        if ((nwritten = mrkdata_pack_elem(*field,
+                                          p,
+                                          buf + dat->packsz - p)) == 0) {
+            MRKDATA_STATS_ERROR(MRKDATA_SEQIDX_PACK_DATUM + 2);
+            return 0;
+        }
+        p += nwritten;
+        ++i;
+    }
+
+    p = buf + recsz - SEQIDX_TRAILERSZ;
+    *((uint64_t *)p) = htobe64(nitems);
+    *((uint32_t *)(p + sizeof(uint64_t))) = htobe32(every);
+
+    MRKDATA_STATS_VALUE(MRKDATA_SEQIDX);
+    st = MRKDATA_STATS();
+    ++st->npacked;
+    st->bpacked += recsz;
+    return recsz;
+}
+
+
+/*
+ * Return the number of items of the SEQIDX record at buf, or -1.
+ */
+int64_t
+mrkdata_seqidx_nitems(const unsigned char *buf, ssize_t sz)
+{
+    seqidx_t si;
+
+    if (seqidx_open(&si, buf, sz) == 0 || si.nitems > INT64_MAX) {
+        return -1;
+    }
+    return si.nitems;
+}
+
+
+/*
+ * Return the idx-th item of the SEQIDX record at buf, and its size in
+ * *psz, skipping over fewer than "every" items.  Return NULL if there is
+ * no such item, or the record does not fit in sz.
+ */
+const unsigned char *
+mrkdata_seqidx_get(const unsigned char *buf,
+                   ssize_t sz,
+                   uint64_t idx,
+                   ssize_t *psz)
+{
+    seqidx_t si;
+    const unsigned char *p;
+    ssize_t isz;
+    unsigned i;
+
+    if (seqidx_open(&si, buf, sz) == 0 || idx >= si.nitems) {
+        return NULL;
+    }
+    if ((p = seqidx_offset(&si, idx / si.every)) == NULL) {
+        return NULL;
+    }
+    for (i = 0; ; ++i) {
+        if ((isz = mrkdata_buf_size(p, si.end - p)) <= 0 ||
+            isz > si.end - p) {
+            return NULL;
+        }
+        if (i == idx % si.every) {
+            *psz = isz;
+            return p;
+        }
+        p += isz;
+    }
+}
+
+
+static void *
+seqidx_worker(void *arg)
+{
+    seqidx_slice_t *sl = arg;
+    const unsigned char *p = sl->buf;
+    uint64_t i;
+
+    for (i = 0; i < sl->nitems; ++i) {
+        ssize_t nread;
+
+        if ((nread = mrkdata_unpack_elem(sl->spec,
+                                         p,
+                                         sl->end - p,
+                                         &sl->items[i])) == 0) {
+            sl->res = MRKDATA_SEQIDX_UNPACK_BUF + 3;
+            return NULL;
+        }
+        p += nread;
+    }
+    if (p != sl->end) {
+        sl->res = MRKDATA_SEQIDX_UNPACK_BUF + 3;
+    }
+    return NULL;
+}
+
+
+/*
+ * Unpack the SEQIDX record at buf into a new SEQ datum of spec, with
+ * the items split between nthreads threads, 4 by default, the calling
+ * one included.  Return the size of the record, or 0.
+ */
+ssize_t
+mrkdata_seqidx_unpack_buf(const mrkdata_spec_t *spec,
+                          const unsigned char *buf,
+                          ssize_t sz,
+                          mrkdata_datum_t **pdat,
+                          unsigned nthreads)
+{
+    seqidx_t si;
+    seqidx_slice_t *slices;
+    pthread_t *threads;
+    mrkdata_datum_t **items, *dat;
+    mrkdata_spec_t **item;
+    uint64_t i, nspans, span;
+    unsigned j, nslices;
+    ssize_t recsz, res;
+    mrkdata_stats_t *st;
+
+    assert(pdat != NULL);
+
+    if ((recsz = seqidx_open(&si, buf, sz)) == 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_SEQIDX_UNPACK_BUF + 1);
+        return 0;
+    }
+    if (*pdat != NULL ||
+        spec->tag != MRKDATA_SEQ ||
+        (item = array_get(&spec->fields, 0)) == NULL) {
+        MRKDATA_STATS_ERROR(MRKDATA_SEQIDX_UNPACK_BUF + 2);
+        return 0;
+    }
+    /* there is at least an item per byte */
+    if (si.nitems > (uint64_t)(si.end - si.items)) {
+        MRKDATA_STATS_ERROR(MRKDATA_SEQIDX_UNPACK_BUF + 1);
+        return 0;
+    }
+
+    if (nthreads == 0) {
+        nthreads = SEQIDX_DEFAULT_NTHREADS;
+    }
+    nslices = MAX(1, MIN(nthreads, si.nitems / SEQIDX_MINSLICE));
+    nslices = MIN(nslices, MAX(1, si.noffsets));
+    /* whole offset spans per slice */
+    nspans = si.noffsets == 0 ? 0 : (si.noffsets - 1) / nslices + 1;
+    span = nspans * si.every;
+
+    if ((items = calloc(MAX(1, si.nitems),
+                        sizeof(mrkdata_datum_t *))) == NULL) {
+        FAIL("calloc");
+    }
+    if ((slices = calloc(nslices, sizeof(seqidx_slice_t))) == NULL) {
+        FAIL("calloc");
+    }
+    if ((threads = calloc(nslices, sizeof(pthread_t))) == NULL) {
+        FAIL("calloc");
+    }
+
+    res = 0;
+    for (j = 0; j < nslices; ++j) {
+        seqidx_slice_t *sl = &slices[j];
+
+        sl->spec = *item;
+        if (j * span < si.nitems) {
+            sl->items = items + j * span;
+            sl->nitems = MIN(span, si.nitems - j * span);
+            sl->buf = seqidx_offset(&si, j * nspans);
+        } else {
+            sl->items = items;
+            sl->nitems = 0;
+            sl->buf = si.end;
+        }
+        sl->end = (j + 1) * span < si.nitems ?
+                  seqidx_offset(&si, (j + 1) * nspans) : si.end;
+        if (sl->buf == NULL ||
+            sl->end == NULL ||
+            sl->end < sl->buf ||
+            (j == 0 && sl->buf != si.items)) {
+            res = MRKDATA_SEQIDX_UNPACK_BUF + 1;
+            nslices = j;
+            break;
+        }
+    }
+
+    for (j = 1; j < nslices; ++j) {
+        if (pthread_create(&threads[j], NULL, seqidx_worker, &slices[j]) !=
+            0) {
+            FAIL("pthread_create");
+        }
+    }
+    if (nslices > 0) {
+        seqidx_worker(&slices[0]);
+    }
+    for (j = 0; j < nslices; ++j) {
+        if (j > 0) {
+            pthread_join(threads[j], NULL);
+        }
+        if (slices[j].res != 0) {
+            res = slices[j].res;
+        }
+    }
+
+    dat = NULL;
+    if (res == 0) {
+        dat = mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+        for (i = 0; i < si.nitems; ++i) {
+            mrkdata_datum_add_field(dat, items[i]);
+        }
+    } else {
+        for (i = 0; i < si.nitems; ++i) {
+            mrkdata_datum_destroy(&items[i]);
+        }
+    }
+    free(threads);
+    free(slices);
+    free(items);
+
+    if (res != 0) {
+        MRKDATA_STATS_ERROR(res);
+        return 0;
+    }
+
+    *pdat = dat;
+    MRKDATA_STATS_VALUE(MRKDATA_SEQIDX);
+    st = MRKDATA_STATS();
+    ++st->nunpacked;
+    st->bunpacked += recsz;
+    return recsz;
+}
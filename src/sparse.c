@@ -0,0 +1,339 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Sparse STRUCTs.
+ *
+ * A STRUCT datum may have absent fields, added as NULL, see
+ * mrkdata_datum_add_field().  Such a STRUCT is packed as a SPARSE
+ * element: the tag, the 8-byte length of the rest, the 2-byte number of
+ * fields, the 1-byte width of the offsets, a bitmap of the present
+ * fields, the offsets of the present fields from the first one, and the
+ * present fields in order.  The offsets are 1, 2 or 4 bytes wide, as
+ * few as the fields need.  The numbers are big-endian, and field i is
+ * bit i % 8 of byte i / 8 of the bitmap.  The bits past the last field
+ * are zero.
+ *
+ * The bitmap is read 64 fields at a time, so that a run of absent
+ * fields costs nothing to skip when unpacking, and the position of
+ * field i among the present ones is a popcount, which indexes its
+ * offset.
+ */
+
+#define SPARSE_HDRSZ \
+    (MRKDATA_EXPECT_SZ(MRKDATA_SPARSE) + sizeof(uint16_t) + sizeof(uint8_t))
+#define SPARSE_MAXFIELDS 0xffff
+#define SPARSE_BITMAPSZ(n) (((n) + 7) / 8)
+
+typedef struct _sparse {
+    const unsigned char *bitmap;
+    const unsigned char *offsets;
+    const unsigned char *fields;
+    const unsigned char *end;
+    unsigned nfields;
+    unsigned npresent;
+    unsigned width;
+} sparse_t;
+
+static uint64_t sparse_word(const sparse_t *, unsigned);
+
+
+/*
+ * Read the header of the SPARSE record at buf.  Return its size, or 0.
+ */
+static ssize_t
+sparse_open(sparse_t *sp, const unsigned char *buf, ssize_t sz)
+{
+    int64_t len;
+    unsigned i;
+
+    if (sz < (ssize_t)SPARSE_HDRSZ || buf[0] != MRKDATA_SPARSE) {
+        return 0;
+    }
+    len = be64toh(*((const int64_t *)(buf + 1)));
+    sp->nfields = be16toh(*((const uint16_t *)
+                            (buf + MRKDATA_EXPECT_SZ(MRKDATA_SPARSE))));
+    sp->width = buf[SPARSE_HDRSZ - 1];
+    if (len < (int64_t)(SPARSE_HDRSZ - MRKDATA_EXPECT_SZ(MRKDATA_SPARSE) +
+                        SPARSE_BITMAPSZ(sp->nfields)) ||
+        len > sz - MRKDATA_EXPECT_SZ(MRKDATA_SPARSE) ||
+        (sp->width != 1 && sp->width != 2 && sp->width != 4)) {
+        return 0;
+    }
+    sp->bitmap = buf + SPARSE_HDRSZ;
+    /* no bits for fields that are not there */
+    if (sp->nfields % 8 != 0 &&
+        sp->bitmap[sp->nfields / 8] >> (sp->nfields % 8) != 0) {
+        return 0;
+    }
+    sp->npresent = 0;
+    for (i = 0; i < sp->nfields; i += 64) {
+        sp->npresent += __builtin_popcountll(sparse_word(sp, i / 64));
+    }
+    sp->offsets = sp->bitmap + SPARSE_BITMAPSZ(sp->nfields);
+    sp->fields = sp->offsets + sp->npresent * sp->width;
+    sp->end = buf + MRKDATA_EXPECT_SZ(MRKDATA_SPARSE) + len;
+    if (sp->fields > sp->end) {
+        return 0;
+    }
+    return sp->end - buf;
+}
+
+
+/*
+ * The 64 bits of fields 64 * i to 64 * i + 63.
+ */
+static uint64_t
+sparse_word(const sparse_t *sp, unsigned i)
+{
+    unsigned nbytes = SPARSE_BITMAPSZ(sp->nfields);
+    uint64_t w = 0;
+
+    memcpy(&w, sp->bitmap + i * 8, MIN(8, nbytes - i * 8));
+    return le64toh(w);
+}
+
+
+/*
+ * The offset of the rank-th present field from the first one.
+ */
+static ssize_t
+sparse_offset(const sparse_t *sp, unsigned rank)
+{
+    const unsigned char *p = sp->offsets + rank * sp->width;
+
+    switch (sp->width) {
+    case 1:
+        return *p;
+    case 2:
+        return be16toh(*((const uint16_t *)p));
+    default:
+        return be32toh(*((const uint32_t *)p));
+    }
+}
+
+
+/*
+ * Pack dat, a STRUCT with absent fields or not, as a SPARSE element.
+ * With no buffer, only count.  Return its size, or 0.
+ */
+ssize_t
+mrkdata_sparse_pack_datum(const mrkdata_datum_t *dat,
+                          unsigned char *buf,
+                          ssize_t sz)
+{
+    mrkdata_datum_t **field;
+    mnarray_iter_t it;
+    unsigned char *bitmap, *offsets, *fields, *p;
+    unsigned i, nfields, npresent, width;
+    ssize_t recsz;
+    mrkdata_stats_t *st;
+
+    if (dat->spec->tag != MRKDATA_STRUCT ||
+        dat->data.fields.elnum > SPARSE_MAXFIELDS ||
+        dat->packsz > (ssize_t)UINT32_MAX) {
+        MRKDATA_STATS_ERROR(MRKDATA_SPARSE_PACK_DATUM + 1);
+        return 0;
+    }
+    nfields = dat->data.fields.elnum;
+    npresent = 0;
+    for (field = array_first(&dat->data.fields, &it);
+         field != NULL;
+         field = array_next(&dat->data.fields, &it)) {
+        if (*field != NULL) {
+            ++npresent;
+        }
+    }
+    /* no offset is past the fields, which packsz has after the header */
+    recsz = dat->packsz - MRKDATA_EXPECT_SZ(MRKDATA_STRUCT);
+    width = recsz <= 0x100 ? 1 : recsz <= 0x10000 ? 2 : 4;
+    /* absent fields do not count in packsz */
+    recsz = dat->packsz + (SPARSE_HDRSZ - MRKDATA_EXPECT_SZ(MRKDATA_SPARSE)) +
+            SPARSE_BITMAPSZ(nfields) + npresent * width;
+    if (buf == NULL) {
+        return recsz;
+    }
+    if (sz < recsz) {
+        MRKDATA_STATS_ERROR(MRKDATA_SPARSE_PACK_DATUM + 2);
+        return 0;
+    }
+
+    buf[0] = MRKDATA_SPARSE;
+    *((int64_t *)(buf + 1)) =
+        htobe64(recsz - MRKDATA_EXPECT_SZ(MRKDATA_SPARSE));
+    *((uint16_t *)(buf + MRKDATA_EXPECT_SZ(MRKDATA_SPARSE))) =
+        htobe16(nfields);
+    buf[SPARSE_HDRSZ - 1] = width;
+    bitmap = buf + SPARSE_HDRSZ;
+    memset(bitmap, '\0', SPARSE_BITMAPSZ(nfields));
+
+    offsets = bitmap + SPARSE_BITMAPSZ(nfields);
+    fields = offsets + npresent * width;
+    p = fields;
+    i = 0;
+    for (field = array_first(&dat->data.fields, &it);
+         field != NULL;
+         field = array_next(&dat->data.fields, &it)) {
+        ssize_t nwritten;
+
+        if (*field != NULL) {
+            bitmap[i / 8] |= 1 << (i % 8);
+            if (width == 1) {
+                *offsets = p - fields;
+            } else if (width == 2) {
+                *((uint16_t *)offsets) = htobe16(p - fields);
+            } else {
+                *((uint32_t *)offsets) = htobe32(p - fields);
+            }
+            offsets += width;
+            if ((nwritten = mrkdata_pack_elem(*field,
+                                              p,
+                                              buf + recsz - p)) == 0) {
+                MRKDATA_STATS_ERROR(MRKDATA_SPARSE_PACK_DATUM + 2);
+                return 0;
+            }
+            p += nwritten;
+        }
+        ++i;
+    }
+
+    MRKDATA_STATS_VALUE(MRKDATA_SPARSE);
+    st = MRKDATA_STATS();
+    ++st->npacked;
+    st->bpacked += recsz;
+    return recsz;
+}
+
+
+/*
+ * Unpack the SPARSE record at buf into a new STRUCT datum of spec, with
+ * its absent fields NULL.  Return the size of the record, or 0.
+ */
+ssize_t
+mrkdata_sparse_unpack_buf(const mrkdata_spec_t *spec,
+                          const unsigned char *buf,
+                          ssize_t sz,
+                          mrkdata_datum_t **pdat)
+{
+    sparse_t sp;
+    mrkdata_datum_t *dat;
+    mrkdata_spec_t **field_spec;
+    const unsigned char *p;
+    unsigned i, next, rank;
+    ssize_t recsz;
+    mrkdata_stats_t *st;
+
+    assert(pdat != NULL);
+
+    if ((recsz = sparse_open(&sp, buf, sz)) == 0) {
+        MRKDATA_STATS_ERROR(MRKDATA_SPARSE_UNPACK_BUF + 1);
+        return 0;
+    }
+    if (*pdat != NULL ||
+        spec->tag != MRKDATA_STRUCT ||
+        spec->fields.elnum != sp.nfields) {
+        MRKDATA_STATS_ERROR(MRKDATA_SPARSE_UNPACK_BUF + 2);
+        return 0;
+    }
+
+    dat = mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+    p = sp.fields;
+    next = 0;
+    rank = 0;
+    for (i = 0; i < sp.nfields; i += 64) {
+        uint64_t w;
+
+        for (w = sparse_word(&sp, i / 64); w != 0; w &= w - 1) {
+            unsigned idx = i + __builtin_ctzll(w);
+            mrkdata_datum_t *field = NULL;
+            ssize_t nread;
+
+            for (; next < idx; ++next) {
+                mrkdata_datum_add_field(dat, NULL);
+            }
+            field_spec = array_get(&spec->fields, idx);
+            assert(field_spec != NULL);
+            if (sparse_offset(&sp, rank) != p - sp.fields ||
+                (nread = mrkdata_unpack_elem(*field_spec,
+                                             p,
+                                             sp.end - p,
+                                             &field)) == 0) {
+                mrkdata_datum_destroy(&field);
+                mrkdata_datum_destroy(&dat);
+                MRKDATA_STATS_ERROR(MRKDATA_SPARSE_UNPACK_BUF + 3);
+                return 0;
+            }
+            mrkdata_datum_add_field(dat, field);
+            p += nread;
+            ++next;
+            ++rank;
+        }
+    }
+    for (; next < sp.nfields; ++next) {
+        mrkdata_datum_add_field(dat, NULL);
+    }
+    if (p != sp.end) {
+        mrkdata_datum_destroy(&dat);
+        MRKDATA_STATS_ERROR(MRKDATA_SPARSE_UNPACK_BUF + 3);
+        return 0;
+    }
+
+    *pdat = dat;
+    MRKDATA_STATS_VALUE(MRKDATA_SPARSE);
+    st = MRKDATA_STATS();
+    ++st->nunpacked;
+    st->bunpacked += recsz;
+    return recsz;
+}
+
+
+/*
+ * Return the idx-th field of the SPARSE record at buf, and its size in
+ * *psz, without decoding anything else.  Return NULL if the field is
+ * absent, or there is no such field, or the record does not fit in sz.
+ */
+const unsigned char *
+mrkdata_sparse_get_field(const unsigned char *buf,
+                         ssize_t sz,
+                         unsigned idx,
+                         ssize_t *psz)
+{
+    sparse_t sp;
+    const unsigned char *p;
+    uint64_t w;
+    unsigned i, rank;
+    ssize_t off, fsz;
+
+    if (sparse_open(&sp, buf, sz) == 0 || idx >= sp.nfields) {
+        return NULL;
+    }
+
+    w = sparse_word(&sp, idx / 64);
+    if (!(w & ((uint64_t)1 << (idx % 64)))) {
+        return NULL;
+    }
+    rank = __builtin_popcountll(w & (((uint64_t)1 << (idx % 64)) - 1));
+    for (i = 0; i < idx / 64; ++i) {
+        rank += __builtin_popcountll(sparse_word(&sp, i));
+    }
+
+    if ((off = sparse_offset(&sp, rank)) >= sp.end - sp.fields) {
+        return NULL;
+    }
+    p = sp.fields + off;
+    if ((fsz = mrkdata_buf_size(p, sp.end - p)) <= 0 ||
+        fsz > sp.end - p) {
+        return NULL;
+    }
+    *psz = fsz;
+    return p;
+}
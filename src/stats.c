@@ -0,0 +1,345 @@
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Per-thread counters are bumped without any locking.  Every thread
+ * links its block into the "locals" list on first use, and folds it into
+ * "retired" on exit, so that a snapshot is the sum of both.
+ */
+__thread mrkdata_stats_local_t mrkdata_stats_local;
+unsigned mrkdata_stats_nhist = 0;
+
+static pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static mrkdata_stats_local_t *locals = NULL;
+static mrkdata_stats_t retired;
+
+/*
+ * Histogram slots are written under stats_mtx, and read with no lock on
+ * the hot path.  The generation of a slot changes whenever it is taken
+ * or released, so that a sample begun before is dropped.
+ */
+static struct {
+    const mrkdata_spec_t *spec;
+    unsigned sample;
+    unsigned gen;
+} hist_specs[MRKDATA_STATS_NHIST];
+
+
+static void
+stats_add(mrkdata_stats_t *dst, const mrkdata_stats_t *src)
+{
+    size_t i, j;
+
+    dst->npacked += src->npacked;
+    dst->bpacked += src->bpacked;
+    dst->nunpacked += src->nunpacked;
+    dst->bunpacked += src->bunpacked;
+    dst->nparsed += src->nparsed;
+    dst->bparsed += src->bparsed;
+    dst->nalloc += src->nalloc;
+    dst->balloc += src->balloc;
+
+    for (i = 0; i < countof(dst->values); ++i) {
+        dst->values[i] += src->values[i];
+    }
+
+    for (i = 0; i < countof(dst->errors); ++i) {
+        dst->errors[i] += src->errors[i];
+    }
+
+    for (i = 0; i < countof(dst->hist); ++i) {
+        if (src->hist[i].spec != NULL) {
+            dst->hist[i].spec = src->hist[i].spec;
+        }
+        for (j = 0; j < MRKDATA_STATS_NBUCKETS; ++j) {
+            dst->hist[i].pack[j] += src->hist[i].pack[j];
+            dst->hist[i].unpack[j] += src->hist[i].unpack[j];
+        }
+    }
+}
+
+
+static void
+stats_local_fini(void *arg)
+{
+    mrkdata_stats_local_t *local = arg;
+
+    pthread_mutex_lock(&stats_mtx);
+    stats_add(&retired, &local->s);
+    if (local->prev != NULL) {
+        local->prev->next = local->next;
+    } else {
+        locals = local->next;
+    }
+    if (local->next != NULL) {
+        local->next->prev = local->prev;
+    }
+    local->prev = NULL;
+    local->next = NULL;
+    local->registered = 0;
+    pthread_mutex_unlock(&stats_mtx);
+}
+
+
+static void
+stats_once_init(void)
+{
+    if (pthread_key_create(&stats_key, stats_local_fini) != 0) {
+        FAIL("pthread_key_create");
+    }
+}
+
+
+mrkdata_stats_t *
+mrkdata_stats_local_init(void)
+{
+    mrkdata_stats_local_t *local = &mrkdata_stats_local;
+
+    pthread_once(&stats_once, stats_once_init);
+
+    pthread_mutex_lock(&stats_mtx);
+    local->prev = NULL;
+    local->next = locals;
+    if (locals != NULL) {
+        locals->prev = local;
+    }
+    locals = local;
+    local->registered = 1;
+    pthread_mutex_unlock(&stats_mtx);
+
+    if (pthread_setspecific(stats_key, local) != 0) {
+        FAIL("pthread_setspecific");
+    }
+
+    return &local->s;
+}
+
+
+int
+mrkdata_stats_sample_begin(const mrkdata_spec_t *spec, struct timespec *ts)
+{
+    int i;
+    mrkdata_stats_local_t *local = &mrkdata_stats_local;
+
+    for (i = 0; i < MRKDATA_STATS_NHIST; ++i) {
+        if (__atomic_load_n(&hist_specs[i].spec, __ATOMIC_ACQUIRE) == spec) {
+            if (local->countdown[i] > 0) {
+                --local->countdown[i];
+                return -1;
+            }
+            local->countdown[i] =
+                __atomic_load_n(&hist_specs[i].sample, __ATOMIC_RELAXED) - 1;
+            local->gen[i] =
+                __atomic_load_n(&hist_specs[i].gen, __ATOMIC_RELAXED);
+            clock_gettime(CLOCK_MONOTONIC, ts);
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void
+mrkdata_stats_sample_end(int slot, int kind, const struct timespec *ts)
+{
+    struct timespec now;
+    uint64_t ns;
+    unsigned bucket;
+    mrkdata_stats_t *st;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (uint64_t)(now.tv_sec - ts->tv_sec) * 1000000000ul +
+         (uint64_t)now.tv_nsec - (uint64_t)ts->tv_nsec;
+
+    bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= MRKDATA_STATS_NBUCKETS) {
+        bucket = MRKDATA_STATS_NBUCKETS - 1;
+    }
+
+    /* the slot has changed hands since */
+    if (mrkdata_stats_local.gen[slot] !=
+        __atomic_load_n(&hist_specs[slot].gen, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    st = MRKDATA_STATS();
+    st->hist[slot].spec =
+        __atomic_load_n(&hist_specs[slot].spec, __ATOMIC_RELAXED);
+    if (kind == MRKDATA_STATS_PACK) {
+        ++st->hist[slot].pack[bucket];
+    } else {
+        ++st->hist[slot].unpack[bucket];
+    }
+}
+
+
+/*
+ * Clear what the previous holder of the slot i has collected.  The
+ * counters of running threads are cleared without synchronization, as
+ * by mrkdata_stats_reset().
+ */
+static void
+hist_clear(int i)
+{
+    mrkdata_stats_local_t *local;
+
+    memset(&retired.hist[i], '\0', sizeof(retired.hist[i]));
+    for (local = locals; local != NULL; local = local->next) {
+        memset(&local->s.hist[i], '\0', sizeof(local->s.hist[i]));
+        local->countdown[i] = 0;
+    }
+}
+
+
+int
+mrkdata_stats_hist_enable(const mrkdata_spec_t *spec, unsigned sample)
+{
+    int i, res = -1;
+
+    if (sample == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&stats_mtx);
+    for (i = 0; i < MRKDATA_STATS_NHIST; ++i) {
+        if (hist_specs[i].spec == spec) {
+            __atomic_store_n(&hist_specs[i].sample, sample, __ATOMIC_RELAXED);
+            res = i;
+            break;
+        }
+    }
+    if (res == -1) {
+        for (i = 0; i < MRKDATA_STATS_NHIST; ++i) {
+            if (hist_specs[i].spec == NULL) {
+                hist_clear(i);
+                __atomic_store_n(&hist_specs[i].sample,
+                                 sample,
+                                 __ATOMIC_RELAXED);
+                __atomic_add_fetch(&hist_specs[i].gen, 1, __ATOMIC_RELEASE);
+                __atomic_store_n(&hist_specs[i].spec, spec, __ATOMIC_RELEASE);
+                __atomic_add_fetch(&mrkdata_stats_nhist, 1, __ATOMIC_RELAXED);
+                res = i;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_mtx);
+    return res;
+}
+
+
+int
+mrkdata_stats_hist_disable(const mrkdata_spec_t *spec)
+{
+    int i, res = -1;
+
+    pthread_mutex_lock(&stats_mtx);
+    for (i = 0; i < MRKDATA_STATS_NHIST; ++i) {
+        if (hist_specs[i].spec == spec) {
+            __atomic_store_n(&hist_specs[i].spec, NULL, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&hist_specs[i].gen, 1, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&mrkdata_stats_nhist, 1, __ATOMIC_RELAXED);
+            res = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_mtx);
+    return res;
+}
+
+
+/*
+ * Counters of running threads are read without synchronization, so a
+ * snapshot may lag behind by the operations in flight.
+ */
+void
+mrkdata_stats_snapshot(mrkdata_stats_t *st)
+{
+    mrkdata_stats_local_t *local;
+
+    memset(st, '\0', sizeof(mrkdata_stats_t));
+
+    pthread_mutex_lock(&stats_mtx);
+    stats_add(st, &retired);
+    for (local = locals; local != NULL; local = local->next) {
+        stats_add(st, &local->s);
+    }
+    pthread_mutex_unlock(&stats_mtx);
+}
+
+
+void
+mrkdata_stats_merge(mrkdata_stats_t *dst, const mrkdata_stats_t *src)
+{
+    stats_add(dst, src);
+}
+
+
+void
+mrkdata_stats_reset(void)
+{
+    mrkdata_stats_local_t *local;
+
+    pthread_mutex_lock(&stats_mtx);
+    memset(&retired, '\0', sizeof(retired));
+    for (local = locals; local != NULL; local = local->next) {
+        memset(&local->s, '\0', sizeof(local->s));
+    }
+    pthread_mutex_unlock(&stats_mtx);
+}
+
+
+int
+mrkdata_stats_dump(const mrkdata_stats_t *st)
+{
+    size_t i, j;
+
+    TRACE("packed=%lu/%lu unpacked=%lu/%lu parsed=%lu/%lu alloc=%lu/%lu",
+          st->npacked, st->bpacked,
+          st->nunpacked, st->bunpacked,
+          st->nparsed, st->bparsed,
+          st->nalloc, st->balloc);
+
+    for (i = 0; i < countof(st->values); ++i) {
+        if (st->values[i] != 0) {
+            TRACE("%s=%lu", MRKDATA_TAG_STR(i), st->values[i]);
+        }
+    }
+
+    for (i = 0; i < countof(st->errors); ++i) {
+        if (st->errors[i] != 0) {
+            TRACE("%s=%lu",
+                  mrkdata_diag_str(MRKDATA_STATS_ERROR_CODE(i)),
+                  st->errors[i]);
+        }
+    }
+
+    for (i = 0; i < countof(st->hist); ++i) {
+        if (st->hist[i].spec == NULL) {
+            continue;
+        }
+        TRACE("hist %p <spec tag=%s>",
+              st->hist[i].spec,
+              MRKDATA_TAG_STR(st->hist[i].spec->tag));
+        for (j = 0; j < MRKDATA_STATS_NBUCKETS; ++j) {
+            if (st->hist[i].pack[j] != 0 || st->hist[i].unpack[j] != 0) {
+                TRACE("  <%luns pack=%lu unpack=%lu",
+                      1ul << j,
+                      st->hist[i].pack[j],
+                      st->hist[i].unpack[j]);
+            }
+        }
+    }
+
+    return 0;
+}
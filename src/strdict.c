@@ -0,0 +1,203 @@
+#include <assert.h>
+#include <string.h>
+#include <sys/endian.h>
+
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Stream string dictionary.
+ *
+ * The writer and the reader of a stream keep the same table of the last
+ * nentries strings written in full, of MRKDATA_STRDICT_MINSZ to
+ * MRKDATA_STRDICT_MAXSZ bytes: a string goes to the entry next, and next
+ * moves on round the table.  A string found in the writer table is
+ * written as a STRREF tag and the 16-bit entry index, and the reader
+ * hands out the datum kept in that entry.
+ *
+ * The writer table keeps its own copies of the strings, since the datums
+ * it is handed are the caller's, and may borrow their bytes.  The reader
+ * table keeps the datums it has unpacked, shared by reference count, so
+ * that a repeated string is not allocated by the reader.  Shared datums
+ * are not to be modified in place, see mrkdata_datum_set_path().
+ */
+
+#define STRDICT_DEFAULT_NENTRIES 4096
+
+static int64_t
+strdict_strsz(const mrkdata_datum_t *dat)
+{
+    switch (dat->spec->tag) {
+    case MRKDATA_STR8:
+        return dat->value.sz8;
+    case MRKDATA_STR16:
+        return dat->value.sz16;
+    case MRKDATA_STR32:
+        return dat->value.sz32;
+    case MRKDATA_STR64:
+        return dat->value.sz64;
+    default:
+        return -1;
+    }
+}
+
+
+static int
+strdict_eligible(const mrkdata_datum_t *dat)
+{
+    int64_t sz = strdict_strsz(dat);
+
+    return sz >= MRKDATA_STRDICT_MINSZ && sz <= MRKDATA_STRDICT_MAXSZ;
+}
+
+
+static uint32_t *
+strdict_bucket(mrkdata_strdict_t *dict, const mrkdata_datum_t *dat)
+{
+    uint64_t h = mrkdata_datum_hash(dat, 0);
+
+    return &dict->index[h & (2 * dict->nentries - 1)];
+}
+
+
+/*
+ * Put dat in the next entry.  The table takes over the reference.
+ */
+static void
+strdict_put(mrkdata_strdict_t *dict, mrkdata_datum_t *dat)
+{
+    unsigned idx = dict->next;
+
+    if (dict->entries[idx] != NULL) {
+        mrkdata_datum_destroy(&dict->entries[idx]);
+    }
+    dict->entries[idx] = dat;
+    dict->next = (idx + 1) & (dict->nentries - 1);
+    if (dict->index != NULL) {
+        *strdict_bucket(dict, dat) = idx + 1;
+    }
+}
+
+
+/*
+ * The table has nentries, rounded up to a power of 2, of at most
+ * MRKDATA_STRDICT_MAXENTRIES, 4096 by default.
+ */
+int
+mrkdata_strdict_init(mrkdata_strdict_t *dict, unsigned nentries)
+{
+    unsigned n;
+
+    if (nentries == 0) {
+        nentries = STRDICT_DEFAULT_NENTRIES;
+    }
+    nentries = MIN(nentries, MRKDATA_STRDICT_MAXENTRIES);
+    for (n = 1; n < nentries; n <<= 1) {
+        ;
+    }
+
+    dict->nentries = n;
+    dict->next = 0;
+    dict->index = NULL;
+    if ((dict->entries = calloc(n, sizeof(mrkdata_datum_t *))) == NULL) {
+        FAIL("calloc");
+    }
+    MRKDATA_STATS_ALLOC(n * sizeof(mrkdata_datum_t *));
+    return 0;
+}
+
+
+int
+mrkdata_strdict_fini(mrkdata_strdict_t *dict)
+{
+    unsigned i;
+
+    if (dict->entries != NULL) {
+        for (i = 0; i < dict->nentries; ++i) {
+            mrkdata_datum_destroy(&dict->entries[i]);
+        }
+        free(dict->entries);
+        dict->entries = NULL;
+    }
+    if (dict->index != NULL) {
+        free(dict->index);
+        dict->index = NULL;
+    }
+    return 0;
+}
+
+
+/*
+ * Write the reference to the string dat at buf if it is in the table,
+ * and return its size.  Otherwise, the string is written in full, and
+ * it is put in the table.
+ */
+ssize_t
+mrkdata_strdict_pack_ref(mrkdata_strdict_t *dict,
+                         const mrkdata_datum_t *dat,
+                         unsigned char *buf)
+{
+    mrkdata_datum_t *ent;
+    uint32_t *bucket;
+    int64_t sz;
+    char *str;
+
+    if (!strdict_eligible(dat)) {
+        return 0;
+    }
+
+    if (dict->index == NULL) {
+        if ((dict->index = calloc(2 * dict->nentries,
+                                  sizeof(uint32_t))) == NULL) {
+            FAIL("calloc");
+        }
+        MRKDATA_STATS_ALLOC(2 * dict->nentries * sizeof(uint32_t));
+    }
+
+    bucket = strdict_bucket(dict, dat);
+    sz = strdict_strsz(dat);
+    if (*bucket > 0 &&
+        (ent = dict->entries[*bucket - 1]) != NULL &&
+        ent->spec->tag == dat->spec->tag &&
+        strdict_strsz(ent) == sz &&
+        memcmp(ent->data.str, dat->data.str, sz) == 0) {
+        buf[0] = MRKDATA_STRREF;
+        *((uint16_t *)(buf + 1)) = htobe16(*bucket - 1);
+        return MRKDATA_EXPECT_SZ(MRKDATA_STRREF);
+    }
+
+    if ((str = malloc(sz)) == NULL) {
+        FAIL("malloc");
+    }
+    MRKDATA_STATS_ALLOC(sz);
+    memcpy(str, dat->data.str, sz);
+    strdict_put(dict, mrkdata_datum_adopt_str(dat->spec->tag, str, sz, NULL));
+    return 0;
+}
+
+
+/*
+ * The string of the reference at p, or NULL.
+ */
+mrkdata_datum_t *
+mrkdata_strdict_get(mrkdata_strdict_t *dict, const unsigned char *p)
+{
+    unsigned idx = be16toh(*((const uint16_t *)p));
+
+    return idx < dict->nentries ? dict->entries[idx] : NULL;
+}
+
+
+/*
+ * Put the string dat just read in full in the table.
+ */
+void
+mrkdata_strdict_add(mrkdata_strdict_t *dict, mrkdata_datum_t *dat)
+{
+    if (strdict_eligible(dat)) {
+        strdict_put(dict, mrkdata_datum_clone(dat));
+    }
+}
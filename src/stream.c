@@ -0,0 +1,519 @@
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/endian.h>
+#include <unistd.h>
+
+#include <mrkcommon/array.h>
+#include <mrkcommon/dumpm.h>
+#include <mrkcommon/util.h>
+
+#include "diag.h"
+#include "mrkdata_private.h"
+
+/*
+ * Record streams with streamed strings.
+ *
+ * The records are plain records, written to and read from a descriptor
+ * through a buffer of bufsz bytes.  A STR64 datum made with
+ * mrkdata_datum_make_str64_stream() has its length but no body: the
+ * writer puts its header, then asks the fill callback for the body,
+ * straight into the buffer, a buffer at a time.  The reader does not
+ * keep the body of a STR64 that does not fit in its buffer: it gives
+ * it to the chunk callback as it comes, and leaves a streamed STR64 in
+ * the record.  Either way, memory does not grow with the strings.
+ *
+ * Other elements are packed and unpacked as usual, STRUCTs and SEQs
+ * one field at a time.  The writer puts an in-memory string larger than
+ * the buffer from its own bytes, a buffer at a time, so only the reader
+ * of a string other than a STR64 larger than its buffer needs room of
+ * its own, up to maxbufsz.
+ */
+
+#define STREAM_DEFAULT_BUFSZ (64 * 1024)
+#define STREAM_DEFAULT_MAXBUFSZ (64 * 1024 * 1024)
+#define STREAM_HDRSZ MRKDATA_EXPECT_SZ(MRKDATA_STR64)
+
+
+/* writer */
+
+int
+mrkdata_swriter_init(mrkdata_swriter_t *w,
+                     int fd,
+                     ssize_t bufsz,
+                     mrkdata_fill_cb_t fill,
+                     void *udata)
+{
+    w->fd = fd;
+    w->bufsz = bufsz > STREAM_HDRSZ ? bufsz : STREAM_DEFAULT_BUFSZ;
+    if ((w->buf = malloc(w->bufsz)) == NULL) {
+        FAIL("malloc");
+    }
+    w->pos = 0;
+    w->fill = fill;
+    w->udata = udata;
+    return 0;
+}
+
+
+int
+mrkdata_swriter_flush(mrkdata_swriter_t *w)
+{
+    const unsigned char *p = w->buf;
+
+    while (w->pos > 0) {
+        ssize_t nwritten;
+
+        if ((nwritten = write(w->fd, p, w->pos)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            memmove(w->buf, p, w->pos);
+            TRRET(MRKDATA_SWRITER_FLUSH + 1);
+        }
+        p += nwritten;
+        w->pos -= nwritten;
+    }
+    return 0;
+}
+
+
+static int
+swriter_put(mrkdata_swriter_t *w, const unsigned char *p, ssize_t sz)
+{
+    while (sz > 0) {
+        ssize_t n;
+
+        if (w->pos == w->bufsz && mrkdata_swriter_flush(w) != 0) {
+            return -1;
+        }
+        n = MIN(sz, w->bufsz - w->pos);
+        memcpy(w->buf + w->pos, p, n);
+        w->pos += n;
+        p += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+
+static int
+swriter_header(mrkdata_swriter_t *w, mrkdata_tag_t tag, int64_t len)
+{
+    unsigned char hdr[STREAM_HDRSZ];
+
+    hdr[0] = tag;
+    *((int64_t *)(hdr + 1)) = htobe64(len);
+    return swriter_put(w, hdr, sizeof(hdr));
+}
+
+
+/*
+ * Tag and length of an in-memory string.
+ */
+static int
+swriter_str_header(mrkdata_swriter_t *w, const mrkdata_datum_t *dat)
+{
+    unsigned char hdr[STREAM_HDRSZ];
+
+    hdr[0] = dat->spec->tag;
+    switch (dat->spec->tag) {
+    case MRKDATA_STR8:
+        hdr[1] = dat->value.sz8;
+        break;
+
+    case MRKDATA_STR16:
+        *((int16_t *)(hdr + 1)) = htobe16(dat->value.sz16);
+        break;
+
+    case MRKDATA_STR32:
+        *((int32_t *)(hdr + 1)) = htobe32(dat->value.sz32);
+        break;
+
+    case MRKDATA_STR64:
+        *((int64_t *)(hdr + 1)) = htobe64(dat->value.sz64);
+        break;
+
+    default:
+        return -1;
+    }
+    return swriter_put(w, hdr, MRKDATA_EXPECT_SZ(dat->spec->tag));
+}
+
+
+static int
+swriter_body(mrkdata_swriter_t *w, const mrkdata_datum_t *dat)
+{
+    int64_t left = dat->value.sz64;
+
+    if (w->fill == NULL) {
+        return -1;
+    }
+    while (left > 0) {
+        ssize_t n, nfilled;
+
+        if (w->pos == w->bufsz && mrkdata_swriter_flush(w) != 0) {
+            return -1;
+        }
+        n = MIN(left, w->bufsz - w->pos);
+        if ((nfilled = w->fill(dat, w->buf + w->pos, n, w->udata)) <= 0 ||
+            nfilled > n) {
+            return -1;
+        }
+        w->pos += nfilled;
+        left -= nfilled;
+    }
+    return 0;
+}
+
+
+static int
+swriter_elem(mrkdata_swriter_t *w, const mrkdata_datum_t *dat)
+{
+    if (dat == NULL) {
+        return -1;
+    }
+
+    if (MRKDATA_STREAMED(dat)) {
+        if (swriter_header(w, MRKDATA_STR64, dat->value.sz64) != 0) {
+            return -1;
+        }
+        return swriter_body(w, dat);
+
+    } else if (dat->spec->tag == MRKDATA_STRUCT ||
+               dat->spec->tag == MRKDATA_SEQ) {
+        mrkdata_datum_t **field;
+        mnarray_iter_t it;
+
+        if (swriter_header(w, dat->spec->tag, dat->value.sz64) != 0) {
+            return -1;
+        }
+        for (field = array_first(&dat->data.fields, &it);
+             field != NULL;
+             field = array_next(&dat->data.fields, &it)) {
+            if (swriter_elem(w, *field) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+
+    } else if (dat->packsz <= w->bufsz) {
+        if (dat->packsz > w->bufsz - w->pos &&
+            mrkdata_swriter_flush(w) != 0) {
+            return -1;
+        }
+        if (mrkdata_pack_elem(dat,
+                              w->buf + w->pos,
+                              w->bufsz - w->pos) != dat->packsz) {
+            return -1;
+        }
+        w->pos += dat->packsz;
+        return 0;
+
+    } else {
+        /* a string larger than the buffer, put from its own bytes */
+        if (swriter_str_header(w, dat) != 0) {
+            return -1;
+        }
+        return swriter_put(w,
+                           (const unsigned char *)dat->data.str,
+                           dat->packsz - MRKDATA_EXPECT_SZ(dat->spec->tag));
+    }
+}
+
+
+/*
+ * Write dat as the next record of the stream.  The bodies of its
+ * streamed strings come from the fill callback.  The record may stay in
+ * the buffer until the next flush.
+ */
+int
+mrkdata_swriter_write(mrkdata_swriter_t *w, const mrkdata_datum_t *dat)
+{
+    mrkdata_stats_t *st;
+
+    if (swriter_elem(w, dat) != 0) {
+        TRRET(MRKDATA_SWRITER_WRITE + 1);
+    }
+    st = MRKDATA_STATS();
+    ++st->npacked;
+    st->bpacked += dat->packsz;
+    return 0;
+}
+
+
+/*
+ * Flush and release the writer.  The file descriptor is left open.
+ */
+int
+mrkdata_swriter_fini(mrkdata_swriter_t *w)
+{
+    int res = 0;
+
+    if (mrkdata_swriter_flush(w) != 0) {
+        res = MRKDATA_SWRITER_FINI + 1;
+    }
+    free(w->buf);
+    w->buf = NULL;
+    TRRET(res);
+}
+
+
+/*
+ * Fill callback reading the bodies from the descriptor in udata, cast
+ * from an int.
+ */
+ssize_t
+mrkdata_fill_fd(UNUSED const mrkdata_datum_t *dat,
+                unsigned char *buf,
+                ssize_t sz,
+                void *udata)
+{
+    ssize_t nread;
+
+    while ((nread = read((int)(intptr_t)udata, buf, sz)) < 0) {
+        if (errno != EINTR) {
+            break;
+        }
+    }
+    return nread;
+}
+
+
+/* reader */
+
+int
+mrkdata_sreader_init(mrkdata_sreader_t *r,
+                     int fd,
+                     ssize_t bufsz,
+                     mrkdata_chunk_cb_t chunk,
+                     void *udata)
+{
+    r->fd = fd;
+    r->bufsz = bufsz > STREAM_HDRSZ ? bufsz : STREAM_DEFAULT_BUFSZ;
+    if ((r->buf = malloc(r->bufsz)) == NULL) {
+        FAIL("malloc");
+    }
+    r->pos = 0;
+    r->end = 0;
+    r->maxbufsz = MAX(r->bufsz, STREAM_DEFAULT_MAXBUFSZ);
+    r->chunk = chunk;
+    r->udata = udata;
+    return 0;
+}
+
+
+/*
+ * Have at least n unread bytes in the buffer, growing it up to maxbufsz
+ * if n does not fit.  Return 0, 1 at the end of the stream, or -1.
+ */
+static int
+sreader_need(mrkdata_sreader_t *r, ssize_t n)
+{
+    if (r->end - r->pos >= n) {
+        return 0;
+    }
+
+    memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+    r->end -= r->pos;
+    r->pos = 0;
+
+    if (n > r->bufsz) {
+        unsigned char *buf;
+
+        /* the length comes from the stream */
+        if (n > r->maxbufsz || (buf = realloc(r->buf, n)) == NULL) {
+            return -1;
+        }
+        r->buf = buf;
+        r->bufsz = n;
+    }
+
+    while (r->end < n) {
+        ssize_t nread;
+
+        if ((nread = read(r->fd,
+                          r->buf + r->end,
+                          r->bufsz - r->end)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (nread == 0) {
+            return 1;
+        }
+        r->end += nread;
+    }
+    return 0;
+}
+
+
+static int
+sreader_body(mrkdata_sreader_t *r, const mrkdata_datum_t *dat)
+{
+    int64_t left = dat->value.sz64;
+
+    if (r->chunk == NULL) {
+        return -1;
+    }
+    while (left > 0) {
+        ssize_t n;
+
+        if (r->pos == r->end && sreader_need(r, 1) != 0) {
+            return -1;
+        }
+        n = MIN(left, r->end - r->pos);
+        if (r->chunk(dat, r->buf + r->pos, n, r->udata) != 0) {
+            return -1;
+        }
+        r->pos += n;
+        left -= n;
+    }
+    return 0;
+}
+
+
+/*
+ * Read an element of spec of at most left bytes.  Return its size, or
+ * 0.
+ */
+static ssize_t
+sreader_elem(mrkdata_sreader_t *r,
+             const mrkdata_spec_t *spec,
+             ssize_t left,
+             unsigned depth,
+             mrkdata_datum_t **pdat)
+{
+    ssize_t sz;
+    mrkdata_tag_t tag;
+
+    if (depth > MRKDATA_MAXDEPTH ||
+        sreader_need(r, 1) != 0 ||
+        (tag = r->buf[r->pos]) != spec->tag ||
+        !MRKDATA_TAG_SUPPORTED(tag) ||
+        sreader_need(r, MRKDATA_EXPECT_SZ(tag)) != 0 ||
+        (sz = mrkdata_buf_size(r->buf + r->pos, r->end - r->pos)) <= 0 ||
+        sz > left) {
+        return 0;
+    }
+
+    if (tag == MRKDATA_STR64 && sz - STREAM_HDRSZ >= r->bufsz) {
+        *pdat = mrkdata_datum_make_str64_stream(sz - STREAM_HDRSZ);
+        r->pos += STREAM_HDRSZ;
+        return sreader_body(r, *pdat) == 0 ? sz : 0;
+
+    } else if (tag == MRKDATA_STRUCT || tag == MRKDATA_SEQ) {
+        mrkdata_spec_t **field_spec;
+        ssize_t off = STREAM_HDRSZ;
+        unsigned i = 0;
+
+        *pdat = mrkdata_datum_from_spec((mrkdata_spec_t *)spec, NULL, 0);
+        r->pos += STREAM_HDRSZ;
+        while (off < sz) {
+            mrkdata_datum_t *field = NULL;
+            ssize_t nread;
+
+            if ((field_spec = array_get(&spec->fields,
+                                        tag == MRKDATA_SEQ ? 0 : i)) ==
+                NULL) {
+                return 0;
+            }
+            if ((nread = sreader_elem(r,
+                                      *field_spec,
+                                      sz - off,
+                                      depth + 1,
+                                      &field)) == 0) {
+                mrkdata_datum_destroy(&field);
+                return 0;
+            }
+            mrkdata_datum_add_field(*pdat, field);
+            off += nread;
+            ++i;
+        }
+        if (tag == MRKDATA_STRUCT && i != spec->fields.elnum) {
+            return 0;
+        }
+        return sz;
+
+    } else {
+        if (sreader_need(r, sz) != 0 ||
+            mrkdata_unpack_elem(spec, r->buf + r->pos, sz, pdat) != sz) {
+            return 0;
+        }
+        r->pos += sz;
+        return sz;
+    }
+}
+
+
+/*
+ * Read the next record of spec into *pdat.  STR64 bodies that do not
+ * fit in the buffer go to the chunk callback, as they come.  At the end
+ * of the stream, return 0 with *pdat NULL.
+ */
+int
+mrkdata_sreader_read(mrkdata_sreader_t *r,
+                     const mrkdata_spec_t *spec,
+                     mrkdata_datum_t **pdat)
+{
+    ssize_t sz;
+    int res;
+    mrkdata_stats_t *st;
+
+    assert(*pdat == NULL);
+
+    if ((res = sreader_need(r, 1)) != 0) {
+        if (res == 1 && r->pos == r->end) {
+            return 0;
+        }
+        TRRET(MRKDATA_SREADER_READ + 1);
+    }
+
+    if ((sz = sreader_elem(r, spec, SSIZE_MAX, 0, pdat)) == 0) {
+        mrkdata_datum_destroy(pdat);
+        TRRET(MRKDATA_SREADER_READ + 2);
+    }
+    st = MRKDATA_STATS();
+    ++st->nunpacked;
+    st->bunpacked += sz;
+    return 0;
+}
+
+
+int
+mrkdata_sreader_fini(mrkdata_sreader_t *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+    return 0;
+}
+
+
+/*
+ * Chunk callback appending the bodies to the descriptor in udata, cast
+ * from an int.
+ */
+int
+mrkdata_chunk_fd(UNUSED const mrkdata_datum_t *dat,
+                 const unsigned char *buf,
+                 ssize_t sz,
+                 void *udata)
+{
+    while (sz > 0) {
+        ssize_t nwritten;
+
+        if ((nwritten = write((int)(intptr_t)udata, buf, sz)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += nwritten;
+        sz -= nwritten;
+    }
+    return 0;
+}